@@ -0,0 +1,648 @@
+/*
+ * bcache-analyze: walk the btree of an offline cache device, and report
+ * what's cached for each backing device and how full the buckets are
+ *
+ * GPLv2
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#include "bcache.h"
+
+#define MAX_DEPTH	8
+
+/* A node still to be read; the key is copied since its node is freed */
+struct pending {
+	BKEY_PADDED(key);
+	unsigned	level;
+};
+
+struct inode_stats {
+	uint64_t	extents;
+	uint64_t	sectors;
+	uint64_t	dirty;
+};
+
+/* Per worker, merged at the end so the walk doesn't share counters */
+struct walk_stats {
+	uint64_t		nodes[MAX_DEPTH];
+	uint64_t		bsets;
+	uint64_t		written;	/* blocks */
+	uint64_t		stale;
+	uint64_t		other_dev;
+	uint64_t		bad_nodes;
+
+	struct inode_stats	*inodes;
+	size_t			nr_inodes;
+};
+
+enum bucket_type {
+	BUCKET_FREE,
+	BUCKET_DATA,
+	BUCKET_DIRTY,
+	BUCKET_BTREE,
+	BUCKET_META,	/* journal and uuids */
+};
+
+static struct {
+	struct cache_sb		sb;
+	int			fd;
+	size_t			node_bytes;
+
+	uint8_t			*gens;
+	uint32_t		*live;		/* sectors, per bucket */
+	uint8_t			*type;		/* enum bucket_type */
+
+	/* the walk: a stack, so it goes depth first and stays small */
+	struct pending		*stack;
+	size_t			nr, size;
+	unsigned		active;
+	int			error;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+} a = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.cond	= PTHREAD_COND_INITIALIZER,
+};
+
+static bool ptr_ok(struct walk_stats *s, const struct bkey *k, unsigned i)
+{
+	uint64_t b = PTR_OFFSET(k, i) / a.sb.bucket_size;
+
+	if (PTR_DEV(k, i) != a.sb.nr_this_dev) {
+		s->other_dev++;
+		return false;
+	}
+
+	if (b >= a.sb.nbuckets || gen_after(a.gens[b], PTR_GEN(k, i))) {
+		s->stale++;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Children are pushed in order, and get the kernel readahead started on
+ * them right away; by the time a worker pops one it's usually in memory.
+ */
+static void push(const struct bkey *k, unsigned level)
+{
+	struct pending *p;
+
+	pthread_mutex_lock(&a.lock);
+
+	if (a.nr == a.size) {
+		a.size = a.size ? a.size * 2 : 256;
+		p = realloc(a.stack, a.size * sizeof(*p));
+		if (!p) {
+			a.error = -ENOMEM;
+			pthread_mutex_unlock(&a.lock);
+			return;
+		}
+		a.stack = p;
+	}
+
+	p = &a.stack[a.nr++];
+	memcpy(&p->key, k, bkey_u64s(k) * sizeof(uint64_t));
+	p->level = level;
+
+	pthread_cond_signal(&a.cond);
+	pthread_mutex_unlock(&a.lock);
+
+	posix_fadvise(a.fd, PTR_OFFSET(k, 0) << 9, a.node_bytes,
+		      POSIX_FADV_WILLNEED);
+}
+
+static bool pop(struct pending *p)
+{
+	pthread_mutex_lock(&a.lock);
+
+	while (!a.nr && a.active && !a.error)
+		pthread_cond_wait(&a.cond, &a.lock);
+
+	if (!a.nr || a.error) {
+		/* nothing left, and nobody left to add more */
+		pthread_cond_broadcast(&a.cond);
+		pthread_mutex_unlock(&a.lock);
+		return false;
+	}
+
+	*p = a.stack[--a.nr];
+	a.active++;
+	pthread_mutex_unlock(&a.lock);
+	return true;
+}
+
+static void done(void)
+{
+	pthread_mutex_lock(&a.lock);
+	if (!--a.active)
+		pthread_cond_broadcast(&a.cond);
+	pthread_mutex_unlock(&a.lock);
+}
+
+struct walk_ctx {
+	struct walk_stats	*s;
+	unsigned		level;
+};
+
+static void interior_key(const struct bkey *k, uint64_t start, uint64_t end,
+			 void *arg)
+{
+	struct walk_ctx *ctx = arg;
+
+	if (ptr_ok(ctx->s, k, 0))
+		push(k, ctx->level - 1);
+}
+
+static void leaf_key(const struct bkey *k, uint64_t start, uint64_t end,
+		     void *arg)
+{
+	struct walk_ctx *ctx = arg;
+	struct walk_stats *s = ctx->s;
+	uint64_t inode = KEY_INODE(k), sectors = end - start;
+	bool live = false;
+	unsigned i;
+
+	for (i = 0; i < KEY_PTRS(k); i++) {
+		uint64_t b = PTR_OFFSET(k, i) / a.sb.bucket_size;
+
+		if (!ptr_ok(s, k, i))
+			continue;
+
+		__sync_fetch_and_add(&a.live[b], sectors);
+		if (KEY_DIRTY(k))
+			a.type[b] = BUCKET_DIRTY;
+		else
+			__sync_bool_compare_and_swap(&a.type[b], BUCKET_FREE,
+						     BUCKET_DATA);
+		live = true;
+	}
+
+	if (!live)
+		return;
+
+	if (inode >= s->nr_inodes) {
+		size_t nr = MAX(inode + 1, s->nr_inodes * 2);
+		struct inode_stats *n = realloc(s->inodes, nr * sizeof(*n));
+
+		if (!n) {
+			a.error = -ENOMEM;
+			return;
+		}
+
+		memset(n + s->nr_inodes, 0,
+		       (nr - s->nr_inodes) * sizeof(*n));
+		s->inodes = n;
+		s->nr_inodes = nr;
+	}
+
+	s->inodes[inode].extents++;
+	s->inodes[inode].sectors += sectors;
+	if (KEY_DIRTY(k))
+		s->inodes[inode].dirty += sectors;
+}
+
+static void *walker(void *arg)
+{
+	struct walk_stats *s = arg;
+	struct btree_node b = { 0 };
+	struct pending p;
+	const char *err;
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, a.node_bytes)) {
+		a.error = -ENOMEM;
+		return NULL;
+	}
+
+	while (pop(&p)) {
+		struct walk_ctx ctx = { s, p.level };
+		off_t offset = PTR_OFFSET(&p.key, 0) << 9;
+		ssize_t ret;
+
+		a.type[PTR_OFFSET(&p.key, 0) / a.sb.bucket_size] = BUCKET_BTREE;
+
+		ret = pread(a.fd, buf, a.node_bytes, offset);
+		if (ret != a.node_bytes) {
+			err = "read error";
+			goto bad;
+		}
+
+		if (btree_node_check(&a.sb, &p.key, buf, &b, &err))
+			goto bad;
+
+		s->nodes[MIN(p.level, MAX_DEPTH - 1)]++;
+		s->bsets	+= b.nr_bsets;
+		s->written	+= b.written;
+
+		if (btree_node_for_each_live(&b, p.level,
+					     p.level ? interior_key : leaf_key,
+					     &ctx))
+			a.error = -ENOMEM;
+		done();
+		continue;
+bad:
+		{
+			char key[256];
+
+			bkey_to_text(key, sizeof(key), &p.key);
+			fprintf(stderr, "Bad btree node at %s level %u: %s\n",
+				key, p.level, err);
+		}
+		s->bad_nodes++;
+		done();
+	}
+
+	free(b.bsets);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * The journal's keys are replayed into the btree at register time; those
+ * newer than what's in the btree aren't in the walk, so just say how many.
+ */
+struct journal_stats {
+	struct jset	newest;
+	uint64_t	entries;
+	uint64_t	*seqs;		/* seq and u64s of keys, per entry */
+	size_t		nr, size;
+};
+
+static void journal_entry(struct jset *i, void *arg)
+{
+	struct journal_stats *j = arg;
+
+	j->entries++;
+	if (i->seq > j->newest.seq)
+		memcpy(&j->newest, i, sizeof(j->newest));
+
+	if (j->nr + 2 > j->size) {
+		uint64_t *n;
+
+		j->size = j->size ? j->size * 2 : 512;
+		n = realloc(j->seqs, j->size * sizeof(*n));
+		if (!n)
+			return;
+		j->seqs = n;
+	}
+
+	j->seqs[j->nr++] = i->seq;
+	j->seqs[j->nr++] = i->keys;
+}
+
+static struct uuid_entry *read_uuids(const struct bkey *k, size_t *nr)
+{
+	size_t bytes = (KEY_SIZE(k) ?: a.sb.bucket_size) * 512UL;
+	struct uuid_entry *u;
+
+	*nr = 0;
+	if (!KEY_PTRS(k) || PTR_DEV(k, 0) != a.sb.nr_this_dev ||
+	    PTR_OFFSET(k, 0) / a.sb.bucket_size >= a.sb.nbuckets)
+		return NULL;
+
+	u = malloc(bytes);
+	if (!u)
+		return NULL;
+
+	if (pread(a.fd, u, bytes, PTR_OFFSET(k, 0) << 9) != bytes) {
+		free(u);
+		return NULL;
+	}
+
+	a.type[PTR_OFFSET(k, 0) / a.sb.bucket_size] = BUCKET_META;
+	*nr = bytes / sizeof(*u);
+	return u;
+}
+
+static void print_inodes(struct walk_stats *s, struct uuid_entry *u,
+			 size_t nr_uuids)
+{
+	char uuid[40];
+	unsigned i;
+
+	printf("\n%-6s %-36s %-16s %-5s %10s %12s %12s %12s\n",
+	       "inode", "uuid", "label", "type", "extents", "cached MB",
+	       "dirty MB", "clean MB");
+
+	for (i = 0; i < s->nr_inodes; i++) {
+		struct inode_stats *n = &s->inodes[i];
+		struct uuid_entry *e = i < nr_uuids ? &u[i] : NULL;
+
+		if (!n->extents)
+			continue;
+
+		if (e)
+			uuid_unparse(e->uuid, uuid);
+		else
+			strcpy(uuid, "?");
+
+		printf("%-6u %-36s %-16.16s %-5s %10" PRIu64
+		       " %12.1f %12.1f %12.1f\n",
+		       i, uuid, e ? (char *) e->label : "",
+		       !e ? "?" : UUID_FLASH_ONLY(e) ? "flash" : "bdev",
+		       n->extents, n->sectors / 2048.0, n->dirty / 2048.0,
+		       (n->sectors - n->dirty) / 2048.0);
+	}
+}
+
+/*
+ * How full the buckets are is what garbage collection works from: a bucket
+ * with little live data left costs a bucket's worth of space to keep.
+ */
+static void print_buckets(void)
+{
+	uint64_t fill[11] = { 0 }, count[BUCKET_META + 1] = { 0 };
+	uint64_t data = 0, live = 0, sparse = 0, sparse_free = 0;
+	unsigned bucket_size = a.sb.bucket_size;
+	uint64_t b, nr = a.sb.nbuckets - a.sb.first_bucket;
+	unsigned i;
+
+	for (b = a.sb.first_bucket; b < a.sb.nbuckets; b++) {
+		uint32_t l = MIN(a.live[b], bucket_size);
+
+		count[a.type[b]]++;
+		if (a.type[b] != BUCKET_DATA && a.type[b] != BUCKET_DIRTY)
+			continue;
+
+		fill[l ? 1 + (l * 10 - 1) / bucket_size : 0]++;
+		data++;
+		live += l;
+
+		if (l * 2 < bucket_size) {
+			sparse++;
+			sparse_free += bucket_size - l;
+		}
+	}
+
+	printf("\nbuckets: %" PRIu64 " total, %" PRIu64 " free, %" PRIu64
+	       " clean, %" PRIu64 " dirty, %" PRIu64 " btree, %" PRIu64
+	       " journal/uuids\n", nr, count[BUCKET_FREE], count[BUCKET_DATA],
+	       count[BUCKET_DIRTY], count[BUCKET_BTREE], count[BUCKET_META]);
+
+	if (!data)
+		return;
+
+	printf("\ndata bucket fill:\n");
+	printf("  %7s %10" PRIu64 "\n", "0%", fill[0]);
+	for (i = 1; i <= 10; i++)
+		printf("  %3u-%3u%% %9" PRIu64 " %5.1f%%\n",
+		       (i - 1) * 10, i * 10, fill[i], fill[i] * 100.0 / data);
+
+	printf("\nlive data %.1f MB in %.1f MB of buckets, %.1f%% used\n",
+	       live / 2048.0, data * bucket_size / 2048.0,
+	       live * 100.0 / (data * bucket_size));
+	printf("%" PRIu64 " buckets under half full, %.1f MB reclaimable by gc\n",
+	       sparse, sparse_free / 2048.0);
+}
+
+static void print_btree(struct walk_stats *s, unsigned depth)
+{
+	uint64_t nodes = 0, blocks = btree_bytes(&a.sb) / (a.sb.block_size * 512);
+	int l;
+
+	for (l = depth - 1; l >= 0; l--) {
+		printf("  level %d: %" PRIu64 " nodes\n", l, s->nodes[l]);
+		nodes += s->nodes[l];
+	}
+
+	if (nodes)
+		printf("  %.1f bsets per node, nodes %.1f%% written\n",
+		       (double) s->bsets / nodes,
+		       s->written * 100.0 / (nodes * blocks));
+
+	printf("  %" PRIu64 " bad nodes, %" PRIu64 " stale pointers, %"
+	       PRIu64 " to other caches\n",
+	       s->bad_nodes, s->stale, s->other_dev);
+}
+
+static void merge_stats(struct walk_stats *to, struct walk_stats *from)
+{
+	size_t i;
+
+	for (i = 0; i < MAX_DEPTH; i++)
+		to->nodes[i] += from->nodes[i];
+
+	to->bsets	+= from->bsets;
+	to->written	+= from->written;
+	to->stale	+= from->stale;
+	to->other_dev	+= from->other_dev;
+	to->bad_nodes	+= from->bad_nodes;
+
+	if (from->nr_inodes > to->nr_inodes) {
+		struct inode_stats *n = realloc(to->inodes,
+				from->nr_inodes * sizeof(*n));
+
+		if (!n) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		memset(n + to->nr_inodes, 0,
+		       (from->nr_inodes - to->nr_inodes) * sizeof(*n));
+		to->inodes = n;
+		to->nr_inodes = from->nr_inodes;
+	}
+
+	for (i = 0; i < from->nr_inodes; i++) {
+		to->inodes[i].extents	+= from->inodes[i].extents;
+		to->inodes[i].sectors	+= from->inodes[i].sectors;
+		to->inodes[i].dirty	+= from->inodes[i].dirty;
+	}
+
+	free(from->inodes);
+}
+
+static int read_sb(const char *dev)
+{
+	struct cache_sb *sb = &a.sb;
+
+	if (sb_read(a.fd, 0, sb)) {
+		fprintf(stderr, "Couldn't read superblock of %s\n", dev);
+		return -1;
+	}
+
+	switch (sb_check(sb)) {
+	case SB_OK:
+		break;
+	case SB_BAD_CSUM:
+		fprintf(stderr, "Bad superblock csum on %s\n", dev);
+		return -1;
+	default:
+		fprintf(stderr, "%s is not a bcache device\n", dev);
+		return -1;
+	}
+
+	if (SB_IS_BDEV(sb)) {
+		fprintf(stderr, "%s is a backing device, it has no btree\n",
+			dev);
+		return -1;
+	}
+
+	if (!sb->bucket_size || !sb->block_size ||
+	    sb->nbuckets <= sb->first_bucket ||
+	    sb->nr_this_dev >= MAX_CACHES_PER_SET) {
+		fprintf(stderr, "Bad cache geometry on %s\n", dev);
+		return -1;
+	}
+
+	if (!CACHE_SYNC(sb))
+		fprintf(stderr, "Warning: %s was never synced, its btree "
+			"is probably empty\n", dev);
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: bcache-analyze [-j jobs] device\n"
+		"	-j jobs	btree nodes to read in parallel (default 8)\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct journal_stats j = { .newest.seq = 0 };
+	struct walk_stats total = { { 0 } }, *stats;
+	struct uuid_entry *uuids;
+	struct bkey *root;
+	uint64_t pending_keys = 0, pending_entries = 0;
+	unsigned jobs = 8, i, started;
+	size_t nr_uuids;
+	pthread_t *threads;
+	char buf[256];
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "j:h")) != -1)
+		switch (c) {
+		case 'j':
+			jobs = atoi(optarg);
+			if (!jobs)
+				usage();
+			break;
+		default:
+			usage();
+		}
+
+	if (argc - optind != 1)
+		usage();
+
+	a.fd = open(argv[optind], O_RDONLY);
+	if (a.fd < 0) {
+		perror("Can't open dev");
+		exit(EXIT_FAILURE);
+	}
+
+	if (read_sb(argv[optind]))
+		exit(EXIT_FAILURE);
+
+	a.node_bytes = btree_bytes(&a.sb);
+
+	printf("cache: %" PRIu64 " buckets of %u KB, block %u KB, "
+	       "btree nodes %zu KB\n", a.sb.nbuckets, a.sb.bucket_size / 2,
+	       a.sb.block_size / 2, a.node_bytes >> 10);
+
+	a.gens	= calloc(a.sb.nbuckets, sizeof(*a.gens));
+	a.live	= calloc(a.sb.nbuckets, sizeof(*a.live));
+	a.type	= calloc(a.sb.nbuckets, sizeof(*a.type));
+	threads	= calloc(jobs, sizeof(*threads));
+	stats	= calloc(jobs, sizeof(*stats));
+	if (!a.gens || !a.live || !a.type || !threads || !stats) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = journal_read(a.fd, &a.sb, journal_entry, &j);
+	if (ret) {
+		fprintf(stderr, "Error reading journal: %s\n", strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	if (!j.newest.seq) {
+		fprintf(stderr, "No journal entries, so no btree root\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < a.sb.njournal_buckets; i++)
+		if (a.sb.d[i] < a.sb.nbuckets)
+			a.type[a.sb.d[i]] = BUCKET_META;
+
+	for (i = 0; i < j.nr; i += 2)
+		if (j.seqs[i] >= j.newest.last_seq) {
+			pending_entries++;
+			pending_keys += j.seqs[i + 1];
+		}
+
+	printf("journal: %" PRIu64 " entries, seq %" PRIu64 ", replay from %"
+	       PRIu64 ": %" PRIu64 " entries, %" PRIu64 " u64s of keys not "
+	       "counted below\n", j.entries, j.newest.seq, j.newest.last_seq,
+	       pending_entries, pending_keys);
+
+	ret = prio_read(a.fd, &a.sb, j.newest.prio_bucket[a.sb.nr_this_dev],
+			a.gens);
+	if (ret) {
+		fprintf(stderr, "Error reading bucket gens: %s\n",
+			strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	uuids = read_uuids(&j.newest.uuid_bucket, &nr_uuids);
+	if (!uuids)
+		fprintf(stderr, "Warning: couldn't read uuids\n");
+
+	root = &j.newest.btree_root;
+	bkey_to_text(buf, sizeof(buf), root);
+	printf("btree: root level %u, %s\n", j.newest.btree_level, buf);
+
+	if (j.newest.btree_level >= MAX_DEPTH || !KEY_PTRS(root) ||
+	    !ptr_ok(&total, root, 0)) {
+		fprintf(stderr, "Bad btree root\n");
+		exit(EXIT_FAILURE);
+	}
+
+	push(root, j.newest.btree_level);
+
+	for (started = 0; started < jobs; started++)
+		if (pthread_create(&threads[started], NULL, walker,
+				   &stats[started]))
+			break;
+
+	if (!started) {
+		perror("Error creating thread");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+		merge_stats(&total, &stats[i]);
+	}
+
+	if (a.error) {
+		fprintf(stderr, "Error walking btree: %s\n", strerror(-a.error));
+		exit(EXIT_FAILURE);
+	}
+
+	print_btree(&total, j.newest.btree_level + 1);
+	print_inodes(&total, uuids, nr_uuids);
+	print_buckets();
+
+	exit(total.bad_nodes ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,628 @@
+/*
+ * bcache-bench: micro-benchmarks of the superblock and crc paths the tools
+ * share, with the results as JSON so runs can be compared across releases
+ *
+ * GPLv2
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bcache.h"
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+/* From a superblock's 4k up to a large journal bucket */
+static const size_t crc_sizes[] = {
+	4096, 16384, 65536, 262144, 1 << 20, 4 << 20, 16 << 20,
+};
+
+#define MAX_RUNS	1000
+#define MAX_SAMPLES	10000000
+
+static struct {
+	uint64_t	target_ns;	/* per timed run */
+	unsigned	runs;
+	unsigned	samples;	/* sb reads per path */
+	FILE		*out;
+	bool		first;		/* result, for the commas */
+} b = {
+	.target_ns	= 200000000,
+	.runs		= 5,
+	.samples	= 1000,
+	.first		= true,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *l, const void *r)
+{
+	uint64_t a = *(const uint64_t *) l, b = *(const uint64_t *) r;
+
+	return a < b ? -1 : a > b;
+}
+
+static void json_str(const char *s)
+{
+	fputc('"', b.out);
+	for (; *s; s++)
+		if (*s == '"' || *s == '\\')
+			fprintf(b.out, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf(b.out, "\\u%04x", *s);
+		else
+			fputc(*s, b.out);
+	fputc('"', b.out);
+}
+
+/* Each result is one object on its own line, opened here */
+static void result_begin(const char *bench)
+{
+	fprintf(b.out, "%s\n    {\"bench\": ", b.first ? "" : ",");
+	json_str(bench);
+	b.first = false;
+}
+
+static void result_end(void)
+{
+	fprintf(b.out, "}");
+}
+
+/*
+ * The iteration count is doubled until a run takes about target_ns, then
+ * runs runs of that many are timed. Min and median per op are reported;
+ * min is the one that's stable from one invocation to the next.
+ */
+typedef uint64_t (*bench_fn)(void *arg);
+
+static volatile uint64_t sink;
+
+static uint64_t time_iters(bench_fn fn, void *arg, uint64_t iters)
+{
+	uint64_t start = now_ns(), i, v = 0;
+
+	for (i = 0; i < iters; i++)
+		v += fn(arg);
+	sink = v;
+
+	return now_ns() - start;
+}
+
+static void bench_rate(bench_fn fn, void *arg, size_t bytes)
+{
+	uint64_t iters = 1, ns[MAX_RUNS];
+	double min, median;
+	unsigned i;
+
+	while (time_iters(fn, arg, iters) < b.target_ns / 4)
+		iters *= 2;
+	iters *= 4;
+
+	for (i = 0; i < b.runs; i++)
+		ns[i] = time_iters(fn, arg, iters);
+	qsort(ns, b.runs, sizeof(ns[0]), cmp_u64);
+
+	min	= (double) ns[0] / iters;
+	median	= (double) ns[b.runs / 2] / iters;
+
+	fprintf(b.out, ", \"iters\": %" PRIu64 ", \"runs\": %u, "
+		"\"ns_per_op\": {\"min\": %.2f, \"median\": %.2f}",
+		iters, b.runs, min, median);
+	if (bytes)
+		fprintf(b.out, ", \"gb_per_s\": {\"max\": %.3f, \"median\": %.3f}",
+			bytes / min, bytes / median);
+}
+
+struct crc_arg {
+	const void	*buf;
+	size_t		len;
+};
+
+static uint64_t crc_one(void *arg)
+{
+	struct crc_arg *c = arg;
+
+	return crc64(c->buf, c->len);
+}
+
+static void bench_crc64(void)
+{
+	size_t max = crc_sizes[ARRAY_SIZE(crc_sizes) - 1];
+	uint64_t *buf = malloc(max), x = 0x9e3779b97f4a7c15ULL;
+	unsigned i;
+
+	if (!buf) {
+		fprintf(stderr, "Could not allocate crc buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* fixed contents, so every run crcs the same data */
+	for (i = 0; i < max / 8; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = x;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(crc_sizes); i++) {
+		struct crc_arg c = { buf, crc_sizes[i] };
+
+		result_begin("crc64");
+		fprintf(b.out, ", \"bytes\": %zu", c.len);
+		bench_rate(crc_one, &c, c.len);
+		result_end();
+	}
+
+	free(buf);
+}
+
+/* A v3 cache superblock with @keys journal buckets, or a v4 backing one */
+static void make_sb(struct cache_sb *sb, bool bdev, unsigned keys)
+{
+	unsigned i;
+
+	memset(sb, 0, sizeof(*sb));
+	memcpy(sb->magic, bcache_magic, 16);
+	sb->offset = SB_SECTOR;
+	for (i = 0; i < 16; i++) {
+		sb->uuid[i]	= i * 7 + 1;
+		sb->set_uuid[i]	= i * 13 + 5;
+	}
+	strcpy((char *) sb->label, "bench");
+	sb->seq = 1;
+	sb->block_size = 8;
+
+	if (bdev) {
+		sb->version = BCACHE_SB_VERSION_BDEV_WITH_OFFSET;
+		sb->data_offset = BDEV_DATA_START_DEFAULT;
+		SET_BDEV_CACHE_MODE(sb, CACHE_MODE_WRITEBACK);
+	} else {
+		sb->version = BCACHE_SB_VERSION_CDEV_WITH_UUID;
+		sb->bucket_size = 1024;
+		sb->nbuckets = 1 << 20;
+		sb->nr_in_set = 1;
+		sb->first_bucket = 1;
+		sb->keys = keys;
+		for (i = 0; i < keys; i++)
+			sb->d[i] = sb->first_bucket + i;
+		SET_CACHE_SYNC(sb, true);
+	}
+
+	sb_set_csum(sb);
+}
+
+static uint64_t csum_one(void *arg)
+{
+	return csum_set((struct cache_sb *) arg);
+}
+
+/* What bcache-super-show and probe-bcache get out of a superblock */
+struct sb_info {
+	enum sb_status	status;
+	bool		bdev;
+	uint64_t	data_offset;
+	uint64_t	cache_sectors;
+	const char	*mode;
+	char		label[SB_LABEL_SIZE + 1];
+};
+
+static uint64_t decode_one(void *arg)
+{
+	const struct cache_sb *sb = arg;
+	struct sb_info i;
+
+	i.status = sb_check(sb);
+	i.bdev = SB_IS_BDEV(sb);
+	memcpy(i.label, sb->label, SB_LABEL_SIZE);
+	i.label[SB_LABEL_SIZE] = '\0';
+
+	if (i.bdev) {
+		i.data_offset = sb_data_offset(sb);
+		i.cache_sectors = 0;
+		i.mode = bdev_cache_mode_name(BDEV_CACHE_MODE(sb));
+	} else {
+		i.data_offset = sb->bucket_size * sb->first_bucket;
+		i.cache_sectors = sb->bucket_size *
+			(sb->nbuckets - sb->first_bucket);
+		i.mode = cache_replacement_name(CACHE_REPLACEMENT(sb));
+	}
+
+	return i.status + i.data_offset + i.cache_sectors +
+		(uintptr_t) i.mode + i.label[0];
+}
+
+static void bench_sb(void)
+{
+	static const unsigned keys[] = { 0, 8, SB_JOURNAL_BUCKETS };
+	struct cache_sb sb;
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		make_sb(&sb, false, keys[i]);
+
+		result_begin("csum_set");
+		fprintf(b.out, ", \"keys\": %u", keys[i]);
+		bench_rate(csum_one, &sb, 0);
+		result_end();
+	}
+
+	for (i = 0; i < 2; i++) {
+		make_sb(&sb, i, 8);
+
+		result_begin("sb_decode");
+		fprintf(b.out, ", \"type\": \"%s\"", i ? "backing" : "cache");
+		bench_rate(decode_one, &sb, 0);
+		result_end();
+	}
+}
+
+/*
+ * One io_uring, queue depth 1, with the raw syscalls like bcache-test, so
+ * that we don't need liburing.
+ */
+struct uring {
+	int			fd;
+	unsigned		*sq_tail, *sq_mask, *sq_array;
+	unsigned		*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ring, *cq_ring;
+	size_t			sq_ring_size, cq_ring_size, sqes_size;
+};
+
+static int uring_init(struct uring *u)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, 1, &p);
+	if (u->fd < 0)
+		return -errno;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size	= p.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes	   = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED ||
+	    u->cq_ring == MAP_FAILED ||
+	    u->sqes == MAP_FAILED) {
+		close(u->fd);
+		return -ENOMEM;
+	}
+
+	u->sq_tail	= u->sq_ring + p.sq_off.tail;
+	u->sq_mask	= u->sq_ring + p.sq_off.ring_mask;
+	u->sq_array	= u->sq_ring + p.sq_off.array;
+	u->cq_head	= u->cq_ring + p.cq_off.head;
+	u->cq_tail	= u->cq_ring + p.cq_off.tail;
+	u->cq_mask	= u->cq_ring + p.cq_off.ring_mask;
+	u->cqes		= u->cq_ring + p.cq_off.cqes;
+	return 0;
+}
+
+static void uring_exit(struct uring *u)
+{
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+}
+
+static int uring_pread(struct uring *u, int fd, void *buf, unsigned len,
+		       uint64_t offset)
+{
+	unsigned tail = *u->sq_tail, head;
+	struct io_uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+	int res;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode	= IORING_OP_READ;
+	sqe->fd		= fd;
+	sqe->addr	= (uintptr_t) buf;
+	sqe->len	= len;
+	sqe->off	= offset;
+	u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, u->fd, 1, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		return -errno;
+
+	head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return -EIO;
+
+	res = u->cqes[head & *u->cq_mask].res;
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return res;
+}
+
+enum read_path {
+	PATH_BUFFERED,
+	PATH_DIRECT,
+	PATH_URING,
+	PATH_NR,
+};
+
+static const char * const path_names[] = {
+	[PATH_BUFFERED]	= "buffered",
+	[PATH_DIRECT]	= "direct",
+	[PATH_URING]	= "uring",
+};
+
+/* One superblock read, through @path; 0 or -errno */
+static int sb_read_path(enum read_path path, int fd, struct uring *u,
+			void *buf, struct cache_sb *sb)
+{
+	int ret;
+
+	if (path != PATH_URING)
+		return sb_read(fd, 0, sb);
+
+	ret = uring_pread(u, fd, buf, 4096, SB_START);
+	if (ret < 0)
+		return ret;
+	if (ret < (int) sizeof(*sb))
+		return -EIO;
+
+	memcpy(sb, buf, sizeof(*sb));
+	return 0;
+}
+
+/*
+ * Latency of reading and checking the superblock of @dev, one read at a
+ * time: buffered reads mostly hit the page cache after the first, O_DIRECT
+ * and io_uring (also O_DIRECT) go to the device each time.
+ */
+static void bench_sb_read(const char *dev, enum read_path path)
+{
+	uint64_t *lat = calloc(b.samples, sizeof(*lat)), sum = 0;
+	struct uring u = { .fd = -1 };
+	struct cache_sb sb;
+	enum sb_status status = SB_OK;
+	void *buf = NULL;
+	unsigned i;
+	int fd = -1, ret = 0;
+
+	result_begin("sb_read");
+	fprintf(b.out, ", \"dev\": ");
+	json_str(dev);
+	fprintf(b.out, ", \"path\": \"%s\"", path_names[path]);
+
+	if (!lat) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	fd = open(dev, O_RDONLY|(path != PATH_BUFFERED ? O_DIRECT : 0));
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (path == PATH_URING &&
+	    ((ret = uring_init(&u)) ||
+	     (ret = -posix_memalign(&buf, 4096, 4096))))
+		goto out;
+
+	/* one untimed read, so the first buffered one isn't a miss */
+	if ((ret = sb_read_path(path, fd, &u, buf, &sb)) ||
+	    (status = sb_check(&sb)))
+		goto out;
+
+	for (i = 0; i < b.samples; i++) {
+		uint64_t start = now_ns();
+
+		if ((ret = sb_read_path(path, fd, &u, buf, &sb)) ||
+		    (status = sb_check(&sb)))
+			goto out;
+		lat[i] = now_ns() - start;
+		sum += lat[i];
+	}
+
+	qsort(lat, b.samples, sizeof(*lat), cmp_u64);
+
+	fprintf(b.out, ", \"samples\": %u, \"ns\": {\"min\": %" PRIu64
+		", \"mean\": %.0f, \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+		", \"p99\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+		b.samples, lat[0], (double) sum / b.samples,
+		lat[b.samples / 2], lat[b.samples * 9 / 10],
+		lat[b.samples * 99 / 100], lat[b.samples - 1]);
+out:
+	if (ret)
+		fprintf(b.out, ", \"error\": \"%s\"", strerror(-ret));
+	else if (status)
+		fprintf(b.out, ", \"error\": \"%s\"", sb_status_str(status));
+	result_end();
+
+	if (u.fd >= 0)
+		uring_exit(&u);
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	free(lat);
+}
+
+/* Without devices, a file in the current directory with a cache sb */
+static char *make_image(void)
+{
+	char *path = strdup("bcache-bench.XXXXXX");
+	struct cache_sb sb;
+	int fd;
+
+	fd = path ? mkstemp(path) : -1;
+	if (fd < 0) {
+		perror("Error creating superblock image");
+		exit(EXIT_FAILURE);
+	}
+
+	make_sb(&sb, false, 8);
+	if (ftruncate(fd, 1 << 20) || sb_write(fd, 0, &sb) || fsync(fd)) {
+		perror("Error writing superblock image");
+		unlink(path);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+	return path;
+}
+
+static void print_host(void)
+{
+	char line[256], cpu[256] = "unknown";
+	struct utsname u;
+	FILE *f = fopen("/proc/cpuinfo", "r");
+
+	while (f && fgets(line, sizeof(line), f))
+		if (!strncmp(line, "model name", 10) && strchr(line, ':')) {
+			snprintf(cpu, sizeof(cpu), "%s", strchr(line, ':') + 2);
+			cpu[strcspn(cpu, "\n")] = '\0';
+			break;
+		}
+	if (f)
+		fclose(f);
+
+	uname(&u);
+
+	fprintf(b.out, "{\n  \"bcache_bench\": 1,\n  \"host\": {\"cpu\": ");
+	json_str(cpu);
+	fprintf(b.out, ", \"cpus\": %ld, \"kernel\": ",
+		sysconf(_SC_NPROCESSORS_ONLN));
+	json_str(u.release);
+	fprintf(b.out, ", \"machine\": ");
+	json_str(u.machine);
+	fprintf(b.out, "},\n  \"config\": {\"run_ms\": %" PRIu64
+		", \"runs\": %u, \"samples\": %u},\n  \"results\": [",
+		b.target_ns / 1000000, b.runs, b.samples);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: bcache-bench [options] [device...]\n"
+		"Times crc64, csum_set and superblock decode, and reading the\n"
+		"superblock of each device (a temporary file if none) buffered,\n"
+		"with O_DIRECT and with io_uring; prints JSON.\n"
+		"	-t ms		time per run of the throughput benchmarks (200)\n"
+		"	-r runs		runs of each, min and median reported (5, max %u)\n"
+		"	-n samples	superblock reads per device and path (1000, max %u)\n"
+		"	-c cpu		pin to cpu, for less noise\n"
+		"	-o file		write the results to file\n"
+		"	-h		display this help and exit\n",
+		MAX_RUNS, MAX_SAMPLES);
+	exit(EXIT_FAILURE);
+}
+
+/* a whole number from @min to @max, or the usage message */
+static unsigned long parse_num(const char *arg, unsigned long min,
+			       unsigned long max)
+{
+	unsigned long v;
+	char *e;
+
+	errno = 0;
+	v = strtoul(arg, &e, 10);
+	if (*arg == '-' || *e || errno || v < min || v > max)
+		usage();
+	return v;
+}
+
+int main(int argc, char **argv)
+{
+	char *image = NULL;
+	int c, i, j;
+
+	b.out = stdout;
+
+	while ((c = getopt(argc, argv, "t:r:n:c:o:h")) != -1)
+		switch (c) {
+		case 't':
+			b.target_ns = parse_num(optarg, 1, 60000) * 1000000;
+			break;
+		case 'r':
+			b.runs = parse_num(optarg, 1, MAX_RUNS);
+			break;
+		case 'n':
+			b.samples = parse_num(optarg, 1, MAX_SAMPLES);
+			break;
+		case 'c': {
+			cpu_set_t set;
+
+			CPU_ZERO(&set);
+			CPU_SET(parse_num(optarg, 0, CPU_SETSIZE - 1), &set);
+			if (sched_setaffinity(0, sizeof(set), &set)) {
+				perror("Error pinning to cpu");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'o':
+			b.out = fopen(optarg, "w");
+			if (!b.out) {
+				perror("Error opening output file");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			usage();
+		}
+
+	argv += optind;
+	argc -= optind;
+
+	if (!argc) {
+		image = make_image();
+		argv = &image;
+		argc = 1;
+	}
+
+	print_host();
+
+	bench_crc64();
+	bench_sb();
+
+	for (i = 0; i < argc; i++)
+		for (j = 0; j < PATH_NR; j++)
+			bench_sb_read(argv[i], j);
+
+	fprintf(b.out, "\n  ]\n}\n");
+
+	if (image)
+		unlink(image);
+
+	if (fclose(b.out)) {
+		perror("Error writing results");
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
@@ -0,0 +1,452 @@
+/*
+ * bcache-find-sb: find bcache superblocks anywhere on a device, after the
+ * partition table was rewritten or the superblock wiped
+ *
+ * GPLv2
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#include "bcache.h"
+
+/* A superblock starts on a sector boundary, its magic right after that */
+#define MAGIC_OFFSET	offsetof(struct cache_sb, magic)
+
+struct candidate {
+	uint64_t	pos;		/* bytes, of the superblock itself */
+	uint64_t	start;		/* of the device it belongs to */
+	bool		before;		/* which started before this one */
+	bool		csum_ok;
+	const char	*copy;
+	struct cache_sb	sb;
+};
+
+static struct {
+	int		fd, buffered_fd;
+	uint64_t	size;
+	size_t		chunk;
+	uint64_t	nchunks;
+	uint64_t	next;		/* chunk */
+	bool		all, progress;
+
+	uint64_t	magic64;
+	uint64_t	scanned;	/* bytes */
+	double		start, last_progress;
+	int		error;
+
+	pthread_mutex_t	lock;
+	struct candidate *found;
+	unsigned	nr_found, size_found;
+} s = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+};
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_candidate(uint64_t pos, const void *p)
+{
+	struct candidate c = { .pos = pos };
+
+	memcpy(&c.sb, p, sizeof(c.sb));
+
+	c.csum_ok = sb_check(&c.sb) == SB_OK;
+
+	if (!c.csum_ok && !s.all)
+		return;
+
+	pthread_mutex_lock(&s.lock);
+	if (s.nr_found == s.size_found) {
+		s.size_found = s.size_found ? s.size_found * 2 : 16;
+		s.found = realloc(s.found, s.size_found * sizeof(*s.found));
+		if (!s.found) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	s.found[s.nr_found++] = c;
+	pthread_mutex_unlock(&s.lock);
+}
+
+/*
+ * Only one place per sector can hold the magic, so this is a strided compare
+ * of the first 8 bytes of it rather than a search: the CPU only has to keep
+ * up with the memory bandwidth O_DIRECT reads run at, and it does, easily.
+ */
+static void scan_buf(uint64_t pos, const char *buf, size_t len, size_t end)
+{
+	size_t i;
+
+	for (i = 0; i < len && i + MAGIC_OFFSET + 16 <= end; i += 512) {
+		uint64_t v;
+
+		memcpy(&v, buf + i + MAGIC_OFFSET, sizeof(v));
+		if (v != s.magic64 ||
+		    memcmp(buf + i + MAGIC_OFFSET, bcache_magic, 16) ||
+		    i + sizeof(struct cache_sb) > end)
+			continue;
+
+		add_candidate(pos + i, buf + i);
+	}
+}
+
+static ssize_t read_chunk(void *buf, size_t len, uint64_t pos)
+{
+	size_t done = 0;
+	int fd = s.fd;
+
+	while (done < len) {
+		ssize_t ret = pread(fd, buf + done, len - done, pos + done);
+
+		/* O_DIRECT wants aligned lengths: the odd tail at the end */
+		if (ret < 0 && errno == EINVAL && fd != s.buffered_fd) {
+			fd = s.buffered_fd;
+			continue;
+		}
+		if (ret < 0)
+			return -1;
+		if (!ret)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+static void print_progress(void)
+{
+	double now = now_seconds();
+
+	if (now - s.last_progress < 1)
+		return;
+	s.last_progress = now;
+
+	fprintf(stderr, "\r%3u%% %" PRIu64 " MiB, %.0f MiB/s ",
+		(unsigned) (s.scanned * 100 / s.size), s.scanned >> 20,
+		(s.scanned >> 20) / (now - s.start));
+}
+
+/*
+ * Chunks are handed out in order, so the threads read neighbouring parts of
+ * the device. Each read runs a superblock's worth past the end of its chunk,
+ * so that one starting in the last sectors of the chunk can be checked.
+ */
+static void *scan_worker(void *arg)
+{
+	bool progress = arg != NULL;
+	size_t len = s.chunk + sizeof(struct cache_sb);
+	uint64_t c;
+	void *buf;
+
+	len = (len + 4095) & ~4095UL;
+
+	if (posix_memalign(&buf, 4096, len)) {
+		s.error = ENOMEM;
+		return NULL;
+	}
+
+	while (!s.error &&
+	       (c = __sync_fetch_and_add(&s.next, 1)) < s.nchunks) {
+		uint64_t pos = c * s.chunk;
+		size_t want = s.size - pos < len ? s.size - pos : len;
+		ssize_t ret = read_chunk(buf, want, pos);
+
+		if (ret < 0) {
+			fprintf(stderr, "Read error at %" PRIu64 ": %m\n", pos);
+			s.error = errno ?: EIO;
+			break;
+		}
+
+		scan_buf(pos, buf, ret < (ssize_t) s.chunk ? ret : s.chunk,
+			 ret);
+
+		__sync_fetch_and_add(&s.scanned,
+				     ret < (ssize_t) s.chunk ? ret : s.chunk);
+		if (progress)
+			print_progress();
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static int candidate_cmp(const void *l, const void *r)
+{
+	const struct candidate *a = l, *b = r;
+
+	return (a->pos > b->pos) - (a->pos < b->pos);
+}
+
+static bool same_sb(const struct candidate *a, const struct candidate *b)
+{
+	return a->csum_ok && b->csum_ok && !memcmp(&a->sb, &b->sb, sizeof(a->sb));
+}
+
+static struct candidate *find_copy(const struct candidate *c, uint64_t pos)
+{
+	unsigned i;
+
+	for (i = 0; i < s.nr_found; i++)
+		if (s.found[i].pos == pos && same_sb(&s.found[i], c))
+			return &s.found[i];
+	return NULL;
+}
+
+/* A copy found @back bytes into its device; near our start, it began before */
+static void set_start(struct candidate *c, uint64_t back)
+{
+	c->before	= c->pos < back;
+	c->start	= c->before ? 0 : c->pos - back;
+}
+
+/*
+ * make-bcache writes byte for byte copies of the superblock (SB_BACKUP): one
+ * 4k after it, and on caches one at the end of the device. A copy with no
+ * twin 4k before or after it is taken for the backup, as it's the primary
+ * that gets wiped; one found further on is the end copy of an earlier one.
+ */
+static void name_copies(void)
+{
+	unsigned i, j;
+
+	for (i = 0; i < s.nr_found; i++) {
+		struct candidate *c = &s.found[i];
+
+		c->copy		= "primary";
+		set_start(c, SB_START);
+
+		if (!c->csum_ok || !SB_BACKUP(&c->sb))
+			continue;
+
+		if (find_copy(c, c->pos + SB_BACKUP_SIZE))
+			continue;
+
+		c->copy		= "backup";
+		set_start(c, SB_START + SB_BACKUP_SIZE);
+
+		if (find_copy(c, c->pos - SB_BACKUP_SIZE))
+			continue;
+
+		for (j = 0; j < i; j++)
+			if (same_sb(&s.found[j], c)) {
+				c->copy		= "backup-end";
+				c->start	= s.found[j].start;
+				c->before	= s.found[j].before;
+				break;
+			}
+	}
+}
+
+static void print_candidate(const struct candidate *c)
+{
+	const struct cache_sb *sb = &c->sb;
+	uint64_t start = c->start;
+	char uuid[40], set_uuid[40];
+
+	printf("%" PRIu64 "\t%s", c->pos, c->csum_ok ? "ok" : "bad-csum");
+
+	if (!c->csum_ok) {
+		putchar('\n');
+		return;
+	}
+
+	uuid_unparse(sb->uuid, uuid);
+	uuid_unparse(sb->set_uuid, set_uuid);
+
+	printf("\t%s\t%s", c->copy,
+	       sb->version > BCACHE_SB_MAX_VERSION ? "unknown" :
+	       SB_IS_BDEV(sb) ? "backing" : "cache");
+	if (c->before)
+		printf("\tstart=before-device");
+	else
+		printf("\tstart=%" PRIu64, start);
+	printf("\tuuid=%s\tcset.uuid=%s\tseq=%" PRIu64,
+	       uuid, set_uuid, sb->seq);
+
+	/* offsets from a start we can't give would be meaningless */
+	if (sb->version > BCACHE_SB_MAX_VERSION || c->before)
+		;
+	else if (SB_IS_BDEV(sb)) {
+		uint64_t data_offset = sb_data_offset(sb);
+
+		printf("\tdata_offset=%" PRIu64 "\tdata=%" PRIu64
+		       "\tstate=%" PRIu64,
+		       data_offset, start + (data_offset << 9),
+		       BDEV_STATE(sb));
+	} else
+		printf("\tbucket_size=%u\tnbuckets=%" PRIu64
+		       "\tfirst_bucket=%u\tdata=%" PRIu64 "\tend=%" PRIu64
+		       "\tnr_this_dev=%u",
+		       sb->bucket_size, sb->nbuckets, sb->first_bucket,
+		       start + bucket_to_offset(sb, sb->first_bucket),
+		       start + bucket_to_offset(sb, sb->nbuckets),
+		       sb->nr_this_dev);
+	putchar('\n');
+}
+
+static size_t parse_size(const char *arg)
+{
+	char *e;
+	unsigned long long v = strtoull(arg, &e, 10);
+
+	switch (*e) {
+	case 'G': case 'g':
+		v <<= 10;
+	case 'M': case 'm':
+		v <<= 10;
+	case 'K': case 'k':
+		v <<= 10;
+	}
+
+	return v;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: bcache-find-sb [-j threads] [-b size] [-a] device\n"
+		"	-j	threads reading the device (default 4)\n"
+		"	-b	size of each read (default 8M)\n"
+		"	-a	also print candidates with a bad csum\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned i, jobs = 4, started = 0, good = 0;
+	struct stat statbuf;
+	double elapsed;
+	int c;
+
+	s.chunk = 8 << 20;
+
+	while ((c = getopt(argc, argv, "j:b:ah")) != -1)
+		switch (c) {
+		case 'j': {
+			unsigned long v;
+			char *e;
+
+			errno = 0;
+			v = strtoul(optarg, &e, 10);
+			if (*optarg == '-' || *e || errno || !v || v > UINT_MAX)
+				usage();
+			jobs = v;
+			break;
+		}
+		case 'b':
+			s.chunk = parse_size(optarg);
+			if (!s.chunk || s.chunk % 4096) {
+				fprintf(stderr, "Read size must be a multiple "
+					"of 4k\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'a':
+			s.all = true;
+			break;
+		default:
+			usage();
+		}
+
+	if (argc - optind != 1)
+		usage();
+
+	s.buffered_fd = open(argv[optind], O_RDONLY);
+	if (s.buffered_fd < 0) {
+		perror("Can't open dev");
+		exit(EXIT_FAILURE);
+	}
+
+	/* filesystems without O_DIRECT get buffered reads */
+	s.fd = open(argv[optind], O_RDONLY|O_DIRECT);
+	if (s.fd < 0)
+		s.fd = s.buffered_fd;
+
+	if (fstat(s.buffered_fd, &statbuf)) {
+		perror("Can't stat dev");
+		exit(EXIT_FAILURE);
+	}
+	s.size = statbuf.st_size;
+	if (S_ISBLK(statbuf.st_mode) &&
+	    ioctl(s.buffered_fd, BLKGETSIZE64, &s.size)) {
+		perror("Can't get device size");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(&s.magic64, bcache_magic, sizeof(s.magic64));
+	s.nchunks	= (s.size + s.chunk - 1) / s.chunk;
+	s.progress	= isatty(STDERR_FILENO);
+	s.start		= s.last_progress = now_seconds();
+
+	{
+		pthread_t *threads;
+
+		if (jobs > s.nchunks)
+			jobs = s.nchunks ?: 1;
+		threads = jobs > 1 ? calloc(jobs - 1, sizeof(*threads)) : NULL;
+		if (!threads)
+			jobs = 1;
+
+		for (i = 1; i < jobs; i++) {
+			if (pthread_create(&threads[started], NULL,
+					   scan_worker, NULL))
+				break;
+			started++;
+		}
+
+		scan_worker(s.progress ? &s : NULL);
+
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+
+		free(threads);
+	}
+
+	elapsed = now_seconds() - s.start;
+	if (s.progress)
+		fputc('\r', stderr);
+
+	if (s.error == ENOMEM)
+		fprintf(stderr, "Out of memory\n");
+
+	qsort(s.found, s.nr_found, sizeof(*s.found), candidate_cmp);
+	name_copies();
+
+	for (i = 0; i < s.nr_found; i++) {
+		print_candidate(&s.found[i]);
+		good += s.found[i].csum_ok;
+	}
+
+	fprintf(stderr, "%u superblocks found, %" PRIu64 " MiB in %.1fs, "
+		"%.0f MiB/s\n", good, s.scanned >> 20, elapsed,
+		elapsed ? (s.scanned >> 20) / elapsed : 0);
+
+	if (s.error)
+		exit(2);
+	return good ? 0 : 1;
+}
@@ -0,0 +1,383 @@
+/*
+ * bcache-journal-dump: read and check the journal of an offline cache device
+ *
+ * GPLv2
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bcache.h"
+
+/* Buckets read ahead of the one being checked */
+#define NR_BUFS		4
+
+static struct {
+	struct cache_sb	sb;
+	int		fd;
+	size_t		bucket_bytes;
+	unsigned	block_bytes;
+	bool		verbose, keys;
+} j;
+
+/*
+ * The journal is read by a separate thread, a whole bucket per pread(),
+ * into a small ring of buffers; checksumming is much faster than the disk,
+ * so this keeps the device streaming.
+ */
+struct bucket_buf {
+	void		*data;
+	unsigned	idx;
+	int		error;
+	bool		full;
+};
+
+static struct {
+	struct bucket_buf	bufs[NR_BUFS];
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+} ring = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.cond	= PTHREAD_COND_INITIALIZER,
+};
+
+struct bucket_stats {
+	unsigned	entries;
+	uint64_t	min_seq, max_seq;
+	uint64_t	keys;
+	uint64_t	bytes;
+	bool		bad_csum;
+};
+
+static void *reader(void *arg)
+{
+	unsigned i;
+
+	for (i = 0; i < j.sb.njournal_buckets; i++) {
+		struct bucket_buf *b = &ring.bufs[i % NR_BUFS];
+		off_t offset = bucket_to_offset(&j.sb, j.sb.d[i]);
+		size_t done = 0;
+		ssize_t ret;
+
+		pthread_mutex_lock(&ring.lock);
+		while (b->full)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		pthread_mutex_unlock(&ring.lock);
+
+		b->idx = i;
+		b->error = 0;
+
+		while (done < j.bucket_bytes) {
+			ret = pread(j.fd, b->data + done, j.bucket_bytes - done,
+				    offset + done);
+			if (ret <= 0) {
+				b->error = ret ? errno : EIO;
+				break;
+			}
+			done += ret;
+		}
+
+		pthread_mutex_lock(&ring.lock);
+		b->full = true;
+		pthread_cond_broadcast(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+	}
+
+	return NULL;
+}
+
+static struct bucket_buf *get_bucket(unsigned i)
+{
+	struct bucket_buf *b = &ring.bufs[i % NR_BUFS];
+
+	pthread_mutex_lock(&ring.lock);
+	while (!b->full)
+		pthread_cond_wait(&ring.cond, &ring.lock);
+	pthread_mutex_unlock(&ring.lock);
+
+	return b;
+}
+
+static void put_bucket(struct bucket_buf *b)
+{
+	pthread_mutex_lock(&ring.lock);
+	b->full = false;
+	pthread_cond_broadcast(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+}
+
+static void print_keys(struct jset *i)
+{
+	struct bkey *k;
+	char buf[256];
+
+	for (k = i->start; k < (struct bkey *) end(i); k = bkey_next(k)) {
+		bkey_to_text(buf, sizeof(buf), k);
+		printf("\t\t%s\n", buf);
+	}
+}
+
+static void check_bucket(struct bucket_buf *b, struct bucket_stats *s,
+			 struct jset *newest)
+{
+	size_t offset = 0;
+
+	memset(s, 0, sizeof(*s));
+	s->min_seq = UINT64_MAX;
+
+	while (1) {
+		size_t prev = offset, bytes;
+		struct jset *i = jset_next(&j.sb, b->data, &offset,
+					   &s->bad_csum);
+
+		if (!i)
+			break;
+
+		bytes = set_bytes(i);
+
+		s->entries++;
+		s->min_seq = MIN(s->min_seq, i->seq);
+		s->max_seq = MAX(s->max_seq, i->seq);
+		s->keys	  += i->keys;
+		s->bytes  += bytes;
+
+		if (i->seq > newest->seq)
+			memcpy(newest, i, sizeof(*newest));
+
+		if (j.verbose)
+			printf("\tseq %" PRIu64 " last_seq %" PRIu64
+			       " keys %u u64s, %zu bytes, offset %zu\n",
+			       i->seq, i->last_seq, i->keys, bytes, prev);
+		if (j.keys)
+			print_keys(i);
+	}
+}
+
+/*
+ * A second pass over what we've read would mean reading it twice; instead
+ * remember enough per bucket to count what replay will have to process
+ * once the newest entry, and so last_seq, is known.
+ */
+struct seq_range {
+	uint64_t	min_seq, max_seq;
+	uint64_t	entries, keys, bytes;
+};
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_sb(const char *dev)
+{
+	struct cache_sb *sb = &j.sb;
+
+	if (sb_read(j.fd, 0, sb)) {
+		fprintf(stderr, "Couldn't read superblock of %s\n", dev);
+		return -1;
+	}
+
+	switch (sb_check(sb)) {
+	case SB_OK:
+		break;
+	case SB_BAD_CSUM:
+		fprintf(stderr, "Bad superblock csum on %s\n", dev);
+		return -1;
+	default:
+		fprintf(stderr, "%s is not a bcache device\n", dev);
+		return -1;
+	}
+
+	if (SB_IS_BDEV(sb)) {
+		fprintf(stderr, "%s is a backing device, it has no journal\n",
+			dev);
+		return -1;
+	}
+
+	if (!sb->njournal_buckets || sb->njournal_buckets > SB_JOURNAL_BUCKETS) {
+		fprintf(stderr, "%s has no journal buckets\n", dev);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: bcache-journal-dump [-v] [-k] device\n"
+		"	-v	print every journal entry\n"
+		"	-k	print the keys in every entry\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct seq_range *ranges;
+	struct bkey *root;
+	struct jset newest = { .seq = 0 };
+	uint64_t replay_entries = 0, replay_keys = 0, replay_bytes = 0;
+	uint64_t min_seq = UINT64_MAX, entries = 0, bad = 0;
+	pthread_t thread;
+	double start, elapsed;
+	unsigned i;
+	char buf[256];
+	int c;
+
+	while ((c = getopt(argc, argv, "vkh")) != -1)
+		switch (c) {
+		case 'v':
+			j.verbose = true;
+			break;
+		case 'k':
+			j.verbose = j.keys = true;
+			break;
+		default:
+			usage();
+		}
+
+	if (argc - optind != 1)
+		usage();
+
+	j.fd = open(argv[optind], O_RDONLY);
+	if (j.fd < 0) {
+		perror("Can't open dev");
+		exit(EXIT_FAILURE);
+	}
+
+	if (read_sb(argv[optind]))
+		exit(EXIT_FAILURE);
+
+	j.bucket_bytes	= j.sb.bucket_size * 512UL;
+	j.block_bytes	= j.sb.block_size * 512U;
+
+	/* sequential reads don't need O_DIRECT, but shouldn't churn the cache */
+	posix_fadvise(j.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	ranges = calloc(j.sb.njournal_buckets, sizeof(*ranges));
+	if (!ranges) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < NR_BUFS; i++)
+		if (posix_memalign(&ring.bufs[i].data, 4096, j.bucket_bytes)) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+	printf("journal: %u buckets of %zu KB, block size %u\n",
+	       j.sb.njournal_buckets, j.bucket_bytes >> 10, j.block_bytes);
+
+	start = now_seconds();
+
+	if (pthread_create(&thread, NULL, reader, NULL)) {
+		perror("Error creating thread");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < j.sb.njournal_buckets; i++) {
+		struct bucket_buf *b = get_bucket(i);
+		struct bucket_stats s;
+
+		if (b->error) {
+			printf("bucket %3u (%" PRIu64 "): read error: %s\n",
+			       i, j.sb.d[i], strerror(b->error));
+			bad++;
+			put_bucket(b);
+			continue;
+		}
+
+		if (j.verbose)
+			printf("bucket %3u (%" PRIu64 "):\n", i, j.sb.d[i]);
+
+		check_bucket(b, &s, &newest);
+		put_bucket(b);
+
+		if (!s.entries)
+			printf("bucket %3u (%" PRIu64 "): empty%s\n",
+			       i, j.sb.d[i], s.bad_csum ? ", bad csum" : "");
+		else
+			printf("bucket %3u (%" PRIu64 "): %u entries, seq %"
+			       PRIu64 "-%" PRIu64 ", %" PRIu64 " u64s of keys, %"
+			       PRIu64 " KB%s\n",
+			       i, j.sb.d[i], s.entries, s.min_seq, s.max_seq,
+			       s.keys, s.bytes >> 10,
+			       s.bad_csum ? ", then a bad csum" : "");
+
+		bad += s.bad_csum;
+		entries += s.entries;
+		if (s.entries)
+			min_seq = MIN(min_seq, s.min_seq);
+
+		ranges[i] = (struct seq_range) {
+			.min_seq = s.min_seq,	.max_seq = s.max_seq,
+			.entries = s.entries,	.keys	 = s.keys,
+			.bytes	 = s.bytes,
+		};
+	}
+
+	pthread_join(thread, NULL);
+	elapsed = now_seconds() - start;
+
+	printf("read %zu MB in %.2fs, %.0f MB/s\n",
+	       (j.bucket_bytes * j.sb.njournal_buckets) >> 20, elapsed,
+	       j.bucket_bytes * j.sb.njournal_buckets / 1048576.0 / elapsed);
+
+	if (!entries) {
+		printf("no journal entries\n");
+		exit(bad ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	/*
+	 * Buckets are written whole in seq order, so a bucket is either all
+	 * needed, all not, or straddles last_seq; count the straddling one
+	 * in full. That's what the kernel reads anyway.
+	 */
+	for (i = 0; i < j.sb.njournal_buckets; i++)
+		if (ranges[i].entries && ranges[i].max_seq >= newest.last_seq) {
+			replay_entries	+= ranges[i].entries;
+			replay_keys	+= ranges[i].keys;
+			replay_bytes	+= ranges[i].bytes;
+		}
+
+	printf("%" PRIu64 " entries, seq %" PRIu64 "-%" PRIu64 "%s\n",
+	       entries, min_seq, newest.seq,
+	       bad ? ", with errors" : "");
+	printf("replay: from seq %" PRIu64 ", up to %" PRIu64 " entries, %"
+	       PRIu64 " u64s of keys, %" PRIu64 " KB\n",
+	       newest.last_seq, replay_entries, replay_keys,
+	       replay_bytes >> 10);
+
+	root = &newest.btree_root;
+	bkey_to_text(buf, sizeof(buf), root);
+	printf("btree root: level %u, %s\n", newest.btree_level, buf);
+
+	root = &newest.uuid_bucket;
+	bkey_to_text(buf, sizeof(buf), root);
+	printf("uuids: %s\n", buf);
+
+	printf("prio buckets:");
+	for (i = 0; i < MAX(j.sb.nr_in_set, 1) && i < MAX_CACHES_PER_SET; i++)
+		printf(" %" PRIu64, newest.prio_bucket[i]);
+	printf("\n");
+
+	exit(bad ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -4,14 +4,235 @@
  * GPLv2
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "bcache.h"
+
+struct reg_dev {
+    const char      *dev;
+    uint8_t         set_uuid[16];
+    bool            have_set;
+    int             error;
+    double          elapsed;
+};
+
+struct reg_pool {
+    struct reg_dev  *devs;
+    unsigned        ndevs;
+    unsigned        next;
+    const char      *path;
+};
+
+static int register_dev(const char *path, const char *dev)
+{
+    int fd, ret = 0;
+
+    fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return errno;
+
+    if (dprintf(fd, "%s\n", dev) < 0)
+        ret = errno ?: EIO;
+
+    close(fd);
+    return ret;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Devices are sorted so that members of the same cache set are adjacent;
+ * each worker claims a whole set and registers its members in order, so
+ * independent sets replay their journals in parallel.
+ */
+static void *register_worker(void *arg)
+{
+    struct reg_pool *pool = arg;
+    unsigned i, end;
+
+    while (1)
+    {
+        do
+        {
+            i = pool->next;
+            if (i >= pool->ndevs)
+                return NULL;
+
+            for (end = i + 1; end < pool->ndevs; end++)
+                if (!pool->devs[i].have_set ||
+                    !pool->devs[end].have_set ||
+                    memcmp(pool->devs[i].set_uuid,
+                           pool->devs[end].set_uuid, 16))
+                    break;
+        } while (!__sync_bool_compare_and_swap(&pool->next, i, end));
+
+        for (; i < end; i++)
+        {
+            struct reg_dev *d = &pool->devs[i];
+            double start = now_seconds();
+
+            d->error = register_dev(pool->path, d->dev);
+            d->elapsed = now_seconds() - start;
+        }
+    }
+}
+
+static void read_set_uuid(struct reg_dev *d)
+{
+    struct cache_sb sb;
+    int fd = open(d->dev, O_RDONLY);
+
+    if (fd < 0)
+        return;
+
+    if (pread(fd, &sb, sizeof(sb), SB_START) == sizeof(sb) &&
+        !memcmp(sb.magic, bcache_magic, 16))
+    {
+        memcpy(d->set_uuid, sb.set_uuid, 16);
+        d->have_set = true;
+    }
+
+    close(fd);
+}
+
+static int cmp_set(const void *_l, const void *_r)
+{
+    const struct reg_dev *l = _l, *r = _r;
+
+    if (l->have_set != r->have_set)
+        return l->have_set - r->have_set;
+
+    return memcmp(l->set_uuid, r->set_uuid, 16);
+}
+
+static int register_batch(char **devs, unsigned ndevs, unsigned jobs)
+{
+    struct reg_pool pool = { .ndevs = ndevs };
+    pthread_t *threads;
+    unsigned i, started = 0, failed = 0;
+    bool async;
+
+    /*
+     * register_async returns once the kernel has queued the work, so then
+     * all we can report is that, and how long queueing took; errors only
+     * show up in the kernel log
+     */
+    async = !access("/sys/fs/bcache/register_async", W_OK);
+    pool.path = async
+        ? "/sys/fs/bcache/register_async"
+        : "/sys/fs/bcache/register";
+
+    if (access(pool.path, W_OK))
+    {
+        perror("Error opening /sys/fs/bcache/register");
+        fprintf(stderr, "The bcache kernel module must be loaded\n");
+        return 1;
+    }
+
+    pool.devs = calloc(ndevs, sizeof(*pool.devs));
+    if (!pool.devs)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < ndevs; i++)
+    {
+        pool.devs[i].dev = devs[i];
+        read_set_uuid(&pool.devs[i]);
+    }
+
+    qsort(pool.devs, ndevs, sizeof(*pool.devs), cmp_set);
+
+    jobs = jobs < ndevs ? jobs : ndevs;
+    threads = jobs > 1 ? calloc(jobs - 1, sizeof(*threads)) : NULL;
+    if (!threads)
+        jobs = 1;
+
+    for (i = 1; i < jobs; i++)
+    {
+        if (pthread_create(&threads[started], NULL, register_worker, &pool))
+            break;
+        started++;
+    }
+
+    register_worker(&pool);
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+
+    for (i = 0; i < ndevs; i++)
+    {
+        struct reg_dev *d = &pool.devs[i];
+
+        if (d->error)
+        {
+            fprintf(stderr, "Error registering %s with bcache: %s\n",
+                    d->dev, strerror(d->error));
+            failed++;
+        }
+
+        printf("%s\t%s\t%.3fs\n", d->dev,
+               d->error ? "failed" : async ? "queued" : "registered",
+               d->elapsed);
+    }
+
+    free(pool.devs);
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
     int fd;
 
+    if (argc > 1 && !strcmp(argv[1], "--batch"))
+    {
+        unsigned jobs = 16;
+
+        argv += 2;
+        argc -= 2;
+
+        if (argc > 1 && !strcmp(argv[0], "-j"))
+        {
+            unsigned long v;
+            char *e;
+
+            errno = 0;
+            v = strtoul(argv[1], &e, 10);
+            jobs = *argv[1] == '-' || *e || errno || v > UINT_MAX ? 0 : v;
+            argv += 2;
+            argc -= 2;
+        }
+
+        if (!jobs || argc < 1)
+        {
+            fprintf(stderr, "Usage: bcache-register --batch [-j jobs] device...\n");
+            return 1;
+        }
+
+        return register_batch(argv, argc, jobs);
+    }
+
     if (argc != 2)
     {
         fprintf(stderr, "bcache-register takes exactly one argument\n");
@@ -34,4 +255,3 @@ int main(int argc, char *argv[])
 
     return 0;
 }
-
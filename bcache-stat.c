@@ -0,0 +1,453 @@
+/*
+ * bcache-stat: iostat style monitor of cache sets and their backing devices
+ *
+ * GPLv2
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYSFS_BCACHE	"/sys/fs/bcache"
+
+/*
+ * Everything we sample, for a cache set and for a backing device alike;
+ * each only has some of them. The files are opened once, and re-read with
+ * pread() every interval, so a sample is one syscall per value.
+ */
+enum stat_id {
+	ST_HITS,
+	ST_MISSES,
+	ST_BYPASS_HITS,
+	ST_BYPASS_MISSES,
+	ST_COLLISIONS,
+	ST_BYPASSED,
+	ST_DIRTY,
+	ST_WB_RATE,
+	ST_CONGESTED,
+	ST_BTREE_CACHE,
+	ST_GC_LAST,
+	ST_GC_DURATION,
+	ST_NR,
+};
+
+static const char * const stat_paths[] = {
+	[ST_HITS]		= "stats_total/cache_hits",
+	[ST_MISSES]		= "stats_total/cache_misses",
+	[ST_BYPASS_HITS]	= "stats_total/cache_bypass_hits",
+	[ST_BYPASS_MISSES]	= "stats_total/cache_bypass_misses",
+	[ST_COLLISIONS]		= "stats_total/cache_miss_collisions",
+	[ST_BYPASSED]		= "stats_total/bypassed",
+	[ST_DIRTY]		= "dirty_data",
+	[ST_WB_RATE]		= "writeback_rate",
+	[ST_CONGESTED]		= "congested",
+	[ST_BTREE_CACHE]	= "btree_cache_size",
+	[ST_GC_LAST]		= "internal/btree_gc_last_sec",
+	[ST_GC_DURATION]	= "internal/btree_gc_average_duration_ms",
+};
+
+struct node {
+	char		name[64];
+	bool		is_set;
+	int		fd[ST_NR];
+	uint64_t	cur[ST_NR];
+	uint64_t	prev[ST_NR];
+	uint64_t	res[ST_NR];	/* bytes a sample's last digit is worth */
+};
+
+static struct node *nodes;
+static unsigned nr_nodes;
+
+/*
+ * sysfs prints sizes with bch_hprint(): "512", "1.5k", "20.0M", "120G"...
+ * so three digits at most; @res is what the last one is worth.
+ */
+static uint64_t parse_hprint(const char *buf, uint64_t *res)
+{
+	static const char units[] = "kMGTPEZY";
+	uint64_t v = 0, frac = 0, div = 1;
+	const char *u;
+
+	for (; isdigit(*buf); buf++)
+		v = v * 10 + *buf - '0';
+
+	if (*buf == '.')
+		for (buf++; isdigit(*buf); buf++) {
+			frac = frac * 10 + *buf - '0';
+			div *= 10;
+		}
+
+	u = *buf ? strchr(units, *buf) : NULL;
+	if (u) {
+		unsigned shift = (u - units + 1) * 10;
+
+		*res = (1ULL << shift) / div;
+		return (v << shift) + ((frac << shift) / div);
+	}
+
+	*res = 1;
+	return v;
+}
+
+static struct node *add_node(const char *dir, const char *name, bool is_set)
+{
+	char path[PATH_MAX];
+	struct node *n;
+	unsigned i;
+
+	n = realloc(nodes, (nr_nodes + 1) * sizeof(*nodes));
+	if (!n) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	nodes = n;
+	n = &nodes[nr_nodes++];
+
+	memset(n, 0, sizeof(*n));
+	snprintf(n->name, sizeof(n->name), "%s", name);
+	n->is_set = is_set;
+
+	for (i = 0; i < ST_NR; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, stat_paths[i]);
+		n->fd[i] = open(path, O_RDONLY|O_CLOEXEC);
+	}
+
+	return n;
+}
+
+static void close_nodes(void)
+{
+	unsigned i, j;
+
+	for (i = 0; i < nr_nodes; i++)
+		for (j = 0; j < ST_NR; j++)
+			if (nodes[i].fd[j] >= 0)
+				close(nodes[i].fd[j]);
+
+	free(nodes);
+	nodes = NULL;
+	nr_nodes = 0;
+}
+
+static bool is_uuid(const char *s)
+{
+	unsigned i;
+
+	for (i = 0; i < 36; i++)
+		if ((i == 8 || i == 13 || i == 18 || i == 23)
+		    ? s[i] != '-' : !isxdigit(s[i]))
+			return false;
+
+	return !s[36];
+}
+
+/*
+ * The backing device's bcache directory is <disk>/bcache, with a dev link
+ * to the bcacheN device it's cached as.
+ */
+static void bdev_name(const char *dir, char *name, size_t size)
+{
+	char path[PATH_MAX], link[PATH_MAX], real[PATH_MAX];
+	const char *bcache = "?", *disk = "?", *p;
+	ssize_t len;
+
+	len = -1;
+	if (snprintf(path, sizeof(path), "%s/dev", dir) < sizeof(path))
+		len = readlink(path, link, sizeof(link) - 1);
+	if (len > 0) {
+		link[len] = '\0';
+		p = strrchr(link, '/');
+		bcache = p ? p + 1 : link;
+	}
+
+	if (realpath(dir, real)) {
+		*strrchr(real, '/') = '\0';
+		p = strrchr(real, '/');
+		disk = p ? p + 1 : real;
+	}
+
+	snprintf(name, size, "%.24s (%.24s)", bcache, disk);
+}
+
+/*
+ * Sets are named by their uuid, and link to their backing devices. Returns
+ * how many of both there are, and with @add, makes a node for each.
+ */
+static unsigned walk(bool add)
+{
+	char set_dir[PATH_MAX], bdev_dir[PATH_MAX], name[64];
+	struct dirent *e, *b;
+	DIR *sets, *set;
+	unsigned nr = 0;
+
+	sets = opendir(SYSFS_BCACHE);
+	if (!sets) {
+		perror("Error opening " SYSFS_BCACHE);
+		fprintf(stderr, "The bcache kernel module must be loaded\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while ((e = readdir(sets))) {
+		if (!is_uuid(e->d_name))
+			continue;
+
+		snprintf(set_dir, sizeof(set_dir), SYSFS_BCACHE "/%s",
+			 e->d_name);
+		if (add)
+			add_node(set_dir, e->d_name, true);
+		nr++;
+
+		set = opendir(set_dir);
+		if (!set)
+			continue;
+
+		while ((b = readdir(set))) {
+			if (strncmp(b->d_name, "bdev", 4) ||
+			    !isdigit(b->d_name[4]))
+				continue;
+
+			if (snprintf(bdev_dir, sizeof(bdev_dir), "%s/%s",
+				     set_dir, b->d_name) >= sizeof(bdev_dir))
+				continue;
+
+			if (add) {
+				bdev_name(bdev_dir, name, sizeof(name));
+				add_node(bdev_dir, name, false);
+			}
+			nr++;
+		}
+
+		closedir(set);
+	}
+
+	closedir(sets);
+	return nr;
+}
+
+static void scan(void)
+{
+	close_nodes();
+	walk(true);
+}
+
+/*
+ * sysfs directories don't change their mtime, so count what's there each
+ * interval to notice sets and backing devices registered since the last
+ * scan; one that went away makes sample() fail anyway.
+ */
+static bool new_devices(void)
+{
+	return walk(false) != nr_nodes;
+}
+
+/* Returns false if a device went away, and we need to scan again */
+static bool sample(void)
+{
+	char buf[64];
+	unsigned i, j;
+	ssize_t ret;
+
+	for (i = 0; i < nr_nodes; i++) {
+		struct node *n = &nodes[i];
+
+		memcpy(n->prev, n->cur, sizeof(n->cur));
+
+		for (j = 0; j < ST_NR; j++) {
+			if (n->fd[j] < 0)
+				continue;
+
+			ret = pread(n->fd[j], buf, sizeof(buf) - 1, 0);
+			if (ret < 0)
+				return false;
+
+			buf[ret] = '\0';
+			n->cur[j] = parse_hprint(buf, &n->res[j]);
+		}
+	}
+
+	return true;
+}
+
+static uint64_t delta(struct node *n, enum stat_id s)
+{
+	return n->cur[s] - n->prev[s];
+}
+
+/*
+ * A rate of a rounded counter: once the counter is in the gigabytes, a few
+ * intervals' worth of change is lost in the rounding, so the rate is either
+ * 0 or a whole step. Show those as bounds or approximations instead.
+ */
+static void rounded_rate(char *buf, size_t size, struct node *n,
+			 enum stat_id s, double secs)
+{
+	uint64_t d = delta(n, s), res = n->res[s] ? n->res[s] : 1;
+	double mb = d / secs / 1048576;
+
+	if (res == 1 || d >= res * 10)
+		snprintf(buf, size, "%.1f", mb);
+	else if (!d)
+		snprintf(buf, size, "<%.1f", res / secs / 1048576);
+	else
+		snprintf(buf, size, "~%.1f", mb);
+}
+
+static double ratio(uint64_t n, uint64_t d)
+{
+	return d ? n * 100.0 / d : 0;
+}
+
+static void print_header(void)
+{
+	printf("%-40s %6s %6s %9s %9s %9s %9s %10s %8s %8s %9s %9s\n",
+	       "device", "hit%", "byp%", "hits/s", "miss/s", "coll/s",
+	       "bypMB/s", "dirtyMB", "wbMB/s", "congMB", "btreeMB", "gc");
+}
+
+/*
+ * GC activity is shown as how long ago the last one finished, with a * if
+ * one ran during this interval, and its average duration.
+ */
+static void print_node(struct node *n, uint64_t dirty, uint64_t wb,
+		       double secs)
+{
+	uint64_t hits = delta(n, ST_HITS), misses = delta(n, ST_MISSES);
+	uint64_t bypass = delta(n, ST_BYPASS_HITS) + delta(n, ST_BYPASS_MISSES);
+	char gc[32] = "-", byp[32];
+
+	if (n->is_set && n->fd[ST_GC_LAST] >= 0)
+		snprintf(gc, sizeof(gc), "%s%lus/%lums",
+			 n->cur[ST_GC_LAST] < n->prev[ST_GC_LAST] ||
+			 n->cur[ST_GC_LAST] < secs ? "*" : "",
+			 (unsigned long) n->cur[ST_GC_LAST],
+			 (unsigned long) n->cur[ST_GC_DURATION]);
+
+	rounded_rate(byp, sizeof(byp), n, ST_BYPASSED, secs);
+
+	printf("%s%-*s %6.1f %6.1f %9.0f %9.0f %9.0f %9s %10.1f %8.1f",
+	       n->is_set ? "" : "  ", n->is_set ? 40 : 38, n->name,
+	       ratio(hits, hits + misses),
+	       ratio(bypass, hits + misses + bypass),
+	       hits / secs, misses / secs, delta(n, ST_COLLISIONS) / secs,
+	       byp,
+	       dirty / 1048576.0, wb / 1048576.0);
+
+	if (n->is_set)
+		printf(" %8.1f %9.1f %9s\n",
+		       n->cur[ST_CONGESTED] / 1048576.0,
+		       n->cur[ST_BTREE_CACHE] / 1048576.0, gc);
+	else
+		printf(" %8s %9s %9s\n", "-", "-", "-");
+}
+
+static void report(double secs)
+{
+	unsigned i, j;
+
+	print_header();
+
+	for (i = 0; i < nr_nodes; i = j) {
+		uint64_t dirty = 0, wb = 0;
+
+		/* a set's dirty data and writeback are its backing devices' */
+		for (j = i + 1; j < nr_nodes && !nodes[j].is_set; j++) {
+			dirty	+= nodes[j].cur[ST_DIRTY];
+			wb	+= nodes[j].cur[ST_WB_RATE];
+		}
+
+		print_node(&nodes[i], dirty, wb, secs);
+
+		for (j = i + 1; j < nr_nodes && !nodes[j].is_set; j++)
+			print_node(&nodes[j], nodes[j].cur[ST_DIRTY],
+				   nodes[j].cur[ST_WB_RATE], secs);
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: bcache-stat [interval [count]]\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	double interval = 1, last, now;
+	long count = -1;
+	struct timespec next;
+	uint64_t ns;
+	int c;
+
+	while ((c = getopt(argc, argv, "h")) != -1)
+		usage();
+
+	argv += optind;
+	argc -= optind;
+
+	if (argc > 2)
+		usage();
+	if (argc > 0 && (interval = atof(argv[0])) <= 0)
+		usage();
+	if (argc > 1 && (count = atol(argv[1])) <= 0)
+		usage();
+
+	scan();
+	if (!nr_nodes) {
+		fprintf(stderr, "No cache sets registered\n");
+		exit(EXIT_FAILURE);
+	}
+
+	sample();
+
+	last = now_seconds();
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	ns = interval * 1e9;
+
+	while (count) {
+		/* absolute deadlines, so the interval doesn't drift */
+		next.tv_sec  += (next.tv_nsec + ns) / 1000000000;
+		next.tv_nsec  = (next.tv_nsec + ns) % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &next, NULL) == EINTR)
+			;
+
+		if (new_devices() || !sample()) {
+			/* devices changed; start over with the new set */
+			scan();
+			sample();
+			last = now_seconds();
+			continue;
+		}
+
+		now = now_seconds();
+		report(now - last);
+		last = now;
+
+		if (count > 0)
+			count--;
+	}
+
+	return 0;
+}
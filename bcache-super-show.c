@@ -8,11 +8,16 @@
 #define _FILE_OFFSET_BITS	64
 #define __USE_FILE_OFFSET64
 #define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -29,7 +34,9 @@
 
 static void usage()
 {
-	fprintf(stderr, "Usage: bcache-super-show [-f] <device>\n");
+	fprintf(stderr, "Usage: bcache-super-show [-f] [-o text|json|kv] <device>\n"
+		"       bcache-super-show [-o text|json|kv] [-j jobs] -s | <device>...\n"
+		"       bcache-super-show [-f] --recover <device>\n");
 }
 
 
@@ -55,22 +62,588 @@ static void print_encode(char* in)
 			printf("%%%x", *pos);
 }
 
+/*
+ * Structured output (-o json / -o kv): fields are emitted in groups that
+ * become nested JSON objects, or BCACHE_<GROUP>_<KEY>=value lines in the
+ * udev style probe-bcache -o udev uses.
+ */
+enum output_format {
+	OUTPUT_TEXT,
+	OUTPUT_JSON,
+	OUTPUT_KV,
+};
+
+static enum output_format output = OUTPUT_TEXT;
+static bool out_compact;		/* one JSON object per line */
+static const char *out_groups[4];
+static unsigned out_depth;
+static bool out_first;
+
+static void out_indent(void)
+{
+	if (!out_compact) {
+		putchar('\n');
+		for (unsigned i = 0; i <= out_depth; i++)
+			putchar('\t');
+	}
+}
+
+static void out_kv_name(const char *name)
+{
+	for (const char *p = name; *p; p++)
+		putchar(*p == '.' ? '_' : toupper(*p));
+}
+
+static void out_key(const char *key)
+{
+	if (output == OUTPUT_JSON) {
+		if (!out_first)
+			putchar(',');
+		out_first = false;
+		out_indent();
+		printf("\"%s\":%s", key, out_compact ? "" : " ");
+	} else {
+		printf("BCACHE_");
+		for (unsigned i = 0; i < out_depth; i++) {
+			out_kv_name(out_groups[i]);
+			putchar('_');
+		}
+		out_kv_name(key);
+		putchar('=');
+	}
+}
+
+static void out_begin(void)
+{
+	out_depth = 0;
+	out_first = true;
+	if (output == OUTPUT_JSON)
+		putchar('{');
+}
+
+static void out_end(void)
+{
+	if (output == OUTPUT_JSON) {
+		if (!out_compact)
+			putchar('\n');
+		printf("}\n");
+	} else if (out_compact) {
+		/* blank line between the records of a batch */
+		putchar('\n');
+	}
+}
+
+static void out_group_begin(const char *name)
+{
+	if (output == OUTPUT_JSON) {
+		out_key(name);
+		putchar('{');
+		out_first = true;
+	}
+	out_groups[out_depth++] = name;
+}
+
+static void out_group_end(void)
+{
+	out_depth--;
+	if (output == OUTPUT_JSON) {
+		if (!out_first)
+			out_indent();
+		putchar('}');
+		out_first = false;
+	}
+}
+
+static void out_str(const char *key, const char *v)
+{
+	out_key(key);
+
+	if (output == OUTPUT_KV) {
+		print_encode((char *) v);
+		putchar('\n');
+		return;
+	}
+
+	putchar('"');
+	for (const unsigned char *p = (const unsigned char *) v; *p; p++)
+		if (*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if (*p < 0x20 || *p >= 0x7f)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	putchar('"');
+}
+
+static void out_u64(const char *key, uint64_t v)
+{
+	out_key(key);
+	printf("%" PRIu64 "%s", v, output == OUTPUT_KV ? "\n" : "");
+}
+
+static void out_bool(const char *key, bool v)
+{
+	out_key(key);
+	if (output == OUTPUT_KV)
+		printf("%u\n", v);
+	else
+		printf("%s", v ? "true" : "false");
+}
+
+/* 64 bit values that JSON consumers would otherwise round */
+static void out_hex(const char *key, uint64_t v)
+{
+	char buf[17];
+
+	snprintf(buf, sizeof(buf), "%" PRIX64, v);
+	out_str(key, buf);
+}
+
+/*
+ * Everything the text output decodes; if the magic is bad nothing past it
+ * means anything, so only that is emitted.
+ */
+static void emit_sb(const struct cache_sb *sb)
+{
+	char uuid[40], label[SB_LABEL_SIZE + 1];
+	bool bdev = SB_IS_BDEV(sb), keys_ok;
+	uint64_t expected_csum;
+
+	out_group_begin("sb");
+	if (memcmp(sb->magic, bcache_magic, 16)) {
+		out_str("magic", "bad");
+		out_group_end();
+		return;
+	}
+
+	/* keys bounds what csum_set() reads */
+	keys_ok = sb->keys <= SB_JOURNAL_BUCKETS;
+	expected_csum = keys_ok ? csum_set(sb) : 0;
+
+	out_str("magic", "ok");
+	out_u64("first_sector", sb->offset);
+	out_bool("first_sector_ok", sb->offset == SB_SECTOR);
+	out_hex("csum", sb->csum);
+	if (keys_ok)
+		out_hex("csum_expected", expected_csum);
+	out_bool("csum_ok", keys_ok && sb->csum == expected_csum);
+	out_u64("version", sb->version);
+	out_str("type", sb->version > BCACHE_SB_MAX_VERSION ? "unknown"
+		: bdev ? "backing" : "cache");
+	out_group_end();
+
+	if (sb->version > BCACHE_SB_MAX_VERSION)
+		return;
+
+	strncpy(label, (char *) sb->label, SB_LABEL_SIZE);
+	label[SB_LABEL_SIZE] = '\0';
+	uuid_unparse(sb->uuid, uuid);
+
+	out_group_begin("dev");
+	out_str("label", label);
+	out_str("uuid", uuid);
+	out_u64("sectors_per_block", sb->block_size);
+	out_u64("sectors_per_bucket", sb->bucket_size);
+	out_bool("zoned", SB_ZONED(sb));
+
+	if (!bdev) {
+		out_group_begin("cache");
+		out_u64("first_sector", sb->bucket_size * sb->first_bucket);
+		out_u64("cache_sectors",
+			sb->bucket_size * (sb->nbuckets - sb->first_bucket));
+		out_u64("total_sectors", sb->bucket_size * sb->nbuckets);
+		out_bool("ordered", CACHE_SYNC(sb));
+		out_bool("discard", CACHE_DISCARD(sb));
+		out_u64("pos", sb->nr_this_dev);
+		out_u64("replacement", CACHE_REPLACEMENT(sb));
+		out_str("replacement_name",
+			cache_replacement_name(CACHE_REPLACEMENT(sb)));
+		out_group_end();
+	} else {
+		out_group_begin("data");
+		out_u64("first_sector", sb_data_offset(sb));
+		out_u64("cache_mode", BDEV_CACHE_MODE(sb));
+		out_str("cache_mode_name",
+			bdev_cache_mode_name(BDEV_CACHE_MODE(sb)));
+		out_u64("cache_state", BDEV_STATE(sb));
+		out_str("cache_state_name",
+			bdev_state_name(BDEV_STATE(sb)));
+		out_group_end();
+	}
+	out_group_end();
+
+	uuid_unparse(sb->set_uuid, uuid);
+	out_group_begin("cset");
+	out_str("uuid", uuid);
+	out_group_end();
+}
+
+/* Same checks and exit codes as the text output */
+static int show_structured(const struct cache_sb *sb, bool force_csum)
+{
+	out_begin();
+	emit_sb(sb);
+	out_end();
+
+	switch (sb_check(sb)) {
+	case SB_BAD_MAGIC:
+		fprintf(stderr, "Invalid superblock (bad magic)\n");
+		return 2;
+	case SB_BAD_OFFSET:
+		fprintf(stderr, "Invalid superblock (bad sector)\n");
+		return 2;
+	case SB_BAD_CSUM:
+		if (!force_csum) {
+			fprintf(stderr, "Corrupt superblock (bad csum)\n");
+			return 2;
+		}
+	default:
+		break;
+	}
+	if (sb->version == BCACHE_SB_VERSION_BDEV_WITH_OFFSET &&
+	    (sb->keys == 1 || sb->d[0])) {
+		fprintf(stderr,
+			"Possible experimental format detected, bailing\n");
+		return 3;
+	}
+
+	return 0;
+}
+
+/*
+ * Batch mode: read the superblocks of many devices in parallel and print a
+ * one line summary for each, so scanning a whole host costs one process and
+ * roughly one device latency per thread.
+ */
+
+static void print_probe(const struct sb_probe *p)
+{
+	const struct cache_sb *sb = &p->sb;
+	char uuid[40], set_uuid[40];
+
+	if (output != OUTPUT_TEXT) {
+		out_begin();
+		out_str("device", p->dev);
+		out_str("status", sb_status_str(p->status));
+		if (p->status == SB_ERR_OPEN || p->status == SB_ERR_READ)
+			out_str("error", strerror(p->error));
+		else
+			emit_sb(sb);
+		out_end();
+		return;
+	}
+
+	printf("%s\t%s", p->dev, sb_status_str(p->status));
+
+	if (p->status == SB_ERR_OPEN || p->status == SB_ERR_READ) {
+		printf("\t%s\n", strerror(p->error));
+		return;
+	}
+
+	if (p->status == SB_BAD_MAGIC) {
+		putchar('\n');
+		return;
+	}
+
+	uuid_unparse(sb->uuid, uuid);
+	uuid_unparse(sb->set_uuid, set_uuid);
+
+	printf("\t%s\tversion=%" PRIu64 "\tuuid=%s\tcset.uuid=%s",
+	       sb->version > BCACHE_SB_MAX_VERSION ? "unknown" :
+	       SB_IS_BDEV(sb) ? "backing" : "cache",
+	       sb->version, uuid, set_uuid);
+
+	if (sb->version > BCACHE_SB_MAX_VERSION)
+		;
+	else if (SB_IS_BDEV(sb))
+		printf("\tdata_offset=%" PRIu64 "\tcache_mode=%" PRIu64
+		       "\tstate=%" PRIu64,
+		       sb_data_offset(sb),
+		       BDEV_CACHE_MODE(sb), BDEV_STATE(sb));
+	else
+		printf("\tnbuckets=%" PRIu64 "\tbucket_size=%u"
+		       "\tblock_size=%u\tnr_this_dev=%u",
+		       sb->nbuckets, sb->bucket_size,
+		       sb->block_size, sb->nr_this_dev);
+
+	putchar('\n');
+}
+
+/* Every block device and partition the kernel knows about */
+static unsigned scan_devices(char ***devs)
+{
+	char line[256], name[128];
+	unsigned n = 0, size = 64;
+	FILE *f;
+
+	if (!(f = fopen("/proc/partitions", "r"))) {
+		perror("Can't open /proc/partitions");
+		exit(2);
+	}
+
+	*devs = malloc(size * sizeof(char *));
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned maj, min;
+		unsigned long long blocks;
+
+		if (sscanf(line, " %u %u %llu %127s",
+			   &maj, &min, &blocks, name) != 4)
+			continue;
+
+		if (n == size)
+			*devs = realloc(*devs, (size *= 2) * sizeof(char *));
+		if (!*devs || asprintf(&(*devs)[n], "/dev/%s", name) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			exit(2);
+		}
+		n++;
+	}
+
+	fclose(f);
+	return n;
+}
+
+static int batch_show(char **devs, unsigned ndevs, unsigned jobs)
+{
+	struct sb_probe *probes = calloc(ndevs, sizeof(*probes));
+	unsigned i;
+
+	if (!probes) {
+		fprintf(stderr, "Out of memory\n");
+		exit(2);
+	}
+
+	for (i = 0; i < ndevs; i++)
+		probes[i].dev = devs[i];
+
+	sb_probe_all(probes, ndevs, jobs);
+
+	out_compact = true;
+
+	for (i = 0; i < ndevs; i++)
+		print_probe(&probes[i]);
+
+	free(probes);
+	return 0;
+}
+
+/*
+ * --recover: read the primary superblock and the backup copies make-bcache
+ * writes (see SB_BACKUP_SECTOR) in parallel, and if the newest good one by
+ * seq isn't the primary, write it back over the primary.
+ */
+enum { SB_COPY_PRIMARY, SB_COPY_BACKUP, SB_COPY_END, SB_COPIES };
+
+static const char * const sb_copy_names[] = {
+	[SB_COPY_PRIMARY]	= "primary",
+	[SB_COPY_BACKUP]	= "backup",
+	[SB_COPY_END]		= "backup-end",
+};
+
+/* A copy is only a backup if it says so, and belongs where it was found */
+static bool backup_plausible(const struct sb_probe *p, unsigned copy)
+{
+	const struct cache_sb *sb = &p->sb;
+
+	if (p->status != SB_OK)
+		return false;
+	if (copy == SB_COPY_PRIMARY)
+		return true;
+	if (!SB_BACKUP(sb) || sb->version > BCACHE_SB_MAX_VERSION)
+		return false;
+
+	if (copy == SB_COPY_END)
+		return !SB_IS_BDEV(sb) &&
+			bucket_to_offset(sb, sb->nbuckets) <= p->offset;
+
+	return !SB_IS_BDEV(sb) ||
+		(sb->version == BCACHE_SB_VERSION_BDEV_WITH_OFFSET &&
+		 sb->data_offset >= SB_BACKUP_SECTOR + SB_BACKUP_SIZE / 512);
+}
+
+static int recover_sb(char *dev, bool force)
+{
+	struct sb_probe copies[SB_COPIES] = {
+		[SB_COPY_PRIMARY]	= { .dev = dev },
+		[SB_COPY_BACKUP]	= { .dev = dev,
+					    .offset = SB_BACKUP_SECTOR << 9 },
+		[SB_COPY_END]		= { .dev = dev },
+	};
+	struct sb_probe *best = NULL;
+	unsigned i, ncopies = SB_COPIES;
+	char uuid[40];
+	uint64_t size;
+	struct stat statbuf;
+	int fd, ret;
+
+	fd = open(dev, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open dev %s: %s\n", dev, strerror(errno));
+		return 2;
+	}
+
+	if (fstat(fd, &statbuf)) {
+		fprintf(stderr, "Can't stat %s: %s\n", dev, strerror(errno));
+		return 2;
+	}
+	size = statbuf.st_size;
+	if (S_ISBLK(statbuf.st_mode) && ioctl(fd, BLKGETSIZE64, &size)) {
+		fprintf(stderr, "Can't get the size of %s: %s\n",
+			dev, strerror(errno));
+		return 2;
+	}
+
+	/* too small to have room for the copy at the end */
+	if (size < (SB_BACKUP_SECTOR << 9) + 2 * SB_BACKUP_SIZE)
+		ncopies = SB_COPY_END;
+	else
+		copies[SB_COPY_END].offset = SB_BACKUP_END(size);
+
+	sb_probe_all(copies, ncopies, ncopies);
+
+	/* the newest good copy; the primary wins a tie */
+	for (i = 0; i < ncopies; i++) {
+		struct sb_probe *p = &copies[i];
+
+		printf("%s\tsector %" PRIu64 "\t%s", sb_copy_names[i],
+		       (p->offset ?: SB_START) >> 9, sb_status_str(p->status));
+		if (p->status == SB_ERR_OPEN || p->status == SB_ERR_READ)
+			printf("\t%s", strerror(p->error));
+		else if (p->status != SB_BAD_MAGIC)
+			printf("\tseq=%" PRIu64, p->sb.seq);
+		if (p->status == SB_OK && !backup_plausible(p, i))
+			printf("\t[not a backup, ignored]");
+		putchar('\n');
+
+		if (backup_plausible(p, i) &&
+		    (!best || p->sb.seq > best->sb.seq))
+			best = p;
+	}
+
+	if (!best) {
+		fprintf(stderr, "No good superblock copy on %s\n", dev);
+		return 2;
+	}
+
+	if (best == &copies[SB_COPY_PRIMARY]) {
+		printf("Primary superblock is good, nothing to recover\n");
+		return 0;
+	}
+
+	/* no magic is what wipefs leaves, or another filesystem */
+	if (copies[SB_COPY_PRIMARY].status == SB_BAD_MAGIC && !force) {
+		fprintf(stderr, "%s has no bcache superblock at all; if it "
+			"wasn't wiped on purpose, or reused, pass -f\n", dev);
+		return 2;
+	}
+
+	/*
+	 * A cache's backup has CACHE_SYNC clear and the journal buckets of a
+	 * new cache, so on the next register the kernel sees a new cache set
+	 * and invalidates it: whatever was dirty on it is gone.
+	 */
+	if (!SB_IS_BDEV(&best->sb)) {
+		fprintf(stderr, "Warning: %s is a cache device, and its backup "
+			"is as formatted: the kernel will treat the restored "
+			"cache as new and discard its contents, and any dirty "
+			"data on it will be lost\n", dev);
+		if (!force) {
+			fprintf(stderr, "Pass -f to restore it anyway\n");
+			return 2;
+		}
+	}
+
+	uuid_unparse(best->sb.uuid, uuid);
+	printf("Restoring primary superblock from %s copy, seq %" PRIu64
+	       ", uuid %s\n", sb_copy_names[best - copies], best->sb.seq, uuid);
+
+	/*
+	 * Written once, at format time: the kernel only updates the primary,
+	 * so the backup's state is NONE, and attaching a device in that state
+	 * drops its uuid entry, dirty extents and all. Restored as dirty, an
+	 * attach finds the old entry and writes back, or fails with ENOENT.
+	 */
+	if (SB_IS_BDEV(&best->sb)) {
+		SET_BDEV_STATE(&best->sb, BDEV_STATE_DIRTY);
+		sb_set_csum(&best->sb);
+	}
+
+	if ((ret = sb_write(fd, 0, &best->sb)) ||
+	    (fsync(fd) && (ret = -errno))) {
+		fprintf(stderr, "Error writing superblock to %s: %s\n",
+			dev, strerror(-ret));
+		return 2;
+	}
+
+	if (SB_IS_BDEV(&best->sb))
+		printf("Backing device restored as dirty: attached to its old "
+		       "cache set, what is still cached for it is written "
+		       "back. The kernel won't attach it to any other; "
+		       "without a cache, start it with bcache/running\n");
+
+	close(fd);
+	return 0;
+}
+
 
 int main(int argc, char **argv)
 {
-	bool force_csum = false;
+	bool force_csum = false, scan = false, recover = false;
+	unsigned jobs = 32;
 	int o;
 	extern char *optarg;
 	struct cache_sb sb;
 	char uuid[40];
 	uint64_t expected_csum;
 
-	while ((o = getopt(argc, argv, "f")) != EOF)
+	struct option opts[] = {
+		{ "recover",	0, NULL,	'r' },
+		{ NULL,		0, NULL,	0 },
+	};
+
+	while ((o = getopt_long(argc, argv, "fsj:o:", opts, NULL)) != EOF)
 		switch (o) {
+			case 'r':
+				recover = true;
+				break;
+
 			case 'f':
 				force_csum = 1;
 				break;
 
+			case 's':
+				scan = true;
+				break;
+
+			case 'o':
+				if (!strcmp(optarg, "json"))
+					output = OUTPUT_JSON;
+				else if (!strcmp(optarg, "kv") ||
+					 !strcmp(optarg, "udev"))
+					output = OUTPUT_KV;
+				else if (strcmp(optarg, "text")) {
+					fprintf(stderr, "Invalid output format %s\n",
+						optarg);
+					exit(1);
+				}
+				break;
+
+			case 'j': {
+				unsigned long v;
+				char *e;
+
+				errno = 0;
+				v = strtoul(optarg, &e, 10);
+				if (*optarg == '-' || *e || errno || !v ||
+				    v > UINT_MAX) {
+					usage();
+					exit(1);
+				}
+				jobs = v;
+				break;
+			}
+
 			default:
 				usage();
 				exit(1);
@@ -79,6 +652,24 @@ int main(int argc, char **argv)
 	argv += optind;
 	argc -= optind;
 
+	if (recover) {
+		if (argc != 1 || scan) {
+			usage();
+			exit(1);
+		}
+		return recover_sb(argv[0], force_csum);
+	}
+
+	if (scan && !argc) {
+		char **devs;
+		unsigned ndevs = scan_devices(&devs);
+
+		return batch_show(devs, ndevs, jobs);
+	}
+
+	if (scan || argc > 1)
+		return batch_show(argv, argc, jobs);
+
 	if (argc != 1) {
 		usage();
 		exit(1);
@@ -90,11 +681,14 @@ int main(int argc, char **argv)
 		exit(2);
 	}
 
-	if (pread(fd, &sb, sizeof(sb), SB_START) != sizeof(sb)) {
+	if (sb_read(fd, 0, &sb)) {
 		fprintf(stderr, "Couldn't read\n");
 		exit(2);
 	}
 
+	if (output != OUTPUT_TEXT)
+		return show_structured(&sb, force_csum);
+
 	printf("sb.magic\t\t");
 	if (!memcmp(sb.magic, bcache_magic, 16)) {
 		printf("ok\n");
@@ -114,11 +708,14 @@ int main(int argc, char **argv)
 	}
 
 	printf("sb.csum\t\t\t%" PRIX64, sb.csum);
-	expected_csum = csum_set(&sb);
-	if (sb.csum == expected_csum) {
+	expected_csum = sb.keys <= SB_JOURNAL_BUCKETS ? csum_set(&sb) : 0;
+	if (sb.keys <= SB_JOURNAL_BUCKETS && sb.csum == expected_csum) {
 		printf(" [match]\n");
 	} else {
-		printf(" [expected %" PRIX64 "]\n", expected_csum);
+		if (sb.keys > SB_JOURNAL_BUCKETS)
+			printf(" [bad keys %u]\n", sb.keys);
+		else
+			printf(" [expected %" PRIX64 "]\n", expected_csum);
 		if (!force_csum) {
 			fprintf(stderr, "Corrupt superblock (bad csum)\n");
 			exit(2);
@@ -161,9 +758,11 @@ int main(int argc, char **argv)
 	printf("dev.uuid\t\t%s\n", uuid);
 
 	printf("dev.sectors_per_block\t%u\n"
-	       "dev.sectors_per_bucket\t%u\n",
+	       "dev.sectors_per_bucket\t%u\n"
+	       "dev.zoned\t\t%s\n",
 	       sb.block_size,
-	       sb.bucket_size);
+	       sb.bucket_size,
+	       SB_ZONED(&sb) ? "yes" : "no");
 
 	if (!SB_IS_BDEV(&sb)) {
 		// total_sectors includes the superblock;
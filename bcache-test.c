@@ -8,32 +8,33 @@
 #define _XOPEN_SOURCE 500
 #define _GNU_SOURCE
 
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <linux/aio_abi.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <linux/nvme_ioctl.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/klog.h>
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
 
-#include <openssl/rc4.h>
-#include <openssl/md4.h>
-
-static const unsigned char bcache_magic[] = {
-	0xc6, 0x85, 0x73, 0xf6, 0x4e, 0x1a, 0x45, 0xca,
-	0x82, 0x65, 0xf5, 0x7f, 0x48, 0xba, 0x6d, 0x81 };
-
-unsigned char zero[4096];
-
 bool klog = false;
 
 #define Pread(fd, buf, size, offset) do {				\
@@ -56,28 +57,55 @@ bool klog = false;
 	}								\
 } while (0)
 
+/* Per thread random state, so workers don't serialize on random() */
+struct rng {
+	struct drand48_data	d;
+	double			spare;
+};
+
+static void rng_init(struct rng *r, long seed)
+{
+	srand48_r(seed, &r->d);
+	r->spare = 0 / (double) 0;
+}
+
+static long rng_long(struct rng *r)
+{
+	long v;
+
+	lrand48_r(&r->d, &v);
+	return v;
+}
+
+static double rng_double(struct rng *r)
+{
+	double v;
+
+	drand48_r(&r->d, &v);
+	return v;
+}
+
 /* Marsaglia polar method
  */
-double normal()
+double normal(struct rng *r)
 {
 	double x, y, s;
-	static double n = 0 / (double) 0;
 
-	if (n == n) {
-		x = n;
-		n = 0 / (double) 0;
+	if (r->spare == r->spare) {
+		x = r->spare;
+		r->spare = 0 / (double) 0;
 		return x;
 	}
 
 	do {
-		x = random() / (double) (RAND_MAX / 2) - 1;
-		y = random() / (double) (RAND_MAX / 2) - 1;
+		x = rng_double(r) * 2 - 1;
+		y = rng_double(r) * 2 - 1;
 
 		s = x * x + y * y;
 	} while (s >= 1);
 
 	s = sqrt(-2 * log(s) / s);
-	n =	y * s;
+	r->spare = y * s;
 	return  x * s;
 }
 
@@ -98,13 +126,46 @@ long getblocks(int fd)
 	return ret;
 }
 
+/*
+ * Verification state, 16 bytes a page. What we wrote is regenerated from
+ * the write count, so only data that was there before we wrote the page
+ * needs a hash. Counters stick at their max. The table is a sparse
+ * mapping, so the pages of it that get touched are all that take memory,
+ * or disk space with -M.
+ */
 struct pagestuff {
-	unsigned char csum[16];
-	unsigned char oldcsum[16];
-	int readcount;
-	int writecount;
+	uint64_t	csum;		/* of what we first read, if unwritten */
+	uint32_t	readcount;
+	uint32_t	writecount;	/* generation of the data */
 };
 
+#define count_inc(c)	((c) += (c) != UINT32_MAX)
+
+static struct pagestuff *pages_alloc(unsigned long nr, const char *spill)
+{
+	size_t len = nr * sizeof(struct pagestuff);
+	void *p;
+	int fd;
+
+	if (!spill) {
+		p = mmap(NULL, len, PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		return p != MAP_FAILED ? p : NULL;
+	}
+
+	fd = open(spill, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd == -1 || ftruncate(fd, len)) {
+		perror("Error creating verification table file");
+		exit(EXIT_FAILURE);
+	}
+
+	p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return p != MAP_FAILED ? p : NULL;
+}
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void flushlog(void)
 {
 	char logbuf[1 << 21];
@@ -114,10 +175,12 @@ void flushlog(void)
 	if (!klog)
 		return;
 
+	pthread_mutex_lock(&log_lock);
+
 	if (!fd) {
 		klogctl(8, 0, 6);
 
-		sprintf(logbuf, "log.%i", abs(random()) % 1000);
+		sprintf(logbuf, "log.%i", abs(rand()) % 1000);
 		fd = open(logbuf, O_WRONLY|O_CREAT|O_TRUNC, 0644);
 
 		if (fd == -1) {
@@ -141,180 +204,2057 @@ void flushlog(void)
 		}
 		w += r;
 	}
+
+	pthread_mutex_unlock(&log_lock);
+}
+
+/* xxHash64: fast, and plenty good enough to catch corruption */
+#define XXH_P1	0x9E3779B185EBCA87ULL
+#define XXH_P2	0xC2B2AE3D27D4EB4FULL
+#define XXH_P3	0x165667B19E3779F9ULL
+#define XXH_P4	0x85EBCA77C2B2AE63ULL
+#define XXH_P5	0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, unsigned r)
+{
+	return (x << r) | (x >> (64 - r));
 }
 
-void aio_loop(int nr)
+static inline uint64_t xxh_read64(const unsigned char *p)
 {
+	uint64_t v;
 
+	memcpy(&v, p, 8);
+	return le64toh(v);
 }
 
-void usage()
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in)
 {
-	exit(EXIT_FAILURE);
+	return rotl64(acc + in * XXH_P2, 31) * XXH_P1;
 }
 
-int main(int argc, char **argv)
+static inline uint64_t xxh_merge(uint64_t h, uint64_t v)
 {
-	bool walk = false, randsize = false, verbose = false, csum = false, rtest = false, wtest = false;
-	int fd1, fd2 = 0, direct = 0, nbytes = 4096, j, o;
-	unsigned long size, i, offset = 0, done = 0, unique = 0, benchmark = 0;
-	void *buf1 = NULL, *buf2 = NULL;
-	struct pagestuff *pages, *p;
-	unsigned char c[16];
-	time_t last_printed = 0;
-	extern char *optarg;
+	return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4;
+}
 
-	RC4_KEY writedata;
-	RC4_set_key(&writedata, 16, bcache_magic);
+static uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data, *end = p + len;
+	uint64_t h;
 
-	while ((o = getopt(argc, argv, "dnwvscwlb:")) != EOF)
-		switch (o) {
-		case 'd':
-			direct = O_DIRECT;
-			break;
-		case 'n':
-			walk = true;
-			break;
-		case 'v':
-			verbose = true;
-			break;
-		case 's':
-			randsize = true;
-			break;
-		case 'c':
-			csum = true;
-			break;
-		case 'w':
-			wtest = true;
-			break;
-		case 'r':
-			rtest = true;
-			break;
-		case 'l':
-			klog = true;
-			break;
-		case 'b':
-			benchmark = atol(optarg);
-			break;
-		default:
-			usage();
-		}
+	if (len >= 32) {
+		uint64_t v1 = seed + XXH_P1 + XXH_P2;
+		uint64_t v2 = seed + XXH_P2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_P1;
 
-	argv += optind;
-	argc -= optind;
+		do {
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+
+		h = rotl64(v1, 1) + rotl64(v2, 7) +
+		    rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	} else {
+		h = seed + XXH_P5;
+	}
 
-	if (!rtest && !wtest)
-		rtest = true;
+	h += len;
 
-	if (argc < 1) {
-		printf("Please enter a device to test\n");
-		exit(EXIT_FAILURE);
+	for (; p + 8 <= end; p += 8)
+		h = rotl64(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+
+	if (p + 4 <= end) {
+		uint32_t v;
+
+		memcpy(&v, p, 4);
+		h = rotl64(h ^ (le32toh(v) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+		p += 4;
 	}
 
-	if (!csum && !benchmark && argc < 2) {
-		printf("Please enter a device to compare against\n");
-		exit(EXIT_FAILURE);
+	for (; p < end; p++)
+		h = rotl64(h ^ (*p * XXH_P5), 11) * XXH_P1;
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Log-linear latency histograms, HdrHistogram style: values below
+ * 2^HIST_SUB_BITS ns get a bucket each, above that every power of two is
+ * split into 2^HIST_SUB_BITS linear buckets, so any value is within ~3%.
+ * Fixed size, so recording never allocates.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1U << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+enum hist_type {
+	HIST_READ,
+	HIST_WRITE,
+	HIST_HIT,
+	HIST_MISS,
+	HIST_NR,
+};
+
+/*
+ * We can't see bcache's decision from here, so a read counts as a miss if
+ * it touches a page this run hasn't read or written before.
+ */
+static const char * const hist_names[] = {
+	[HIST_READ]	= "read",
+	[HIST_WRITE]	= "write",
+	[HIST_HIT]	= "hit",
+	[HIST_MISS]	= "miss",
+};
+
+struct hist {
+	uint64_t	nr;
+	uint64_t	bytes;
+	uint64_t	max;
+	uint64_t	counts[HIST_BUCKETS];
+};
+
+static inline unsigned hist_idx(uint64_t v)
+{
+	unsigned shift;
+
+	if (v < HIST_SUB)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+	return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Largest value that lands in bucket @idx */
+static uint64_t hist_high(unsigned idx)
+{
+	unsigned block = idx >> HIST_SUB_BITS, sub = idx & (HIST_SUB - 1);
+
+	if (!block)
+		return idx;
+
+	return ((uint64_t) (HIST_SUB + sub + 1) << (block - 1)) - 1;
+}
+
+static uint64_t hist_low(unsigned idx)
+{
+	return idx ? hist_high(idx - 1) + 1 : 0;
+}
+
+static inline void hist_record(struct hist *h, uint64_t v, unsigned bytes)
+{
+	h->counts[hist_idx(v)]++;
+	h->nr++;
+	h->bytes += bytes;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_add(struct hist *dst, const struct hist *src)
+{
+	unsigned i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+	dst->nr	   += src->nr;
+	dst->bytes += src->bytes;
+	dst->max    = MAX(dst->max, src->max);
+}
+
+/* @dst = @cur - @prev, for per interval numbers; max is the bucket's */
+static void hist_sub(struct hist *dst, const struct hist *cur,
+		     const struct hist *prev)
+{
+	unsigned i;
+
+	dst->max = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->counts[i] = cur->counts[i] - prev->counts[i];
+		if (dst->counts[i])
+			dst->max = hist_high(i);
 	}
+	dst->nr	   = cur->nr - prev->nr;
+	dst->bytes = cur->bytes - prev->bytes;
+	dst->max   = MIN(dst->max, cur->max);
+}
 
-	fd1 = open(argv[0], (wtest ? O_RDWR : O_RDONLY)|direct);
-	if (!csum && !benchmark)
-		fd2 = open(argv[1], (wtest ? O_RDWR : O_RDONLY)|direct);
+static uint64_t hist_percentile(const struct hist *h, double p)
+{
+	uint64_t seen = 0, want = ceil(h->nr * p);
+	unsigned i;
 
-	if (fd1 == -1 || fd2 == -1) {
-		perror("Error opening device");
-		exit(EXIT_FAILURE);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen && seen >= want)
+			return MIN(hist_high(i), h->max);
 	}
 
-	size = getblocks(fd1);
-	if (!csum && !benchmark)
-		size = MIN(size, getblocks(fd2));
+	return h->max;
+}
 
-	size = size / 8 - 16;
-	pages = calloc(size + 16, sizeof(*pages));
-	printf("size %li\n", size);
+static void hist_print(const char *name, const struct hist *h, double secs)
+{
+	if (!h->nr)
+		return;
 
-	if (posix_memalign(&buf1, 4096, 4096 * 16) ||
-	    posix_memalign(&buf2, 4096, 4096 * 16)) {
-		printf("Could not allocate buffers\n");
-		exit(EXIT_FAILURE);
+	printf("  %-5s %9" PRIu64 " ops %9.0f iops %8.1f MB/s"
+	       "  lat us p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+	       name, h->nr, h->nr / secs, h->bytes / secs / 1e6,
+	       hist_percentile(h, 0.50) / 1e3,
+	       hist_percentile(h, 0.90) / 1e3,
+	       hist_percentile(h, 0.99) / 1e3,
+	       hist_percentile(h, 0.999) / 1e3,
+	       h->max / 1e3);
+}
+
+/*
+ * Dump in a form that merges by adding counts of identical lines, e.g.
+ * across hosts: type, bucket low and high bound in ns, count.
+ */
+static void hist_dump(FILE *f, const struct hist *hists)
+{
+	unsigned i, j;
+
+	fprintf(f, "# bcache-test latency histogram v1 sub_bucket_bits %u unit ns\n",
+		HIST_SUB_BITS);
+
+	for (i = 0; i < HIST_NR; i++)
+		for (j = 0; j < HIST_BUCKETS; j++)
+			if (hists[i].counts[j])
+				fprintf(f, "%s %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+					hist_names[i], hist_low(j),
+					hist_high(j), hists[i].counts[j]);
+}
+
+#define MAX_IO		(4096 * 16)
+#define MAX_QD		32768	/* IORING_MAX_ENTRIES */
+#define MAX_THREADS	1024
+
+struct io_slot {
+	unsigned		idx;
+	bool			busy;
+	bool			writing;
+	int			nbytes;
+	unsigned long		offset;		/* bytes */
+	bool			miss;
+	unsigned long		loop;
+	uint64_t		submit_ns;
+	uint64_t		complete_ns;
+	int			res;
+	void			*buf1;
+	void			*buf2;
+	struct iovec		iov;
+	struct iocb		iocb;
+};
+
+struct worker;
+
+struct workload {
+	const char	*name;
+	int		(*parse)(const char *arg);
+	void		(*setup)(unsigned long pages);	/* per region */
+	bool		(*pick)(struct worker *w, struct io_slot *s);
+};
+
+/*
+ * An I/O engine queues slots, submits everything queued, and returns
+ * completed slots; the sync engine completes each slot as it's queued.
+ */
+struct io_engine {
+	const char	*name;
+	int		(*init)(struct worker *);
+	void		(*queue)(struct worker *, struct io_slot *);
+	int		(*submit)(struct worker *);
+	int		(*reap)(struct worker *, struct io_slot **, unsigned);
+	void		(*exit)(struct worker *);
+};
+
+struct uring {
+	int			fd;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	unsigned		to_submit;
+	void			*sq_ring, *cq_ring;
+	size_t			sq_ring_size, cq_ring_size, sqes_size;
+};
+
+struct aio {
+	aio_context_t		ctx;
+	struct iocb		**pending;
+	unsigned		npending;
+};
+
+struct worker {
+	unsigned		id;
+	pthread_t		thread;
+
+	/* Pages this worker's offsets are drawn from */
+	unsigned long		region_start;
+	unsigned long		region_pages;
+	unsigned long		page;		/* last offset, for walk */
+	unsigned long		seq_next;
+	unsigned long		seq_left;
+	bool			exhausted;	/* end of the replayed trace */
+
+	unsigned long		iterations;	/* unless t.forever */
+	unsigned long		issued;
+	unsigned long		completed;
+
+	/* sectors; read by the main thread for progress */
+	unsigned long		done;
+	unsigned long		unique;
+	uint64_t		end_ns;
+	struct hist		hist[HIST_NR];
+
+	unsigned long		last_offset;
+	int			last_nbytes;
+
+	struct rng		rng;
+
+	struct io_slot		*slots;
+	struct io_slot		**reaped;	/* t.qd of them */
+	unsigned		inflight;
+
+	/* sync engine */
+	struct io_slot		**completed_slots;
+	unsigned		ncompleted;
+
+	union {
+		struct uring	uring;
+		struct aio	aio;
+	};
+};
+
+static struct {
+	bool			randsize, verbose, csum;
+	bool			rtest, wtest, compare;
+	bool			forever;	/* not a benchmark */
+	unsigned		running;	/* workers */
+	int			fd1, fd2;
+	unsigned		qd;
+	const struct io_engine	*engine;
+	const struct workload	*workload;
+	double			seq_frac;
+	unsigned long		seq_pages;
+	struct pagestuff	*pages;
+	uint64_t		seed;
+	FILE			*trace;
+	bool			kstats;
+	bool			endurance;
+} t;
+
+/*
+ * Written data is a function of (run seed, page, write generation), so a
+ * read is checked by regenerating what it should be. Every word is hashed
+ * from its index independently, leaving the loops free to vectorise; the
+ * seed keeps data from a previous run from passing as this one's.
+ */
+static inline uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 32;
+	x *= 0xd6e8feb86659fd93ULL;
+	x ^= x >> 32;
+	x *= 0xd6e8feb86659fd93ULL;
+	x ^= x >> 32;
+	return x;
+}
+
+static uint64_t pattern_key(unsigned long page, uint32_t gen)
+{
+	return mix64(mix64(t.seed ^ page) + gen) * 4096;
+}
+
+static void pattern_fill(void *buf, unsigned long page, uint32_t gen)
+{
+	uint64_t *p = buf, key = pattern_key(page, gen);
+	unsigned i;
+
+	for (i = 0; i < 4096 / 8; i++)
+		p[i] = mix64(key + i);
+}
+
+static bool pattern_check(const void *buf, unsigned long page, uint32_t gen)
+{
+	const uint64_t *p = buf;
+	uint64_t key = pattern_key(page, gen), diff = 0;
+	unsigned i;
+
+	for (i = 0; i < 4096 / 8; i++)
+		diff |= p[i] ^ mix64(key + i);
+
+	return !diff;
+}
+
+static int sync_rw(int fd, bool writing, void *buf, int size,
+		   unsigned long offset)
+{
+	if (writing)
+		Pwrite(fd, buf, size, offset);
+	else
+		Pread(fd, buf, size, offset);
+	return 0;
+err:
+	return -(errno ?: EIO);
+}
+
+/* Synchronous engine: one blocking pread/pwrite at a time */
+
+static int sync_init(struct worker *w)
+{
+	w->completed_slots = calloc(t.qd, sizeof(*w->completed_slots));
+	return w->completed_slots ? 0 : -ENOMEM;
+}
+
+static void sync_queue(struct worker *w, struct io_slot *s)
+{
+	s->res = sync_rw(t.fd1, s->writing, s->buf1, s->nbytes, s->offset);
+	if (!s->res)
+		s->res = s->nbytes;
+	s->complete_ns = now_ns();
+	w->completed_slots[w->ncompleted++] = s;
+}
+
+static int sync_submit(struct worker *w)
+{
+	return 0;
+}
+
+static int sync_reap(struct worker *w, struct io_slot **done, unsigned max)
+{
+	unsigned n = MIN(max, w->ncompleted);
+
+	memcpy(done, w->completed_slots, n * sizeof(*done));
+	w->ncompleted -= n;
+	memmove(w->completed_slots, w->completed_slots + n,
+		w->ncompleted * sizeof(*done));
+	return n;
+}
+
+static void sync_exit(struct worker *w)
+{
+	free(w->completed_slots);
+}
+
+static const struct io_engine sync_engine = {
+	.name	= "sync",
+	.init	= sync_init,
+	.queue	= sync_queue,
+	.submit	= sync_submit,
+	.reap	= sync_reap,
+	.exit	= sync_exit,
+};
+
+/*
+ * io_uring, driven with the raw syscalls so that we don't need liburing:
+ * one ring per worker, sized to the queue depth.
+ */
+
+static int uring_init(struct worker *w)
+{
+	struct uring *u = &w->uring;
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, t.qd, &p);
+	if (u->fd < 0)
+		return -errno;
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size	= p.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	u->sqes	   = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sq_ring == MAP_FAILED ||
+	    u->cq_ring == MAP_FAILED ||
+	    u->sqes == MAP_FAILED) {
+		close(u->fd);
+		return -ENOMEM;
 	}
-	//setvbuf(stdout, NULL, _IONBF, 0);
 
-	for (i = 0; !benchmark || i < benchmark; i++) {
-		bool writing = (wtest && (i & 1)) || !rtest;
-		nbytes = randsize ? drand48() * 16 + 1 : 1;
-		nbytes <<= 12;
+	u->sq_head	= u->sq_ring + p.sq_off.head;
+	u->sq_tail	= u->sq_ring + p.sq_off.tail;
+	u->sq_mask	= u->sq_ring + p.sq_off.ring_mask;
+	u->sq_array	= u->sq_ring + p.sq_off.array;
+	u->cq_head	= u->cq_ring + p.cq_off.head;
+	u->cq_tail	= u->cq_ring + p.cq_off.tail;
+	u->cq_mask	= u->cq_ring + p.cq_off.ring_mask;
+	u->cqes		= u->cq_ring + p.cq_off.cqes;
+
+	return 0;
+}
 
-		offset >>= 12;
-		offset += walk ? normal() * 20 : random();
-		offset %= size;
-		offset <<= 12;
+static void uring_queue(struct worker *w, struct io_slot *s)
+{
+	struct uring *u = &w->uring;
+	unsigned tail = *u->sq_tail, idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
 
-		if (!(i % 200))
-			flushlog();
+	s->iov.iov_base = s->buf1;
+	s->iov.iov_len	= s->nbytes;
 
-		if (!verbose) {
-			time_t now = time(NULL);
-			if (now - last_printed >= 2) {
-				last_printed = now;
-				goto print;
-			}
-		} else
-print:			printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
-			       i, offset >> 9, nbytes >> 9, done >> 11, unique >> 11);
-
-		done += nbytes >> 9;
-
-		if (!writing)
-			Pread(fd1, buf1, nbytes, offset);
-		if (!writing && !csum && !benchmark)
-			Pread(fd2, buf2, nbytes, offset);
-
-		for (j = 0; j < nbytes; j += 4096) {
-			p = &pages[(offset + j) / 4096];
-
-			if (writing)
-				RC4(&writedata, 4096, zero, buf1 + j);
-
-			if (csum) {
-				MD4(buf1 + j, 4096, &c[0]);
-
-				if (writing ||
-				    (!p->readcount && !p->writecount)) {
-					memcpy(&p->oldcsum[0], &p->csum[0], 16);
-					memcpy(&p->csum[0], c, 16);
-				} else if (memcmp(&p->csum[0], c, 16))
-					goto bad;
-			} else if (!writing && !benchmark &&
-				   memcmp(buf1 + j,
-					  buf2 + j,
-					  4096))
-				goto bad;
-
-			if (!p->writecount && !p->readcount)
-				unique += 8;
-
-			writing ? p->writecount++ : p->readcount++;
-		}
-		if (writing)
-			Pwrite(fd1, buf1, nbytes, offset);
-		if (writing && !csum && !benchmark)
-			Pwrite(fd2, buf2, nbytes, offset);
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode	= s->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd		= t.fd1;
+	sqe->addr	= (unsigned long) &s->iov;
+	sqe->len	= 1;
+	sqe->off	= s->offset;
+	sqe->user_data	= s->idx;
+
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+}
+
+static int uring_submit(struct worker *w)
+{
+	struct uring *u = &w->uring;
+	int ret;
+
+	ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, 1,
+		      IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret < 0)
+		return -errno;
+
+	u->to_submit -= ret;
+	return 0;
+}
+
+static int uring_reap(struct worker *w, struct io_slot **done, unsigned max)
+{
+	struct uring *u = &w->uring;
+	unsigned head = *u->cq_head, n = 0;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	uint64_t now = now_ns();
+
+	while (head != tail && n < max) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		struct io_slot *s = &w->slots[cqe->user_data];
+
+		s->res		= cqe->res;
+		s->complete_ns	= now;
+		done[n++]	= s;
+		head++;
 	}
-	printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
-	       i, offset >> 9, nbytes >> 9, done >> 11, unique >> 11);
-	exit(EXIT_SUCCESS);
-err:
-	perror("IO error");
-	flushlog();
-	exit(EXIT_FAILURE);
-bad:
-	printf("Bad read! loop %li offset %li readcount %i writecount %i\n",
-	       i, (offset + j) >> 9, p->readcount, p->writecount);
 
-	if (!memcmp(&p->oldcsum[0], c, 16))
-		printf("Matches previous csum\n");
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
 
-	flushlog();
-	exit(EXIT_FAILURE);
+static void uring_exit(struct worker *w)
+{
+	struct uring *u = &w->uring;
+
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+}
+
+static const struct io_engine uring_engine = {
+	.name	= "uring",
+	.init	= uring_init,
+	.queue	= uring_queue,
+	.submit	= uring_submit,
+	.reap	= uring_reap,
+	.exit	= uring_exit,
+};
+
+/* Linux native aio, for kernels without io_uring; only async with -d */
+
+static int aio_init(struct worker *w)
+{
+	struct aio *a = &w->aio;
+
+	a->ctx = 0;
+	if (syscall(__NR_io_setup, t.qd, &a->ctx))
+		return -errno;
+
+	a->pending = calloc(t.qd, sizeof(*a->pending));
+	return a->pending ? 0 : -ENOMEM;
+}
+
+static void aio_queue(struct worker *w, struct io_slot *s)
+{
+	struct aio *a = &w->aio;
+
+	memset(&s->iocb, 0, sizeof(s->iocb));
+	s->iocb.aio_data	= s->idx;
+	s->iocb.aio_lio_opcode	= s->writing ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	s->iocb.aio_fildes	= t.fd1;
+	s->iocb.aio_buf		= (unsigned long) s->buf1;
+	s->iocb.aio_nbytes	= s->nbytes;
+	s->iocb.aio_offset	= s->offset;
+
+	a->pending[a->npending++] = &s->iocb;
+}
+
+static int aio_submit(struct worker *w)
+{
+	struct aio *a = &w->aio;
+	unsigned i = 0;
+
+	while (i < a->npending) {
+		int ret = syscall(__NR_io_submit, a->ctx, a->npending - i,
+				  a->pending + i);
+		if (ret < 0)
+			return -errno;
+		i += ret;
+	}
+
+	a->npending = 0;
+	return 0;
+}
+
+static int aio_reap(struct worker *w, struct io_slot **done, unsigned max)
+{
+	struct io_event events[max];
+	uint64_t now;
+	int i, ret;
+
+	do {
+		ret = syscall(__NR_io_getevents, w->aio.ctx, 1, max,
+			      events, NULL);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -errno;
+
+	now = now_ns();
+	for (i = 0; i < ret; i++) {
+		struct io_slot *s = &w->slots[events[i].data];
+
+		s->res		= events[i].res;
+		s->complete_ns	= now;
+		done[i]		= s;
+	}
+
+	return ret;
+}
+
+static void aio_exit(struct worker *w)
+{
+	syscall(__NR_io_destroy, w->aio.ctx);
+	free(w->aio.pending);
+}
+
+static const struct io_engine aio_engine = {
+	.name	= "aio",
+	.init	= aio_init,
+	.queue	= aio_queue,
+	.submit	= aio_submit,
+	.reap	= aio_reap,
+	.exit	= aio_exit,
+};
+
+static const struct io_engine * const engines[] = {
+	&uring_engine,
+	&aio_engine,
+	&sync_engine,
+	NULL
+};
+
+static void io_error(struct worker *w, struct io_slot *s, int err)
+{
+	pthread_mutex_lock(&log_lock);
+	fprintf(stderr, "IO error: thread %u loop %li offset %li: %s\n",
+		w->id, s->loop, s->offset >> 9, strerror(err));
+	pthread_mutex_unlock(&log_lock);
+	flushlog();
+	exit(EXIT_FAILURE);
+}
+
+static void bad_read(struct worker *w, struct io_slot *s, int j)
+{
+	unsigned long page = (s->offset + j) / 4096;
+	struct pagestuff *p = &t.pages[page];
+	const void *buf = s->buf1 + j;
+
+	pthread_mutex_lock(&log_lock);
+	printf("Bad read! loop %li offset %li readcount %u writecount %u\n",
+	       s->loop, (s->offset + j) >> 9, p->readcount, p->writecount);
+
+	if (t.csum && p->writecount > 1 &&
+	    pattern_check(buf, page, p->writecount - 1))
+		printf("Matches previous write\n");
+	else if (t.csum && p->writecount == 1 && p->readcount > 1 &&
+		 xxh64(buf, 4096, 0) == p->csum)
+		printf("Matches data from before the first write\n");
+	pthread_mutex_unlock(&log_lock);
+
+	flushlog();
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * With more than one I/O in flight, don't let a read race with a write to
+ * the same pages, or verification would see either version.
+ */
+static bool overlaps_inflight(struct worker *w, unsigned long offset,
+			      int nbytes)
+{
+	unsigned i;
+
+	for (i = 0; i < t.qd; i++) {
+		struct io_slot *s = &w->slots[i];
+
+		if (s->busy &&
+		    offset < s->offset + s->nbytes &&
+		    s->offset < offset + nbytes)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Offset generators: each sets s->offset within the worker's region, and
+ * may override the size and direction picked by prepare_op(). Returning
+ * false means there's nothing to issue yet (trace replay only).
+ */
+
+static unsigned long region_offset(struct worker *w, long page)
+{
+	page %= (long) w->region_pages;
+	if (page < 0)
+		page += w->region_pages;
+
+	return (w->region_start + page) << 12;
+}
+
+static int no_args(const char *arg)
+{
+	return arg ? -EINVAL : 0;
+}
+
+static bool uniform_pick(struct worker *w, struct io_slot *s)
+{
+	s->offset = region_offset(w, w->page + rng_long(&w->rng));
+	return true;
+}
+
+static bool walk_pick(struct worker *w, struct io_slot *s)
+{
+	s->offset = region_offset(w, w->page + (long) (normal(&w->rng) * 20));
+	return true;
+}
+
+/*
+ * Zipfian ranks by rejection-inversion (Hörmann & Derflinger), which needs
+ * no O(n) zeta table, so it works for any device size and any skew > 0.
+ * Ranks are scattered over the region by a multiplicative permutation, so
+ * the hot pages aren't all at the start of it.
+ */
+static struct {
+	double		theta;
+	double		n;
+	double		h_x1;
+	double		h_n;
+	double		s;
+	unsigned long	mult;
+} zipf = { .theta = 0.99 };
+
+static double zipf_helper1(double x)
+{
+	return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1 / 3.0 - x / 4));
+}
+
+static double zipf_helper2(double x)
+{
+	return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x / 2 * (1 + x / 3 * (1 + x / 4));
+}
+
+static double zipf_h(double x)
+{
+	return exp(-zipf.theta * log(x));
+}
+
+static double zipf_hintegral(double x)
+{
+	double l = log(x);
+
+	return zipf_helper2((1 - zipf.theta) * l) * l;
+}
+
+static double zipf_hintegral_inv(double x)
+{
+	double t = x * (1 - zipf.theta);
+
+	return exp(zipf_helper1(MAX(t, -1.0)) * x);
+}
+
+static int zipf_parse(const char *arg)
+{
+	if (arg && (zipf.theta = atof(arg)) <= 0)
+		return -EINVAL;
+	return 0;
+}
+
+static unsigned long gcd(unsigned long a, unsigned long b)
+{
+	while (b) {
+		unsigned long r = a % b;
+
+		a = b;
+		b = r;
+	}
+
+	return a;
+}
+
+static void zipf_setup(unsigned long pages)
+{
+	zipf.n	 = pages;
+	zipf.h_x1 = zipf_hintegral(1.5) - 1;
+	zipf.h_n  = zipf_hintegral(pages + 0.5);
+	zipf.s	 = 2 - zipf_hintegral_inv(zipf_hintegral(2.5) - zipf_h(2));
+
+	/* any multiplier coprime to the size is a permutation */
+	zipf.mult = pages * 0.618033988749895 + 1;
+	while (gcd(zipf.mult, pages) != 1)
+		zipf.mult++;
+}
+
+static bool zipf_pick(struct worker *w, struct io_slot *s)
+{
+	unsigned long rank;
+	double u, x;
+
+	while (1) {
+		u = zipf.h_n + rng_double(&w->rng) * (zipf.h_x1 - zipf.h_n);
+		x = zipf_hintegral_inv(u);
+		rank = MIN(MAX(x + 0.5, 1.0), zipf.n);
+
+		if (rank - x <= zipf.s ||
+		    u >= zipf_hintegral(rank + 0.5) - zipf_h(rank))
+			break;
+	}
+
+	s->offset = region_offset(w, (unsigned __int128) (rank - 1) * zipf.mult %
+				  w->region_pages);
+	return true;
+}
+
+/* A hot working set at the start of each region, the rest cold */
+static struct {
+	double		frac;
+	double		prob;
+	unsigned long	pages;
+} hot = { .frac = 0.2, .prob = 0.8 };
+
+static int hot_parse(const char *arg)
+{
+	char *end;
+
+	if (!arg)
+		return 0;
+
+	hot.frac = strtod(arg, &end);
+	if (*end == ':')
+		hot.prob = strtod(end + 1, &end);
+
+	return *end || hot.frac <= 0 || hot.frac >= 1 ||
+		hot.prob < 0 || hot.prob > 1 ? -EINVAL : 0;
+}
+
+static void hot_setup(unsigned long pages)
+{
+	hot.pages = MAX(pages * hot.frac, 1.0);
+}
+
+static bool hot_pick(struct worker *w, struct io_slot *s)
+{
+	unsigned long cold = w->region_pages - hot.pages;
+	long page = rng_double(&w->rng) < hot.prob || !cold
+		? rng_long(&w->rng) % hot.pages
+		: hot.pages + rng_long(&w->rng) % cold;
+
+	s->offset = region_offset(w, page);
+	return true;
+}
+
+/*
+ * Replay of blkparse's default text output; only queue (Q) events are
+ * used, since those are what the application asked for. Sectors are
+ * folded into the worker's region. All workers share one trace; with
+ * original timing an I/O can still be late if every slot is busy.
+ */
+struct replay_io {
+	uint64_t	time_ns;
+	unsigned long	sector;
+	int		nbytes;
+	bool		write;
+};
+
+static struct {
+	struct replay_io *ios;
+	unsigned long	nr;
+	unsigned long	next;
+	bool		fast;
+	bool		writes;
+	uint64_t	start_ns;
+} replay;
+
+static int replay_cmp(const void *_l, const void *_r)
+{
+	const struct replay_io *l = _l, *r = _r;
+
+	return (l->time_ns > r->time_ns) - (l->time_ns < r->time_ns);
+}
+
+static int replay_parse(const char *arg)
+{
+	unsigned long size = 0, sector;
+	unsigned sectors;
+	char line[512], action[4], rwbs[8];
+	double time;
+	FILE *f;
+
+	if (!arg)
+		return -EINVAL;
+
+	f = fopen(arg, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		struct replay_io *io;
+
+		if (sscanf(line, "%*s %*u %*u %lf %*u %3s %7s %lu + %u",
+			   &time, action, rwbs, &sector, &sectors) != 5 ||
+		    strcmp(action, "Q") || !sectors ||
+		    strchr(rwbs, 'D') ||
+		    (!strchr(rwbs, 'R') && !strchr(rwbs, 'W')))
+			continue;
+
+		if (replay.nr == size) {
+			size = size ? size * 2 : 4096;
+			io = realloc(replay.ios, size * sizeof(*io));
+			if (!io) {
+				fclose(f);
+				return -ENOMEM;
+			}
+			replay.ios = io;
+		}
+
+		io = &replay.ios[replay.nr++];
+		io->time_ns	= time * 1e9;
+		io->sector	= sector;
+		io->write	= strchr(rwbs, 'W');
+		io->nbytes	= MIN(((sectors + 7) & ~7) << 9, MAX_IO);
+		replay.writes  |= io->write;
+	}
+
+	fclose(f);
+
+	if (!replay.nr) {
+		fprintf(stderr, "No queue events in trace %s\n", arg);
+		return -EINVAL;
+	}
+
+	qsort(replay.ios, replay.nr, sizeof(*replay.ios), replay_cmp);
+	printf("replaying %lu I/Os over %.2fs\n", replay.nr,
+	       (replay.ios[replay.nr - 1].time_ns - replay.ios[0].time_ns) / 1e9);
+	return 0;
+}
+
+static uint64_t replay_due(unsigned long i)
+{
+	return replay.start_ns + replay.ios[i].time_ns - replay.ios[0].time_ns;
+}
+
+static bool replay_pick(struct worker *w, struct io_slot *s)
+{
+	bool verify = t.csum || t.compare;
+	struct replay_io *io;
+	unsigned long i;
+
+	do {
+		i = replay.next;
+		if (i >= replay.nr) {
+			w->exhausted = true;
+			return false;
+		}
+
+		if (!replay.fast && now_ns() < replay_due(i))
+			return false;
+
+		io = &replay.ios[i];
+		s->offset = region_offset(w, io->sector >> 3);
+		s->nbytes = io->nbytes;
+		s->writing = io->write;
+
+		/* keep trace order for overlapping I/O; wait for the first */
+		if (verify && overlaps_inflight(w, s->offset, s->nbytes))
+			return false;
+	} while (!__sync_bool_compare_and_swap(&replay.next, i, i + 1));
+
+	return true;
+}
+
+/* Called with nothing in flight, when replay_pick() had nothing for us */
+static void replay_wait(void)
+{
+	unsigned long i = replay.next;
+	uint64_t now = now_ns();
+	struct timespec ts = { .tv_nsec = 1000000 };
+
+	if (i < replay.nr && replay_due(i) > now)
+		ts.tv_nsec = MIN(replay_due(i) - now, 100000000ULL);
+
+	nanosleep(&ts, NULL);
+}
+
+static const struct workload workloads[] = {
+	{ "uniform",	no_args,	NULL,		uniform_pick },
+	{ "walk",	no_args,	NULL,		walk_pick },
+	{ "zipf",	zipf_parse,	zipf_setup,	zipf_pick },
+	{ "hot",	hot_parse,	hot_setup,	hot_pick },
+	{ "replay",	replay_parse,	NULL,		replay_pick },
+	{ NULL }
+};
+
+static const struct workload *pick_workload(char *spec)
+{
+	const struct workload *wl;
+	char *arg = strchr(spec, ':');
+	int ret;
+
+	if (arg)
+		*arg++ = '\0';
+
+	for (wl = workloads; wl->name; wl++)
+		if (!strcmp(wl->name, spec))
+			break;
+
+	if (!wl->name) {
+		fprintf(stderr, "Unknown workload %s\n", spec);
+		exit(EXIT_FAILURE);
+	}
+
+	ret = wl->parse(arg);
+	if (ret) {
+		fprintf(stderr, "Bad arguments for workload %s: %s\n",
+			spec, strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	return wl;
+}
+
+/*
+ * Mixed in on top of the generator: this fraction of I/Os continue the
+ * worker's sequential stream, which restarts at a generated offset every
+ * t.seq_pages; long enough by default to cross bcache's sequential_cutoff.
+ */
+static void seq_pick(struct worker *w, struct io_slot *s)
+{
+	if (!w->seq_left) {
+		t.workload->pick(w, s);
+		w->seq_next = (s->offset >> 12) - w->region_start;
+		w->seq_left = t.seq_pages;
+	}
+
+	s->offset   = region_offset(w, w->seq_next);
+	w->seq_next += s->nbytes >> 12;
+	w->seq_left -= MIN(w->seq_left, s->nbytes >> 12);
+}
+
+static bool pick_offset(struct worker *w, struct io_slot *s)
+{
+	bool verify = t.csum || t.compare, overlap = false;
+	unsigned tries = 0;
+
+	do {
+		s->nbytes = t.randsize ? rng_double(&w->rng) * 16 + 1 : 1;
+		s->nbytes <<= 12;
+
+		if (t.seq_frac && rng_double(&w->rng) < t.seq_frac)
+			seq_pick(w, s);
+		else if (!t.workload->pick(w, s))
+			return false;
+
+		overlap = verify && t.qd > 1 &&
+			overlaps_inflight(w, s->offset, s->nbytes);
+	} while (overlap && ++tries < 64);
+
+	/* verifying against I/O in flight would race: reap some first */
+	if (overlap)
+		return false;
+
+	w->page = (s->offset >> 12) - w->region_start;
+	return true;
+}
+
+static bool prepare_op(struct worker *w, struct io_slot *s)
+{
+	int j;
+
+	s->writing = (t.wtest && (w->issued & 1)) || !t.rtest;
+	s->loop = w->issued;
+	s->miss = false;
+	if (!pick_offset(w, s))
+		return false;
+
+	for (j = 0; j < s->nbytes; j += 4096) {
+		struct pagestuff *p = &t.pages[(s->offset + j) / 4096];
+
+		if (!p->writecount && !p->readcount) {
+			w->unique += 8;
+			s->miss = true;
+		}
+
+		if (s->writing) {
+			count_inc(p->writecount);
+			pattern_fill(s->buf1 + j, (s->offset + j) / 4096,
+				     p->writecount);
+		} else {
+			count_inc(p->readcount);
+		}
+	}
+
+	if (t.verbose)
+		printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
+		       s->loop, s->offset >> 9, s->nbytes >> 9,
+		       w->done >> 11, w->unique >> 11);
+
+	w->done += s->nbytes >> 9;
+	w->last_offset = s->offset;
+	w->last_nbytes = s->nbytes;
+	return true;
+}
+
+static void complete_op(struct worker *w, struct io_slot *s)
+{
+	uint64_t lat;
+	int j, ret;
+
+	if (s->res != s->nbytes)
+		io_error(w, s, s->res < 0 ? -s->res : EIO);
+
+	/* The device we compare against is only a reference; keep it sync */
+	if (t.compare) {
+		ret = sync_rw(t.fd2, s->writing, s->writing ? s->buf1 : s->buf2,
+			      s->nbytes, s->offset);
+		if (ret)
+			io_error(w, s, -ret);
+	}
+
+	if (!s->writing)
+		for (j = 0; j < s->nbytes; j += 4096) {
+			unsigned long page = (s->offset + j) / 4096;
+			struct pagestuff *p = &t.pages[page];
+
+			if (t.csum && p->writecount) {
+				if (!pattern_check(s->buf1 + j, page,
+						   p->writecount))
+					bad_read(w, s, j);
+			} else if (t.csum) {
+				uint64_t c = xxh64(s->buf1 + j, 4096, 0);
+
+				/* first read of a page we never wrote */
+				if (p->readcount == 1)
+					p->csum = c;
+				else if (p->csum != c)
+					bad_read(w, s, j);
+			} else if (t.compare &&
+				   memcmp(s->buf1 + j, s->buf2 + j, 4096))
+				bad_read(w, s, j);
+		}
+
+	if (t.trace)
+		fprintf(t.trace, "%u %lu %c %lu %i %" PRIu64 " %" PRIu64 "\n",
+			w->id, s->loop, s->writing ? 'W' : 'R',
+			s->offset >> 9, s->nbytes >> 9,
+			s->submit_ns, s->complete_ns);
+
+	lat = s->complete_ns - s->submit_ns;
+	if (s->writing) {
+		hist_record(&w->hist[HIST_WRITE], lat, s->nbytes);
+	} else {
+		hist_record(&w->hist[HIST_READ], lat, s->nbytes);
+		hist_record(&w->hist[s->miss ? HIST_MISS : HIST_HIT],
+			    lat, s->nbytes);
+	}
+
+	w->completed++;
+	w->inflight--;
+	s->busy = false;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+	unsigned i;
+	int ret;
+
+	while ((t.forever || w->completed < w->iterations) &&
+	       !(w->exhausted && !w->inflight)) {
+		for (i = 0;
+		     i < t.qd && w->inflight < t.qd &&
+		     (t.forever || w->issued < w->iterations);
+		     i++) {
+			struct io_slot *s = &w->slots[i];
+
+			if (s->busy)
+				continue;
+
+			if (!w->id && !(w->issued % 200))
+				flushlog();
+
+			if (!prepare_op(w, s))
+				break;
+
+			s->busy = true;
+			s->submit_ns = now_ns();
+			w->issued++;
+			w->inflight++;
+			t.engine->queue(w, s);
+		}
+
+		if (!w->inflight) {
+			if (!w->exhausted)
+				replay_wait();
+			continue;
+		}
+
+		ret = t.engine->submit(w);
+		if (!ret)
+			ret = t.engine->reap(w, w->reaped, t.qd);
+		if (ret < 0) {
+			fprintf(stderr, "%s engine error: %s\n",
+				t.engine->name, strerror(-ret));
+			flushlog();
+			exit(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < ret; i++)
+			complete_op(w, w->reaped[i]);
+	}
+
+	w->end_ns = now_ns();
+	__sync_fetch_and_sub(&t.running, 1);
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: bcache-test [options] device [reference device]\n"
+		"	-r		read test (default)\n"
+		"	-w		write test (alternate writes with -r)\n"
+		"	-c		verify reads against checksums of what was written\n"
+		"	-b iterations	benchmark, don't verify\n"
+		"	-d		O_DIRECT\n"
+		"	-s		random I/O sizes, 4k to 64k\n"
+		"	-n		random walk instead of uniform offsets (-p walk)\n"
+		"	-p workload	offset generator:\n"
+		"			  uniform		(default)\n"
+		"			  walk			random walk\n"
+		"			  zipf[:theta]		Zipfian, default skew 0.99\n"
+		"			  hot[:frac[:prob]]	prob of I/O to frac of the region,\n"
+		"						default 0.2:0.8\n"
+		"			  replay:file		blkparse output, with its timing\n"
+		"	-F		replay as fast as possible\n"
+		"	-S pct[:kb]	send pct%% of I/O to sequential streams, kb long\n"
+		"			(default 8192; not with -p replay)\n"
+		"	-t threads	worker threads, each with its own region (max %u)\n"
+		"	-q depth	I/Os in flight per thread (max %u)\n"
+		"	-e engine	uring, aio or sync\n"
+		"	-T file		log submit/complete times of every I/O\n"
+		"	-i seconds	progress and latency report interval (default 2)\n"
+		"	-H file		dump latency histograms at the end, mergeable by adding counts\n"
+		"	-M file		keep the verification table in file, not memory\n"
+		"	-K bcacheN	report the cache's sysfs stats each interval\n"
+		"	-E dev[:tbw]	write amplification of the cache device dev, and\n"
+		"			its lifetime at this rate if rated for tbw TB\n"
+		"	-l		save the kernel log\n"
+		"	-v		verbose\n", MAX_THREADS, MAX_QD);
+	exit(EXIT_FAILURE);
+}
+
+static const struct io_engine *pick_engine(const char *name)
+{
+	const struct io_engine * const *e;
+
+	for (e = engines; *e; e++)
+		if (!strcmp((*e)->name, name))
+			return *e;
+
+	fprintf(stderr, "Unknown I/O engine %s\n", name);
+	exit(EXIT_FAILURE);
+}
+
+static void print_progress(struct worker *workers, unsigned nr)
+{
+	unsigned long loops = 0, done = 0, unique = 0;
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		loops	+= workers[i].completed;
+		done	+= workers[i].done;
+		unique	+= workers[i].unique;
+	}
+
+	printf("Loop %6li offset %9li sectors %3i, %6lu mb done, %6lu mb unique\n",
+	       loops, workers[0].last_offset >> 9, workers[0].last_nbytes >> 9,
+	       done >> 11, unique >> 11);
+}
+
+/* Merge every worker's histograms; fine to race with them, it's a sample */
+static void collect_hists(struct worker *workers, unsigned nr,
+			  struct hist *hists)
+{
+	unsigned i, j;
+
+	memset(hists, 0, HIST_NR * sizeof(*hists));
+	for (i = 0; i < nr; i++)
+		for (j = 0; j < HIST_NR; j++)
+			hist_add(&hists[j], &workers[i].hist[j]);
+}
+
+/*
+ * Cache side counters, sampled along with the progress report so they line
+ * up with the client side numbers. The files are opened once and re-read
+ * with pread(), so sampling costs a few syscalls an interval.
+ */
+enum kstat {
+	KS_HITS,
+	KS_MISSES,
+	KS_BYPASS_HITS,
+	KS_BYPASS_MISSES,
+	KS_COLLISIONS,
+	KS_BYPASSED,
+	KS_DIRTY,
+	KS_WB_RATE,
+	KS_BTREE_CACHE,
+	KS_NR,
+};
+
+static const struct {
+	const char	*path;
+	bool		counter;	/* report per interval deltas */
+} kstat_files[] = {
+	[KS_HITS]		= { "stats_total/cache_hits",		true },
+	[KS_MISSES]		= { "stats_total/cache_misses",		true },
+	[KS_BYPASS_HITS]	= { "stats_total/cache_bypass_hits",	true },
+	[KS_BYPASS_MISSES]	= { "stats_total/cache_bypass_misses",	true },
+	[KS_COLLISIONS]		= { "stats_total/cache_miss_collisions", true },
+	[KS_BYPASSED]		= { "stats_total/bypassed",		true },
+	[KS_DIRTY]		= { "dirty_data",			false },
+	[KS_WB_RATE]		= { "writeback_rate",			false },
+	[KS_BTREE_CACHE]	= { "cache/btree_cache_size",		false },
+};
+
+static struct {
+	int		fd[KS_NR];
+	uint64_t	start[KS_NR];
+	uint64_t	prev[KS_NR];
+	uint64_t	res[KS_NR];	/* bytes the last digit read is worth */
+} kstats;
+
+/*
+ * sysfs prints sizes with bch_hprint(): "512", "1.5k", "20.0M", "120G"...
+ * so three digits at most; @res, if not NULL, is what the last one is worth.
+ */
+static uint64_t parse_hprint(const char *buf, uint64_t *res)
+{
+	static const char units[] = "kMGTPEZY";
+	char *end;
+	double v = strtod(buf, &end), r = 1;
+	const char *u = *end ? strchr(units, *end) : NULL;
+	const char *dot = strchr(buf, '.');
+
+	if (u) {
+		r = pow(1024, u - units + 1);
+		v *= r;
+	}
+	if (dot && dot < end)
+		r /= pow(10, end - dot - 1);
+
+	if (res)
+		*res = r > 1 ? r : 1;
+	return v;
+}
+
+static void kstats_open(const char *dev)
+{
+	const char *name = strrchr(dev, '/');
+	char path[PATH_MAX];
+	unsigned i, found = 0;
+
+	name = name ? name + 1 : dev;
+
+	for (i = 0; i < KS_NR; i++) {
+		snprintf(path, sizeof(path), "/sys/block/%s/bcache/%s",
+			 name, kstat_files[i].path);
+		kstats.fd[i] = open(path, O_RDONLY);
+		found += kstats.fd[i] >= 0;
+	}
+
+	if (!found) {
+		fprintf(stderr, "No bcache stats for %s in /sys/block\n", name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void kstats_read(uint64_t *v)
+{
+	char buf[64];
+	unsigned i;
+	ssize_t ret;
+
+	for (i = 0; i < KS_NR; i++) {
+		v[i] = 0;
+		if (kstats.fd[i] < 0)
+			continue;
+
+		ret = pread(kstats.fd[i], buf, sizeof(buf) - 1, 0);
+		if (ret <= 0)
+			continue;
+
+		buf[ret] = '\0';
+		v[i] = parse_hprint(buf, &kstats.res[i]);
+	}
+}
+
+/*
+ * Over a short interval, a counter sysfs rounds to a few digits can change
+ * by less than a step, and its rate reads 0 one interval and a whole step
+ * the next: show those as a bound, or as approximate.
+ */
+static void kstats_rate(char *buf, size_t size, uint64_t d, enum kstat k,
+			double secs)
+{
+	uint64_t res = kstats.res[k];
+
+	if (res <= 1 || d >= res * 10)
+		snprintf(buf, size, "%8.1f", d / secs / 1e6);
+	else if (!d)
+		snprintf(buf, size, "<%7.1f", res / secs / 1e6);
+	else
+		snprintf(buf, size, "~%7.1f", d / secs / 1e6);
+}
+
+static void kstats_print(const uint64_t *from, const uint64_t *to, double secs)
+{
+	uint64_t d[KS_NR], lookups;
+	char bypassed[32];
+	unsigned i;
+
+	for (i = 0; i < KS_NR; i++)
+		d[i] = kstat_files[i].counter ? to[i] - from[i] : to[i];
+
+	lookups = d[KS_HITS] + d[KS_MISSES];
+	kstats_rate(bypassed, sizeof(bypassed), d[KS_BYPASSED], KS_BYPASSED,
+		    secs);
+
+	printf("  cache %5.1f%% hit %9" PRIu64 " hits %9" PRIu64 " misses %6"
+	       PRIu64 " collisions, bypassed %s MB/s, dirty %8.1f MB,"
+	       " writeback %6.1f MB/s, btree cache %6.1f MB\n",
+	       lookups ? d[KS_HITS] * 100.0 / lookups : 0,
+	       d[KS_HITS], d[KS_MISSES], d[KS_COLLISIONS],
+	       bypassed, d[KS_DIRTY] / 1e6,
+	       d[KS_WB_RATE] / 1e6, d[KS_BTREE_CACHE] / 1e6);
+}
+
+/*
+ * Endurance: what the cache device was asked to write, against what this
+ * run wrote, and what it physically wrote, snapshotted at the start and the
+ * end of the run. The block layer's stat counts everything written to the
+ * device, bcache's counters split that into data and metadata, and NVMe
+ * SMART has the controller's count; the controller only reports NAND
+ * writes in the OCP datacenter log, if it has one.
+ */
+struct wa_snap {
+	uint64_t	dev;		/* bytes, /sys/class/block/dev/stat */
+	uint64_t	bch_data;	/* bcache's written */
+	uint64_t	bch_meta;	/* metadata_written, includes btree */
+	uint64_t	ctrl;		/* SMART data units written, in bytes */
+	uint64_t	nand;		/* OCP physical media units written */
+	unsigned	pct_used;	/* SMART percentage used */
+};
+
+static struct {
+	const char	*name;
+	double		tbw;
+	uint64_t	capacity;	/* bytes */
+	int		stat_fd, data_fd, meta_fd, nvme_fd;
+	bool		smart, ocp;
+	struct wa_snap	start;
+} wa = { .stat_fd = -1, .data_fd = -1, .meta_fd = -1, .nvme_fd = -1 };
+
+#define NVME_LOG_SMART		0x02
+#define NVME_LOG_OCP_SMART	0xc0
+
+/* OCP datacenter SMART log GUID, as it's laid out at byte 496 */
+static const uint8_t ocp_smart_guid[16] = {
+	0xc5, 0xaf, 0x10, 0x28, 0xea, 0xbf, 0xf2, 0xa4,
+	0x9c, 0x4f, 0x6f, 0x7c, 0xc9, 0x14, 0xd5, 0xaf,
+};
+
+static int nvme_get_log(int fd, uint8_t lid, void *buf, unsigned len)
+{
+	struct nvme_admin_cmd cmd = {
+		.opcode		= 0x02,		/* get log page */
+		.nsid		= 0xffffffff,
+		.addr		= (uintptr_t) buf,
+		.data_len	= len,
+		.cdw10		= lid | ((len / 4 - 1) << 16),
+	};
+
+	return ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd);
+}
+
+/* NVMe counters are 128 bit little endian; the low half will do */
+static uint64_t le128_lo(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, 8);
+	return le64toh(v);
+}
+
+static int wa_open_sysfs(const char *file)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s/%s", wa.name, file);
+	return open(path, O_RDONLY);
+}
+
+static uint64_t wa_read_file(int fd, bool hprint)
+{
+	char buf[256];
+	ssize_t ret;
+	unsigned long long v[7];
+
+	if (fd < 0)
+		return 0;
+
+	ret = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (ret <= 0)
+		return 0;
+	buf[ret] = '\0';
+
+	if (hprint)
+		return parse_hprint(buf, NULL);
+
+	/* stat: the seventh field is sectors written */
+	if (sscanf(buf, "%llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6]) != 7)
+		return 0;
+	return v[6] << 9;
+}
+
+static void wa_read(struct wa_snap *s)
+{
+	uint8_t log[512] __attribute__((aligned(4096)));
+
+	memset(s, 0, sizeof(*s));
+	s->dev		= wa_read_file(wa.stat_fd, false);
+	s->bch_data	= wa_read_file(wa.data_fd, true);
+	s->bch_meta	= wa_read_file(wa.meta_fd, true);
+
+	if (wa.smart && !nvme_get_log(wa.nvme_fd, NVME_LOG_SMART,
+				      log, sizeof(log))) {
+		s->pct_used = log[5];
+		/* units of 1000 512 byte sectors */
+		s->ctrl = le128_lo(log + 48) * 512000;
+	}
+
+	if (wa.ocp && !nvme_get_log(wa.nvme_fd, NVME_LOG_OCP_SMART,
+				    log, sizeof(log)))
+		s->nand = le128_lo(log);
+}
+
+static void wa_open(const char *arg)
+{
+	uint8_t log[512] __attribute__((aligned(4096)));
+	char *name = strdup(arg), *p = strchr(name, ':'), *base;
+	char path[PATH_MAX];
+	int fd;
+
+	if (p) {
+		*p++ = '\0';
+		wa.tbw = strtod(p, &p);
+		if (*p || wa.tbw <= 0)
+			usage();
+	}
+
+	base = strrchr(name, '/');
+	wa.name = base ? base + 1 : name;
+
+	wa.stat_fd = wa_open_sysfs("stat");
+	if (wa.stat_fd < 0) {
+		fprintf(stderr, "No block device %s in /sys/class/block\n",
+			wa.name);
+		exit(EXIT_FAILURE);
+	}
+
+	wa.data_fd = wa_open_sysfs("bcache/written");
+	wa.meta_fd = wa_open_sysfs("bcache/metadata_written");
+	if (wa.data_fd < 0)
+		fprintf(stderr, "%s isn't a registered bcache cache device, "
+			"no bcache write counters\n", wa.name);
+
+	fd = wa_open_sysfs("size");
+	wa.capacity = wa_read_file(fd, true) << 9;
+	if (fd >= 0)
+		close(fd);
+
+	snprintf(path, sizeof(path), "/dev/%s", wa.name);
+	wa.nvme_fd = open(path, O_RDONLY);
+	if (wa.nvme_fd >= 0) {
+		wa.smart = !nvme_get_log(wa.nvme_fd, NVME_LOG_SMART,
+					 log, sizeof(log));
+		wa.ocp = wa.smart &&
+			!nvme_get_log(wa.nvme_fd, NVME_LOG_OCP_SMART,
+				      log, sizeof(log)) &&
+			!memcmp(log + 496, ocp_smart_guid,
+				sizeof(ocp_smart_guid));
+	}
+}
+
+static double ratio(uint64_t a, uint64_t b)
+{
+	return b ? (double) a / b : 0 / (double) 0;
+}
+
+/*
+ * @host is what this run wrote. Host to cache is everything the cache
+ * device took per byte of that; cache to NAND is what the flash took per
+ * byte the device was sent. SMART counts the whole controller, so other
+ * namespaces or partitions writing during the run show up as amplification.
+ */
+static void wa_print(uint64_t host, double secs)
+{
+	struct wa_snap end;
+	uint64_t dev, ctrl, nand, drive;
+	double rate, per_day;
+
+	wa_read(&end);
+
+	dev  = end.dev	- wa.start.dev;
+	ctrl = end.ctrl - wa.start.ctrl;
+	nand = end.nand - wa.start.nand;
+
+	printf("  endurance %s: host %.1f MB, device %.1f MB",
+	       wa.name, host / 1e6, dev / 1e6);
+	if (wa.data_fd >= 0)
+		printf(" (bcache data %.1f MB, metadata %.1f MB)",
+		       (end.bch_data - wa.start.bch_data) / 1e6,
+		       (end.bch_meta - wa.start.bch_meta) / 1e6);
+	if (wa.smart)
+		printf(", controller %.1f MB", ctrl / 1e6);
+	if (wa.ocp)
+		printf(", NAND %.1f MB", nand / 1e6);
+	printf("\n");
+
+	printf("  write amplification host->cache %.2f", ratio(dev, host));
+	if (wa.ocp)
+		printf(", cache->NAND %.2f, total %.2f",
+		       ratio(nand, wa.smart ? ctrl : dev), ratio(nand, host));
+	else if (wa.smart)
+		printf(", device->controller %.2f (no NAND counter)",
+		       ratio(ctrl, dev));
+	printf("\n");
+
+	if (wa.smart && ctrl < 100 * 512000)
+		printf("  (SMART counts in 512000 byte units, "
+		       "run longer for a better controller number)\n");
+
+	/* ratings count writes to the drive, whatever it does with them */
+	drive = wa.smart ? MAX(ctrl, dev) : dev;
+	rate = drive / secs;
+	per_day = rate * 86400;
+
+	printf("  at %.1f MB/s to the drive, %.2f TB/day", rate / 1e6,
+	       per_day / 1e12);
+	if (wa.capacity)
+		printf(", %.2f drive writes/day", per_day / wa.capacity);
+	if (wa.tbw && rate) {
+		double days = wa.tbw * 1e12 / per_day;
+
+		if (days < 365)
+			printf(": %g TBW lasts %.1f days", wa.tbw, days);
+		else
+			printf(": %g TBW lasts %.1f years", wa.tbw, days / 365);
+	}
+	if (wa.smart)
+		printf(", %u%% of rated life used", end.pct_used);
+	printf("\n");
+}
+
+static void print_interval(struct worker *workers, unsigned nr,
+			   struct hist *cur, struct hist *prev,
+			   struct hist *tmp, double secs)
+{
+	unsigned i;
+
+	collect_hists(workers, nr, cur);
+
+	for (i = 0; i < HIST_NR; i++) {
+		hist_sub(tmp, &cur[i], &prev[i]);
+		hist_print(hist_names[i], tmp, secs);
+	}
+
+	memcpy(prev, cur, HIST_NR * sizeof(*cur));
+
+	if (t.kstats) {
+		uint64_t now[KS_NR];
+
+		kstats_read(now);
+		kstats_print(kstats.prev, now, secs);
+		memcpy(kstats.prev, now, sizeof(now));
+	}
+}
+
+/* a whole number from 1 to @max, or the usage message */
+static unsigned parse_count(const char *arg, unsigned max)
+{
+	unsigned long v;
+	char *e;
+
+	errno = 0;
+	v = strtoul(arg, &e, 10);
+	if (*arg == '-' || *e || errno || !v || v > max)
+		usage();
+	return v;
+}
+
+int main(int argc, char **argv)
+{
+	int direct = 0, o, ret;
+	unsigned i, j, nthreads = 1;
+	unsigned long size, benchmark = 0, completed;
+	uint64_t start, end = 0, last_printed, interval = 2000000000ULL;
+	struct hist *cur, *prev, *tmp;
+	struct worker *workers;
+	FILE *hist_file = NULL;
+	const char *spill = NULL;
+	extern char *optarg;
+	char *p;
+
+	t.rtest = t.wtest = false;
+	t.qd = 1;
+	t.seed = mix64(now_ns() ^ getpid());
+	t.workload = &workloads[0];
+
+	while ((o = getopt(argc, argv, "dnwrvsclb:t:q:e:T:i:H:p:FS:M:K:E:")) != EOF)
+		switch (o) {
+		case 'd':
+			direct = O_DIRECT;
+			break;
+		case 'n':
+			t.workload = &workloads[1];
+			break;
+		case 'p':
+			t.workload = pick_workload(optarg);
+			break;
+		case 'F':
+			replay.fast = true;
+			break;
+		case 'M':
+			spill = optarg;
+			break;
+		case 'K':
+			kstats_open(optarg);
+			t.kstats = true;
+			break;
+		case 'E':
+			wa_open(optarg);
+			t.endurance = true;
+			break;
+		case 'S':
+			t.seq_frac = strtod(optarg, &p) / 100;
+			t.seq_pages = *p == ':' ? strtoul(p + 1, &p, 0) / 4 : 2048;
+			if (*p || t.seq_frac < 0 || t.seq_frac > 1 ||
+			    !t.seq_pages)
+				usage();
+			break;
+		case 'v':
+			t.verbose = true;
+			break;
+		case 's':
+			t.randsize = true;
+			break;
+		case 'c':
+			t.csum = true;
+			break;
+		case 'w':
+			t.wtest = true;
+			break;
+		case 'r':
+			t.rtest = true;
+			break;
+		case 'l':
+			klog = true;
+			break;
+		case 'b':
+			benchmark = atol(optarg);
+			break;
+		case 't':
+			nthreads = parse_count(optarg, MAX_THREADS);
+			break;
+		case 'q':
+			t.qd = parse_count(optarg, MAX_QD);
+			break;
+		case 'e':
+			t.engine = pick_engine(optarg);
+			break;
+		case 'i':
+			interval = atof(optarg) * 1e9;
+			break;
+		case 'H':
+			hist_file = fopen(optarg, "w");
+			if (!hist_file) {
+				perror("Error opening histogram file");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'T':
+			t.trace = fopen(optarg, "w");
+			if (!t.trace) {
+				perror("Error opening trace file");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			usage();
+		}
+
+	argv += optind;
+	argc -= optind;
+
+	if (!nthreads || !t.qd)
+		usage();
+
+	if (!t.rtest && !t.wtest)
+		t.rtest = true;
+
+	/* a replay's I/O is the trace's, and ends when the trace does */
+	if (t.seq_frac && t.workload->pick == replay_pick) {
+		printf("-S can't be used with -p replay\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (argc < 1) {
+		printf("Please enter a device to test\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!t.csum && !benchmark && argc < 2) {
+		printf("Please enter a device to compare against\n");
+		exit(EXIT_FAILURE);
+	}
+
+	t.compare = !t.csum && !benchmark;
+	/* a replay ends with its trace */
+	t.forever = !benchmark && t.workload->pick != replay_pick;
+	if (replay.writes)
+		t.wtest = true;
+
+	t.fd1 = open(argv[0], (t.wtest ? O_RDWR : O_RDONLY)|direct);
+	if (t.compare)
+		t.fd2 = open(argv[1], (t.wtest ? O_RDWR : O_RDONLY)|direct);
+
+	if (t.fd1 == -1 || t.fd2 == -1) {
+		perror("Error opening device");
+		exit(EXIT_FAILURE);
+	}
+
+	size = getblocks(t.fd1);
+	if (t.compare)
+		size = MIN(size, getblocks(t.fd2));
+
+	size = size / 8 - 16;
+	t.pages = pages_alloc(size + 16, spill);
+	printf("size %li\n", size);
+
+	if (!t.pages || size / nthreads <= (nthreads > 1 ? 16 : 0)) {
+		printf("Device too small\n");
+		exit(EXIT_FAILURE);
+	}
+
+	workers = calloc(nthreads, sizeof(*workers));
+	if (!workers) {
+		printf("Could not allocate workers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+
+		w->id		= i;
+		w->region_start	= i * (size / nthreads);
+		/* keep 64k I/Os at the end of a region out of the next one */
+		w->region_pages	= size / nthreads - (nthreads > 1 ? 16 : 0);
+		w->iterations	= !benchmark ? ULONG_MAX :
+			benchmark / nthreads + (i < benchmark % nthreads);
+
+		rng_init(&w->rng, i);
+
+		w->slots = calloc(t.qd, sizeof(*w->slots));
+		w->reaped = calloc(t.qd, sizeof(*w->reaped));
+		if (!w->slots || !w->reaped) {
+			printf("Could not allocate buffers\n");
+			exit(EXIT_FAILURE);
+		}
+
+		for (j = 0; j < t.qd; j++) {
+			w->slots[j].idx = j;
+			if (posix_memalign(&w->slots[j].buf1, 4096, MAX_IO) ||
+			    posix_memalign(&w->slots[j].buf2, 4096, MAX_IO)) {
+				printf("Could not allocate buffers\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (!t.engine) {
+		/* the original one-I/O-at-a-time behaviour, unless asked */
+		const struct io_engine * const *e = engines;
+
+		if (t.qd == 1)
+			e = &engines[2];
+
+		for (; *e; e++) {
+			t.engine = *e;
+			if (!t.engine->init(&workers[0]))
+				break;
+		}
+		t.engine->exit(&workers[0]);
+	}
+
+	for (i = 0; i < nthreads; i++)
+		if ((ret = t.engine->init(&workers[i]))) {
+			fprintf(stderr, "Error setting up %s engine: %s\n",
+				t.engine->name, strerror(-ret));
+			exit(EXIT_FAILURE);
+		}
+
+	if (nthreads > 1 || t.qd > 1)
+		printf("engine %s, %u threads, queue depth %u\n",
+		       t.engine->name, nthreads, t.qd);
+
+	if (t.workload->setup)
+		t.workload->setup(workers[0].region_pages);
+
+	if (t.workload != &workloads[0] || t.seq_frac)
+		printf("workload %s, %.0f%% sequential\n",
+		       t.workload->name, t.seq_frac * 100);
+
+	cur  = calloc(HIST_NR, sizeof(*cur));
+	prev = calloc(HIST_NR, sizeof(*prev));
+	tmp  = calloc(1, sizeof(*tmp));
+	if (!cur || !prev || !tmp) {
+		printf("Could not allocate histograms\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (t.kstats) {
+		kstats_read(kstats.start);
+		memcpy(kstats.prev, kstats.start, sizeof(kstats.start));
+	}
+
+	if (t.endurance)
+		wa_read(&wa.start);
+
+	start = last_printed = replay.start_ns = now_ns();
+	t.running = nthreads;
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&workers[i].thread, NULL,
+				   worker_fn, &workers[i])) {
+			perror("Error creating thread");
+			exit(EXIT_FAILURE);
+		}
+
+	while (__atomic_load_n(&t.running, __ATOMIC_ACQUIRE)) {
+		struct timespec ts = { .tv_nsec = 100000000 };
+
+		nanosleep(&ts, NULL);
+
+		if (!t.verbose && now_ns() - last_printed >= interval) {
+			double secs = (now_ns() - last_printed) / 1e9;
+
+			last_printed = now_ns();
+			print_progress(workers, nthreads);
+			print_interval(workers, nthreads, cur, prev, tmp, secs);
+		}
+	}
+
+	completed = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		t.engine->exit(&workers[i]);
+		completed  += workers[i].completed;
+		end	    = MAX(end, workers[i].end_ns);
+	}
+
+	print_progress(workers, nthreads);
+
+	if (completed) {
+		double secs = (end - start) / 1e9;
+
+		printf("%lu ops in %.2fs\n", completed, secs);
+
+		collect_hists(workers, nthreads, cur);
+		for (i = 0; i < HIST_NR; i++)
+			hist_print(hist_names[i], &cur[i], secs);
+
+		if (t.kstats) {
+			uint64_t now[KS_NR];
+
+			kstats_read(now);
+			kstats_print(kstats.start, now, secs);
+		}
+
+		if (t.endurance)
+			wa_print(cur[HIST_WRITE].bytes, secs);
+
+		if (hist_file) {
+			hist_dump(hist_file, cur);
+			fclose(hist_file);
+		}
+	}
+
+	if (t.trace)
+		fclose(t.trace);
+
+	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,126 @@
+/*
+ * bcache-udev: probe-bcache and bcache-register in one static binary, for
+ * initramfs images. Installed there under both names (or called as
+ * "bcache-udev probe" and "bcache-udev register"), it needs neither the
+ * dynamic loader nor libblkid and libuuid.
+ *
+ * GPLv2
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bcache.h"
+
+static void uuid_str(const uint8_t *u, char *out)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned i;
+
+	for (i = 0; i < 16; i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10)
+			*out++ = '-';
+		*out++ = hex[u[i] >> 4];
+		*out++ = hex[u[i] & 15];
+	}
+	*out = '\0';
+}
+
+/*
+ * probe-bcache, less its check for other signatures on the device: 69-bcache
+ * rules only run it when the udev blkid builtin found none. One O_DIRECT
+ * read of the superblock, so nothing goes through the page cache.
+ */
+static int probe(int argc, char **argv)
+{
+	bool udev = false;
+	int i, o;
+
+	while ((o = getopt(argc, argv, "o:")) != EOF)
+		switch (o) {
+		case 'o':
+			if (strcmp("udev", optarg)) {
+				printf("Invalid output format %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			udev = true;
+			break;
+		}
+
+	for (i = optind; i < argc; i++) {
+		struct sb_probe p = { .dev = argv[i] };
+		char uuid[40];
+
+		sb_probe_dev(&p);
+		if (p.status != SB_OK)
+			continue;
+
+		uuid_str(p.sb.uuid, uuid);
+
+		if (udev)
+			printf("ID_FS_UUID=%s\n"
+			       "ID_FS_UUID_ENC=%s\n"
+			       "ID_FS_TYPE=bcache\n",
+			       uuid, uuid);
+		else
+			printf("%s: UUID=\"%s\" TYPE=\"bcache\"\n", argv[i], uuid);
+	}
+
+	return 0;
+}
+
+/* bcache-register, one device at a time as udev calls it */
+static int do_register(int argc, char **argv)
+{
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "bcache-register takes exactly one argument\n");
+		return 1;
+	}
+
+	fd = open("/sys/fs/bcache/register", O_WRONLY);
+	if (fd < 0) {
+		perror("Error opening /sys/fs/bcache/register");
+		fprintf(stderr, "The bcache kernel module must be loaded\n");
+		return 1;
+	}
+
+	if (dprintf(fd, "%s\n", argv[1]) < 0) {
+		fprintf(stderr, "Error registering %s with bcache: %m\n",
+			argv[1]);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const char *name = strrchr(argv[0], '/');
+
+	name = name ? name + 1 : argv[0];
+
+	if (!strcmp(name, "probe-bcache"))
+		return probe(argc, argv);
+	if (!strcmp(name, "bcache-register"))
+		return do_register(argc, argv);
+
+	if (argc > 1 && !strcmp(argv[1], "probe"))
+		return probe(argc - 1, argv + 1);
+	if (argc > 1 && !strcmp(argv[1], "register"))
+		return do_register(argc - 1, argv + 1);
+
+	fprintf(stderr, "Usage: bcache-udev probe [-o udev] device...\n"
+		"       bcache-udev register device\n");
+	return 1;
+}
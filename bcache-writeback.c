@@ -0,0 +1,865 @@
+/*
+ * bcache-writeback: write the dirty data for a backing device back to it from
+ * an offline cache device, and then mark the backing device clean
+ *
+ * GPLv2
+ */
+
+#define _FILE_OFFSET_BITS	64
+#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#include "bcache.h"
+
+/* Reads into one write; more pieces than this and the write is cut short */
+#define MAX_PIECES	16
+
+/* A dirty extent: backing device sectors [start, end) are at @cache */
+struct extent {
+	uint64_t	start, end;
+	uint64_t	cache;
+};
+
+struct extents {
+	struct extent	*e;
+	size_t		nr, size;
+};
+
+/* A journal key, and where it was in the journal; newer keys win */
+struct jkey {
+	uint64_t	seq;
+	uint64_t	idx;
+	BKEY_PADDED(key);
+};
+
+/*
+ * One write to the backing device: its sectors are contiguous there, but
+ * each piece is read from wherever it is on the cache first.
+ */
+struct slot {
+	void		*buf;
+	uint64_t	start;		/* backing device sector */
+	unsigned	sectors;
+	unsigned	nr_pieces;
+	unsigned	reads_left;
+	bool		writing;
+	int		error;
+	uint64_t	cache[MAX_PIECES];
+	struct iovec	iov[MAX_PIECES];
+};
+
+static struct {
+	struct cache_sb		sb;		/* the cache's */
+	struct cache_sb		bdev;
+	const char		*cache_dev, *bdev_dev;
+	int			cache_fd, bdev_fd;
+	uint8_t			*gens;
+	uint64_t		inode;
+	uint64_t		data_offset;	/* sectors */
+
+	struct jkey		*jkeys;
+	size_t			nr_jkeys, jkeys_size;
+	struct jset		newest;
+
+	/* sectors the journal has newer keys for, sorted and disjoint */
+	struct extents		covered;
+	struct extents		dirty;
+
+	/* the copy */
+	size_t			next;		/* extent */
+	uint64_t		next_offset;	/* sectors into it */
+	unsigned		qd;
+	unsigned		max_sectors;
+	uint64_t		written;
+	int			error;
+
+	bool			dry_run, detach, force, verbose;
+} w = {
+	.qd		= 32,
+	.max_sectors	= 2048,
+};
+
+static int extents_push(struct extents *l, uint64_t start, uint64_t end,
+			uint64_t cache)
+{
+	if (l->nr == l->size) {
+		struct extent *n;
+
+		l->size = l->size ? l->size * 2 : 1024;
+		n = realloc(l->e, l->size * sizeof(*n));
+		if (!n)
+			return -ENOMEM;
+		l->e = n;
+	}
+
+	l->e[l->nr++] = (struct extent) { start, end, cache };
+	return 0;
+}
+
+/* First covered range that ends after @offset */
+static size_t covered_find(uint64_t offset)
+{
+	size_t l = 0, r = w.covered.nr;
+
+	while (l < r) {
+		size_t m = (l + r) / 2;
+
+		if (w.covered.e[m].end <= offset)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+/*
+ * Adds the parts of [start, end) the journal doesn't cover to the dirty
+ * list; @cache is where @start is on the cache.
+ */
+static int add_uncovered(uint64_t start, uint64_t end, uint64_t cache)
+{
+	size_t c = covered_find(start);
+	uint64_t pos = start;
+	int ret = 0;
+
+	for (; !ret && pos < end && c < w.covered.nr &&
+	     w.covered.e[c].start < end; c++) {
+		if (w.covered.e[c].start > pos)
+			ret = extents_push(&w.dirty, pos, w.covered.e[c].start,
+					   cache + pos - start);
+		pos = MAX(pos, w.covered.e[c].end);
+	}
+
+	if (!ret && pos < end)
+		ret = extents_push(&w.dirty, pos, end, cache + pos - start);
+
+	return ret;
+}
+
+static int cover(uint64_t start, uint64_t end)
+{
+	size_t c = covered_find(start), m;
+	struct extent *e;
+
+	/* merge with every range this overlaps or touches */
+	if (c && w.covered.e[c - 1].end == start)
+		c--;
+
+	for (m = c; m < w.covered.nr && w.covered.e[m].start <= end; m++) {
+		start	= MIN(start, w.covered.e[m].start);
+		end	= MAX(end, w.covered.e[m].end);
+	}
+
+	if (m == c) {
+		if (extents_push(&w.covered, 0, 0, 0))
+			return -ENOMEM;
+		e = w.covered.e;
+		memmove(e + c + 1, e + c, (w.covered.nr - 1 - c) * sizeof(*e));
+	} else {
+		e = w.covered.e;
+		memmove(e + c + 1, e + m, (w.covered.nr - m) * sizeof(*e));
+		w.covered.nr -= m - c - 1;
+	}
+
+	e[c] = (struct extent) { start, end, 0 };
+	return 0;
+}
+
+/* First pointer to data that's still there, or -1 */
+static int live_ptr(const struct bkey *k)
+{
+	unsigned i;
+
+	for (i = 0; i < KEY_PTRS(k); i++)
+		if (ptr_live(&w.sb, w.gens, k, i))
+			return i;
+
+	return -1;
+}
+
+static void journal_entry(struct jset *i, void *arg)
+{
+	struct bkey *k;
+	uint64_t idx = 0;
+
+	if (i->seq > w.newest.seq)
+		memcpy(&w.newest, i, sizeof(w.newest));
+
+	for (k = i->start; k < (struct bkey *) end(i); k = bkey_next(k)) {
+		struct jkey *j;
+
+		if (bkey_next(k) > (struct bkey *) end(i) ||
+		    KEY_PTRS(k) > BKEY_PAD - 2)
+			break;
+
+		if (w.nr_jkeys == w.jkeys_size) {
+			w.jkeys_size = w.jkeys_size ? w.jkeys_size * 2 : 256;
+			j = realloc(w.jkeys, w.jkeys_size * sizeof(*j));
+			if (!j) {
+				w.error = -ENOMEM;
+				return;
+			}
+			w.jkeys = j;
+		}
+
+		j = &w.jkeys[w.nr_jkeys++];
+		j->seq = i->seq;
+		j->idx = idx++;
+		memcpy(&j->key, k, bkey_u64s(k) * sizeof(uint64_t));
+	}
+}
+
+static int jkey_cmp_newest(const void *_l, const void *_r)
+{
+	const struct jkey *l = _l, *r = _r;
+
+	if (l->seq != r->seq)
+		return l->seq < r->seq ? 1 : -1;
+	return l->idx < r->idx ? 1 : l->idx > r->idx ? -1 : 0;
+}
+
+/*
+ * Journal replay would insert these over the btree: go from the newest key
+ * to the oldest, so a key is only dirty where nothing newer covers it.
+ */
+static int journal_overlay(void)
+{
+	size_t i;
+	int ret = 0;
+
+	qsort(w.jkeys, w.nr_jkeys, sizeof(*w.jkeys), jkey_cmp_newest);
+
+	for (i = 0; !ret && i < w.nr_jkeys; i++) {
+		struct bkey *k = &w.jkeys[i].key;
+		int p = live_ptr(k);
+
+		if (w.jkeys[i].seq < w.newest.last_seq ||
+		    KEY_INODE(k) != w.inode ||
+		    KEY_SIZE(k) > KEY_OFFSET(k))
+			continue;
+
+		if (KEY_DIRTY(k) && p >= 0)
+			ret = add_uncovered(KEY_START(k), KEY_OFFSET(k),
+					    PTR_OFFSET(k, p));
+		if (!ret)
+			ret = cover(KEY_START(k), KEY_OFFSET(k));
+	}
+
+	return ret;
+}
+
+static void btree_key(const struct bkey *k, uint64_t start, uint64_t end,
+		      void *arg)
+{
+	int p;
+
+	if (w.error || KEY_INODE(k) != w.inode || !KEY_DIRTY(k))
+		return;
+
+	p = live_ptr(k);
+	if (p >= 0)
+		w.error = add_uncovered(start, end,
+					PTR_OFFSET(k, p) + start - KEY_START(k));
+}
+
+static int extent_cmp(const void *_l, const void *_r)
+{
+	const struct extent *l = _l, *r = _r;
+
+	return l->start < r->start ? -1 : l->start > r->start;
+}
+
+/*
+ * The next write: as many extents as are contiguous on the backing device,
+ * up to max_sectors, reading pieces contiguous on the cache together.
+ */
+static bool next_write(struct slot *s)
+{
+	unsigned max = w.max_sectors;
+
+	s->sectors = 0;
+	s->nr_pieces = 0;
+
+	while (w.next < w.dirty.nr && s->sectors < max) {
+		struct extent *e = &w.dirty.e[w.next];
+		uint64_t start = e->start + w.next_offset;
+		uint64_t cache = e->cache + w.next_offset;
+		unsigned n = MIN(e->end - start, max - s->sectors);
+		unsigned p = s->nr_pieces;
+
+		if (s->sectors && start != s->start + s->sectors)
+			break;
+
+		if (p && cache == s->cache[p - 1] + (s->iov[p - 1].iov_len >> 9)) {
+			s->iov[p - 1].iov_len += n << 9;
+		} else {
+			if (p == MAX_PIECES)
+				break;
+
+			if (!p)
+				s->start = start;
+			s->cache[p] = cache;
+			s->iov[p] = (struct iovec) {
+				.iov_base	= s->buf + (s->sectors << 9),
+				.iov_len	= n << 9,
+			};
+			s->nr_pieces++;
+		}
+
+		s->sectors += n;
+		w.next_offset += n;
+		if (start + n == e->end) {
+			w.next++;
+			w.next_offset = 0;
+		}
+	}
+
+	return s->sectors;
+}
+
+/* For kernels without io_uring: the same writes, one at a time */
+static int copy_sync(struct slot *s)
+{
+	unsigned i;
+	ssize_t ret;
+
+	/* a short transfer leaves errno as it was: that's EIO, not errno */
+	while (next_write(s)) {
+		for (i = 0; i < s->nr_pieces; i++) {
+			ret = pread(w.cache_fd, s->iov[i].iov_base,
+				    s->iov[i].iov_len, s->cache[i] << 9);
+			if (ret < 0)
+				return -errno;
+			if (ret != s->iov[i].iov_len)
+				return -EIO;
+		}
+
+		ret = pwrite(w.bdev_fd, s->buf, s->sectors << 9,
+			     (s->start + w.data_offset) << 9);
+		if (ret < 0)
+			return -errno;
+		if (ret != s->sectors << 9)
+			return -EIO;
+
+		w.written += s->sectors;
+	}
+
+	return 0;
+}
+
+/*
+ * io_uring, with the raw syscalls as in bcache-test: every slot's reads go
+ * out together, and its write as soon as they're all back, so both devices
+ * see a deep queue.
+ */
+struct uring {
+	int			fd;
+	unsigned		*sq_tail, *sq_mask, *sq_array;
+	unsigned		*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	unsigned		to_submit;
+};
+
+static int uring_init(struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -errno;
+
+	sq = mmap(NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned),
+		  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd,
+		  IORING_OFF_SQ_RING);
+	cq = mmap(NULL, p.cq_off.cqes + p.cq_entries * sizeof(*u->cqes),
+		  PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd,
+		  IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(*u->sqes),
+		       PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd,
+		       IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+		close(u->fd);
+		return -ENOMEM;
+	}
+
+	u->sq_tail	= sq + p.sq_off.tail;
+	u->sq_mask	= sq + p.sq_off.ring_mask;
+	u->sq_array	= sq + p.sq_off.array;
+	u->cq_head	= cq + p.cq_off.head;
+	u->cq_tail	= cq + p.cq_off.tail;
+	u->cq_mask	= cq + p.cq_off.ring_mask;
+	u->cqes		= cq + p.cq_off.cqes;
+	return 0;
+}
+
+static void uring_queue(struct uring *u, int op, int fd, struct iovec *iov,
+			unsigned nr_iov, uint64_t offset, uint64_t data)
+{
+	unsigned tail = *u->sq_tail, idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode	= op;
+	sqe->fd		= fd;
+	sqe->addr	= (unsigned long) iov;
+	sqe->len	= nr_iov;
+	sqe->off	= offset;
+	sqe->user_data	= data;
+
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+}
+
+static void slot_start(struct uring *u, struct slot *s, unsigned idx)
+{
+	unsigned i;
+
+	s->writing = false;
+	s->error = 0;
+	s->reads_left = s->nr_pieces;
+
+	for (i = 0; i < s->nr_pieces; i++)
+		uring_queue(u, IORING_OP_READV, w.cache_fd, &s->iov[i], 1,
+			    s->cache[i] << 9, (uint64_t) i << 32 | idx);
+}
+
+static void slot_write(struct uring *u, struct slot *s, unsigned idx)
+{
+	/* the pieces were read in place; write them out as one */
+	s->writing = true;
+	s->iov[0] = (struct iovec) {
+		.iov_base	= s->buf,
+		.iov_len	= s->sectors << 9,
+	};
+	uring_queue(u, IORING_OP_WRITEV, w.bdev_fd, &s->iov[0], 1,
+		    (s->start + w.data_offset) << 9, idx);
+}
+
+static int copy_uring(struct uring *u, struct slot *slots)
+{
+	unsigned i, inflight = 0;
+	int ret;
+
+	for (i = 0; i < w.qd && next_write(&slots[i]); i++) {
+		slot_start(u, &slots[i], i);
+		inflight++;
+	}
+
+	while (inflight) {
+		unsigned head, tail;
+
+		ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		u->to_submit -= ret;
+
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+			unsigned idx = (uint32_t) cqe->user_data;
+			unsigned piece = cqe->user_data >> 32;
+			struct slot *s = &slots[idx];
+			size_t len = s->writing
+				? s->sectors << 9 : s->iov[piece].iov_len;
+
+			/* a short read or write is past the end of the device */
+			if (!s->error && cqe->res != len)
+				s->error = cqe->res < 0 ? cqe->res : -EIO;
+
+			if (!s->writing) {
+				if (--s->reads_left)
+					continue;
+				if (!s->error) {
+					slot_write(u, s, idx);
+					continue;
+				}
+			}
+
+			if (s->error) {
+				w.error = s->error;
+				fprintf(stderr, "Error copying sectors %" PRIu64
+					"-%" PRIu64 ": %s\n", s->start,
+					s->start + s->sectors,
+					strerror(-s->error));
+			} else {
+				w.written += s->sectors;
+			}
+
+			/* stop starting new writes after an error */
+			if (!w.error && next_write(s))
+				slot_start(u, s, idx);
+			else
+				inflight--;
+		}
+
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return w.error;
+}
+
+static int copy(void)
+{
+	size_t buf_bytes = w.max_sectors << 9;
+	struct slot *slots;
+	struct uring u;
+	unsigned i;
+	int ret;
+
+	slots = calloc(w.qd, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < w.qd; i++)
+		if (posix_memalign(&slots[i].buf, 4096, buf_bytes))
+			return -ENOMEM;
+
+	/* not just -ENOSYS: io_uring_disabled and seccomp give -EPERM */
+	ret = uring_init(&u, w.qd * MAX_PIECES);
+	if (!ret)
+		ret = copy_uring(&u, slots);
+	else
+		ret = copy_sync(&slots[0]);
+
+	if (!ret && fsync(w.bdev_fd))
+		ret = -errno;
+
+	return ret;
+}
+
+/* O_EXCL so we fail if the kernel has the device registered */
+static int open_dev(const char *dev, int flags)
+{
+	int fd = open(dev, flags|O_EXCL|O_DIRECT);
+
+	/* not all filesystems can do O_DIRECT, if it's an image */
+	if (fd < 0 && errno == EINVAL)
+		fd = open(dev, flags|O_EXCL);
+
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %m\n", dev);
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+static void read_sb(const char *dev, struct cache_sb *sb)
+{
+	int fd = open(dev, O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s: %m\n", dev);
+		exit(EXIT_FAILURE);
+	}
+
+	if (sb_read(fd, 0, sb)) {
+		fprintf(stderr, "Couldn't read superblock of %s\n", dev);
+		exit(EXIT_FAILURE);
+	}
+
+	switch (sb_check(sb)) {
+	case SB_OK:
+		break;
+	case SB_BAD_CSUM:
+		fprintf(stderr, "Bad superblock csum on %s\n", dev);
+		exit(EXIT_FAILURE);
+	default:
+		fprintf(stderr, "%s is not a bcache device\n", dev);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+}
+
+/*
+ * As a detach does once it has written everything back: the backing device
+ * no longer depends on the cache set. With -k, as the kernel does once
+ * writeback finishes, which leaves our dirty keys in the cache.
+ */
+static int write_bdev_sb(void)
+{
+	int fd = open(w.bdev_dev, O_WRONLY), ret;
+
+	if (fd < 0)
+		return -errno;
+
+	if (w.detach) {
+		memset(w.bdev.set_uuid, 0, sizeof(w.bdev.set_uuid));
+		SET_BDEV_STATE(&w.bdev, BDEV_STATE_NONE);
+	} else {
+		SET_BDEV_STATE(&w.bdev, BDEV_STATE_CLEAN);
+	}
+
+	sb_set_csum(&w.bdev);
+
+	if ((ret = sb_write(fd, 0, &w.bdev)) ||
+	    (fsync(fd) && (ret = -errno))) {
+		close(fd);
+		return ret;
+	}
+
+	return close(fd) ? -errno : 0;
+}
+
+static uint64_t find_inode(void)
+{
+	const struct bkey *k = &w.newest.uuid_bucket;
+	size_t bytes = (KEY_SIZE(k) ?: w.sb.bucket_size) * 512UL, i;
+	struct uuid_entry *u;
+	char uuid[40];
+
+	if (!KEY_PTRS(k) || !ptr_live(&w.sb, w.gens, k, 0)) {
+		fprintf(stderr, "Bad uuid bucket pointer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (posix_memalign((void **) &u, 4096, bytes) || pread(w.cache_fd, u, bytes, PTR_OFFSET(k, 0) << 9) != bytes) {
+		fprintf(stderr, "Couldn't read uuids\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < bytes / sizeof(*u); i++)
+		if (!memcmp(u[i].uuid, w.bdev.uuid, 16) &&
+		    !UUID_FLASH_ONLY(&u[i])) {
+			free(u);
+			return i;
+		}
+
+	uuid_unparse(w.bdev.uuid, uuid);
+	fprintf(stderr, "%s (%s) isn't attached to this cache set\n",
+		w.bdev_dev, uuid);
+	exit(EXIT_FAILURE);
+}
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: bcache-writeback [options] cache_device backing_device\n"
+		"	-n		dry run: find the dirty data, don't copy it\n"
+		"	-d		detach the backing device afterwards (the default)\n"
+		"	-k		keep it attached, only mark it clean (see the man page)\n"
+		"	-f		check for dirty data even if the backing device is clean\n"
+		"	-q depth	writes in flight (default 32)\n"
+		"	-m kb		largest write (default 1024)\n"
+		"	-v		print every dirty extent\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t sectors = 0, merged = 0, last = UINT64_MAX;
+	double start;
+	const char *err = NULL;
+	size_t i;
+	int c, ret;
+
+	w.detach = true;
+
+	while ((c = getopt(argc, argv, "ndkfq:m:vh")) != -1)
+		switch (c) {
+		case 'n':
+			w.dry_run = true;
+			break;
+		case 'd':
+			/* the default now, kept for scripts */
+			w.detach = true;
+			break;
+		case 'k':
+			w.detach = false;
+			break;
+		case 'f':
+			w.force = true;
+			break;
+		case 'q':
+			w.qd = atoi(optarg);
+			if (!w.qd || w.qd > 1024)
+				usage();
+			break;
+		case 'm':
+			w.max_sectors = atoi(optarg) * 2;
+			if (w.max_sectors < 8 || w.max_sectors > 65536)
+				usage();
+			break;
+		case 'v':
+			w.verbose = true;
+			break;
+		default:
+			usage();
+		}
+
+	if (argc - optind != 2)
+		usage();
+
+	w.cache_dev	= argv[optind];
+	w.bdev_dev	= argv[optind + 1];
+
+	read_sb(w.cache_dev, &w.sb);
+	read_sb(w.bdev_dev, &w.bdev);
+
+	if (SB_IS_BDEV(&w.sb)) {
+		fprintf(stderr, "%s is a backing device, not a cache\n",
+			w.cache_dev);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!SB_IS_BDEV(&w.bdev)) {
+		fprintf(stderr, "%s is not a backing device\n", w.bdev_dev);
+		exit(EXIT_FAILURE);
+	}
+
+	if (memcmp(w.bdev.set_uuid, w.sb.set_uuid, 16)) {
+		fprintf(stderr, "%s isn't attached to the cache set of %s\n",
+			w.bdev_dev, w.cache_dev);
+		exit(EXIT_FAILURE);
+	}
+
+	if (BDEV_STATE(&w.bdev) != BDEV_STATE_DIRTY && !w.force) {
+		printf("%s is clean, nothing to write back\n", w.bdev_dev);
+		exit(EXIT_SUCCESS);
+	}
+
+	/*
+	 * Extents, and btree nodes, may have their only live pointer on
+	 * another member, which with just this device's gens and journal we'd
+	 * skip; then we'd mark the backing device clean over dirty data.
+	 */
+	if (w.sb.nr_in_set != 1) {
+		fprintf(stderr, "%s is one of %u devices in its cache set; "
+			"only single device cache sets are supported\n",
+			w.cache_dev, w.sb.nr_in_set);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!w.sb.bucket_size || !w.sb.block_size ||
+	    w.sb.nbuckets <= w.sb.first_bucket ||
+	    w.sb.nr_this_dev >= MAX_CACHES_PER_SET) {
+		fprintf(stderr, "Bad cache geometry on %s\n", w.cache_dev);
+		exit(EXIT_FAILURE);
+	}
+
+	w.data_offset = sb_data_offset(&w.bdev);
+
+	w.cache_fd	= open_dev(w.cache_dev, O_RDONLY);
+	w.bdev_fd	= open_dev(w.bdev_dev, w.dry_run ? O_RDONLY : O_RDWR);
+
+	w.gens = calloc(w.sb.nbuckets, 1);
+	if (!w.gens) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = journal_read(w.cache_fd, &w.sb, journal_entry, NULL) ?: w.error;
+	if (ret || !w.newest.seq) {
+		fprintf(stderr, "Error reading journal: %s\n",
+			ret ? strerror(-ret) : "no entries");
+		exit(EXIT_FAILURE);
+	}
+
+	ret = prio_read(w.cache_fd, &w.sb,
+			w.newest.prio_bucket[w.sb.nr_this_dev], w.gens);
+	if (ret) {
+		fprintf(stderr, "Error reading bucket gens: %s\n",
+			strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	w.inode = find_inode();
+
+	ret = journal_overlay();
+	free(w.jkeys);
+	if (!ret)
+		ret = btree_walk(w.cache_fd, &w.sb, w.gens, &w.newest.btree_root,
+				 w.newest.btree_level, btree_key, NULL, &err) ?:
+			w.error;
+	if (ret) {
+		fprintf(stderr, "Error reading btree: %s\n",
+			ret == -EBADMSG ? err : strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	qsort(w.dirty.e, w.dirty.nr, sizeof(*w.dirty.e), extent_cmp);
+
+	for (i = 0; i < w.dirty.nr; i++) {
+		struct extent *e = &w.dirty.e[i];
+
+		if (i && e->start < e[-1].end) {
+			fprintf(stderr, "Dirty extents overlap at sector %"
+				PRIu64 ", not writing anything back\n",
+				e->start);
+			exit(EXIT_FAILURE);
+		}
+
+		if (w.verbose)
+			printf("%" PRIu64 "-%" PRIu64 " from cache sector %"
+			       PRIu64 "\n", e->start, e->end, e->cache);
+
+		merged += e->start != last;
+		last = e->end;
+		sectors += e->end - e->start;
+	}
+
+	printf("inode %" PRIu64 ": %zu dirty extents, %" PRIu64 " runs, %.1f MB\n",
+	       w.inode, w.dirty.nr, merged, sectors / 2048.0);
+
+	if (w.dry_run)
+		exit(EXIT_SUCCESS);
+
+	start = now_seconds();
+
+	ret = copy();
+	if (ret) {
+		fprintf(stderr, "Error writing back: %s, %s left dirty\n",
+			strerror(-ret), w.bdev_dev);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("wrote %.1f MB in %.2fs\n", w.written / 2048.0,
+	       now_seconds() - start);
+
+	ret = write_bdev_sb();
+	if (ret) {
+		fprintf(stderr, "Error writing superblock of %s: %s\n",
+			w.bdev_dev, strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%s is now %s\n", w.bdev_dev, w.detach ? "detached" : "clean");
+	return 0;
+}
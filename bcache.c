@@ -1,10 +1,17 @@
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "bcache.h"
+
 /*
  * Portions Copyright (c) 1996-2001, PostgreSQL Global Development Group (Any
  * use permitted, subject to terms of PostgreSQL license; see.)
@@ -115,15 +122,1011 @@ static const uint64_t crc_table[256] = {
 	0x9AFCE626CE85B507ULL
 };
 
-inline uint64_t crc64(const void *_data, size_t len)
-{
-	uint64_t crc = 0xFFFFFFFFFFFFFFFFULL;
-	const unsigned char *data = _data;
+/*
+ * Slice-by-8: crc_table_sb8[k][i] is the crc register contribution of byte i
+ * followed by k + 1 zero bytes, i.e. (i * x^(64 + 8 * (k + 1))) mod P.
+ * Generated from crc_table at startup.
+ */
+static uint64_t crc_table_sb8[7][256];
 
+static uint64_t crc64_bytewise(uint64_t crc, const unsigned char *data,
+			       size_t len)
+{
 	while (len--) {
 		int i = ((int) (crc >> 56) ^ *data++) & 0xFF;
 		crc = crc_table[i] ^ (crc << 8);
 	}
 
+	return crc;
+}
+
+static inline uint64_t load_be64(const unsigned char *p)
+{
+	return ((uint64_t) p[0] << 56) | ((uint64_t) p[1] << 48) |
+	       ((uint64_t) p[2] << 40) | ((uint64_t) p[3] << 32) |
+	       ((uint64_t) p[4] << 24) | ((uint64_t) p[5] << 16) |
+	       ((uint64_t) p[6] <<  8) | ((uint64_t) p[7]);
+}
+
+static uint64_t crc64_sb8(uint64_t crc, const unsigned char *data, size_t len)
+{
+	while (len >= 8) {
+		uint64_t x = crc ^ load_be64(data);
+
+		crc =	crc_table_sb8[6][(x >> 56)	  ] ^
+			crc_table_sb8[5][(x >> 48) & 0xFF] ^
+			crc_table_sb8[4][(x >> 40) & 0xFF] ^
+			crc_table_sb8[3][(x >> 32) & 0xFF] ^
+			crc_table_sb8[2][(x >> 24) & 0xFF] ^
+			crc_table_sb8[1][(x >> 16) & 0xFF] ^
+			crc_table_sb8[0][(x >>  8) & 0xFF] ^
+			crc_table[x & 0xFF];
+
+		data += 8;
+		len -= 8;
+	}
+
+	return crc64_bytewise(crc, data, len);
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+/*
+ * Carry-less multiply folding, after Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction".
+ *
+ * The message is treated as a sequence of 128 bit big endian blocks, with the
+ * running crc xored into the top 64 bits of the first one. An accumulator A is
+ * moved D bits further down the message with
+ *
+ *	A * x^D == A_hi * (x^(D + 64) mod P) + A_lo * (x^D mod P)
+ *
+ * which keeps it at 128 bits; the last one is multiplied by x^64 and reduced
+ * mod P with a Barrett reduction to give the crc register.
+ */
+#define CRC64_X128		0x05F5C3C7EB52FAB6ULL	/* x^128 mod P */
+#define CRC64_X192		0x4EB938A7D257740EULL	/* x^192 mod P */
+#define CRC64_X256		0x571BEE0A227EF92BULL	/* x^256 mod P */
+#define CRC64_X320		0x44BEF2A201B5200CULL	/* x^320 mod P */
+#define CRC64_X512		0x5F6843CA540DF020ULL	/* x^512 mod P */
+#define CRC64_X576		0xDDF4B6981205B83FULL	/* x^576 mod P */
+#define CRC64_X1024		0x05CF79DEA9AC37D6ULL	/* x^1024 mod P */
+#define CRC64_X1088		0x001067E571D7D5C2ULL	/* x^1088 mod P */
+#define CRC64_MU		0x578D29D06CC4F872ULL	/* x^128 / P - x^64 */
+#define CRC64_POLY		0x42F0E1EBA9EA3693ULL	/* P - x^64 */
+#endif
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+#define CRC64_CLMUL_TARGET	__attribute__((target("pclmul,sse4.1")))
+#define CRC64_VCLMUL_TARGET	\
+	__attribute__((target("pclmul,sse4.1,avx2,vpclmulqdq")))
+
+static CRC64_CLMUL_TARGET inline __m128i clmul_load(const unsigned char *p)
+{
+	const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+					    7, 6, 5, 4, 3, 2, 1, 0);
+
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), bswap);
+}
+
+/* k holds x^D mod P in the low half and x^(D + 64) mod P in the high half */
+static CRC64_CLMUL_TARGET inline __m128i clmul_fold(__m128i a, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11),
+			     _mm_clmulepi64_si128(a, k, 0x00));
+}
+
+static CRC64_CLMUL_TARGET inline uint64_t clmul_finish(__m128i a,
+						       const unsigned char *data,
+						       size_t len)
+{
+	const __m128i k128 = _mm_set_epi64x(CRC64_X192, CRC64_X128);
+	const __m128i barrett = _mm_set_epi64x(CRC64_POLY, CRC64_MU);
+	__m128i t, q;
+	uint64_t h, l;
+
+	while (len >= 16) {
+		a = _mm_xor_si128(clmul_fold(a, k128), clmul_load(data));
+		data += 16;
+		len -= 16;
+	}
+
+	/* A * x^64 = (A_hi * (x^128 mod P)) + A_lo * x^64 = H * x^64 + L */
+	t = _mm_clmulepi64_si128(a, k128, 0x01);
+	h = _mm_extract_epi64(t, 1) ^ _mm_cvtsi128_si64(a);
+	l = _mm_cvtsi128_si64(t);
+
+	/* Barrett: q = (H * x^128 / P) / x^64, H * x^64 mod P = q * P mod x^64 */
+	q = _mm_clmulepi64_si128(_mm_cvtsi64_si128(h), barrett, 0x00);
+	q = _mm_cvtsi64_si128(_mm_extract_epi64(q, 1) ^ h);
+	q = _mm_clmulepi64_si128(q, barrett, 0x10);
+
+	return crc64_sb8(_mm_cvtsi128_si64(q) ^ l, data, len);
+}
+
+static CRC64_CLMUL_TARGET uint64_t crc64_pclmul(uint64_t crc,
+						const unsigned char *data,
+						size_t len)
+{
+	const __m128i k128 = _mm_set_epi64x(CRC64_X192, CRC64_X128);
+	const __m128i k512 = _mm_set_epi64x(CRC64_X576, CRC64_X512);
+	__m128i x0, x1, x2, x3;
+
+	if (len < 64)
+		return crc64_sb8(crc, data, len);
+
+	x0 = _mm_xor_si128(clmul_load(data), _mm_set_epi64x(crc, 0));
+	x1 = clmul_load(data + 16);
+	x2 = clmul_load(data + 32);
+	x3 = clmul_load(data + 48);
+	data += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x0 = _mm_xor_si128(clmul_fold(x0, k512), clmul_load(data));
+		x1 = _mm_xor_si128(clmul_fold(x1, k512), clmul_load(data + 16));
+		x2 = _mm_xor_si128(clmul_fold(x2, k512), clmul_load(data + 32));
+		x3 = _mm_xor_si128(clmul_fold(x3, k512), clmul_load(data + 48));
+		data += 64;
+		len -= 64;
+	}
+
+	x1 = _mm_xor_si128(clmul_fold(x0, k128), x1);
+	x2 = _mm_xor_si128(clmul_fold(x1, k128), x2);
+	x3 = _mm_xor_si128(clmul_fold(x2, k128), x3);
+
+	return clmul_finish(x3, data, len);
+}
+
+static CRC64_VCLMUL_TARGET inline __m256i vclmul_load(const unsigned char *p)
+{
+	const __m256i bswap = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+					       7, 6, 5, 4, 3, 2, 1, 0,
+					       15, 14, 13, 12, 11, 10, 9, 8,
+					       7, 6, 5, 4, 3, 2, 1, 0);
+
+	return _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) p),
+				   bswap);
+}
+
+static CRC64_VCLMUL_TARGET inline __m256i vclmul_fold(__m256i a, __m256i k)
+{
+	return _mm256_xor_si256(_mm256_clmulepi64_epi128(a, k, 0x11),
+				_mm256_clmulepi64_epi128(a, k, 0x00));
+}
+
+/*
+ * Same as crc64_pclmul(), but each ymm register carries two consecutive 128
+ * bit blocks, so four accumulators cover 128 bytes per iteration.
+ */
+static CRC64_VCLMUL_TARGET uint64_t crc64_vpclmul(uint64_t crc,
+						  const unsigned char *data,
+						  size_t len)
+{
+	const __m128i k128 = _mm_set_epi64x(CRC64_X192, CRC64_X128);
+	const __m256i k256 = _mm256_set_epi64x(CRC64_X320, CRC64_X256,
+					       CRC64_X320, CRC64_X256);
+	const __m256i k1024 = _mm256_set_epi64x(CRC64_X1088, CRC64_X1024,
+						CRC64_X1088, CRC64_X1024);
+	__m256i y0, y1, y2, y3;
+	__m128i x;
+
+	if (len < 256)
+		return crc64_pclmul(crc, data, len);
+
+	y0 = _mm256_xor_si256(vclmul_load(data),
+			      _mm256_set_epi64x(0, 0, crc, 0));
+	y1 = vclmul_load(data + 32);
+	y2 = vclmul_load(data + 64);
+	y3 = vclmul_load(data + 96);
+	data += 128;
+	len -= 128;
+
+	while (len >= 128) {
+		y0 = _mm256_xor_si256(vclmul_fold(y0, k1024), vclmul_load(data));
+		y1 = _mm256_xor_si256(vclmul_fold(y1, k1024), vclmul_load(data + 32));
+		y2 = _mm256_xor_si256(vclmul_fold(y2, k1024), vclmul_load(data + 64));
+		y3 = _mm256_xor_si256(vclmul_fold(y3, k1024), vclmul_load(data + 96));
+		data += 128;
+		len -= 128;
+	}
+
+	y1 = _mm256_xor_si256(vclmul_fold(y0, k256), y1);
+	y2 = _mm256_xor_si256(vclmul_fold(y1, k256), y2);
+	y3 = _mm256_xor_si256(vclmul_fold(y2, k256), y3);
+
+	x = _mm_xor_si128(clmul_fold(_mm256_castsi256_si128(y3), k128),
+			  _mm256_extracti128_si256(y3, 1));
+
+	/*
+	 * gcc doesn't emit vzeroupper ahead of the tail call out of here, and
+	 * dirty upper halves make every legacy SSE instruction after us (the
+	 * caller's memcpy, say) pay a merge penalty, 10x on sb_check()
+	 */
+	_mm256_zeroupper();
+
+	return clmul_finish(x, data, len);
+}
+#endif
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_PMULL
+#define HWCAP_PMULL		(1 << 4)
+#endif
+
+#define CRC64_PMULL_TARGET	__attribute__((target("+crypto")))
+
+/* Lane 1 is the high (earlier in the message) half, as on x86 */
+static CRC64_PMULL_TARGET inline uint64x2_t pmull_load(const unsigned char *p)
+{
+	uint64x2_t v = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(p)));
+
+	return vextq_u64(v, v, 1);
+}
+
+static CRC64_PMULL_TARGET inline uint64x2_t pmull(uint64_t a, uint64_t b)
+{
+	return vreinterpretq_u64_p128(vmull_p64(a, b));
+}
+
+static CRC64_PMULL_TARGET inline uint64x2_t pmull_fold(uint64x2_t a,
+						       uint64_t k_lo,
+						       uint64_t k_hi)
+{
+	return veorq_u64(pmull(vgetq_lane_u64(a, 1), k_hi),
+			 pmull(vgetq_lane_u64(a, 0), k_lo));
+}
+
+static CRC64_PMULL_TARGET uint64_t crc64_pmull(uint64_t crc,
+					       const unsigned char *data,
+					       size_t len)
+{
+	uint64x2_t x0, x1, x2, x3, t;
+	uint64_t h, l, q;
+
+	if (len < 64)
+		return crc64_sb8(crc, data, len);
+
+	x0 = veorq_u64(pmull_load(data), vcombine_u64(vcreate_u64(0),
+						      vcreate_u64(crc)));
+	x1 = pmull_load(data + 16);
+	x2 = pmull_load(data + 32);
+	x3 = pmull_load(data + 48);
+	data += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x0 = veorq_u64(pmull_fold(x0, CRC64_X512, CRC64_X576),
+			       pmull_load(data));
+		x1 = veorq_u64(pmull_fold(x1, CRC64_X512, CRC64_X576),
+			       pmull_load(data + 16));
+		x2 = veorq_u64(pmull_fold(x2, CRC64_X512, CRC64_X576),
+			       pmull_load(data + 32));
+		x3 = veorq_u64(pmull_fold(x3, CRC64_X512, CRC64_X576),
+			       pmull_load(data + 48));
+		data += 64;
+		len -= 64;
+	}
+
+	x1 = veorq_u64(pmull_fold(x0, CRC64_X128, CRC64_X192), x1);
+	x2 = veorq_u64(pmull_fold(x1, CRC64_X128, CRC64_X192), x2);
+	x3 = veorq_u64(pmull_fold(x2, CRC64_X128, CRC64_X192), x3);
+
+	while (len >= 16) {
+		x3 = veorq_u64(pmull_fold(x3, CRC64_X128, CRC64_X192),
+			       pmull_load(data));
+		data += 16;
+		len -= 16;
+	}
+
+	t = pmull(vgetq_lane_u64(x3, 1), CRC64_X128);
+	h = vgetq_lane_u64(t, 1) ^ vgetq_lane_u64(x3, 0);
+	l = vgetq_lane_u64(t, 0);
+
+	q = vgetq_lane_u64(pmull(h, CRC64_MU), 1) ^ h;
+	q = vgetq_lane_u64(pmull(q, CRC64_POLY), 0);
+
+	return crc64_sb8(q ^ l, data, len);
+}
+#endif
+
+static uint64_t (*crc64_impl)(uint64_t, const unsigned char *, size_t)
+	= crc64_sb8;
+
+__attribute__((constructor))
+static void crc64_init(void)
+{
+	unsigned i, k;
+
+	for (i = 0; i < 256; i++) {
+		uint64_t crc = crc_table[i];
+
+		for (k = 0; k < 7; k++) {
+			crc = crc_table[crc >> 56] ^ (crc << 8);
+			crc_table_sb8[k][i] = crc;
+		}
+	}
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1"))
+		crc64_impl = crc64_pclmul;
+	if (crc64_impl == crc64_pclmul &&
+	    __builtin_cpu_supports("avx2") &&
+	    __builtin_cpu_supports("vpclmulqdq"))
+		crc64_impl = crc64_vpclmul;
+#elif defined(__aarch64__)
+	if (getauxval(AT_HWCAP) & HWCAP_PMULL)
+		crc64_impl = crc64_pmull;
+#endif
+}
+
+/* Without the initial and final inversion, for seeded csums like btree nodes */
+uint64_t crc64_update(uint64_t crc, const void *_data, size_t len)
+{
+	return crc64_impl(crc, _data, len);
+}
+
+uint64_t crc64(const void *_data, size_t len)
+{
+	uint64_t crc = 0xFFFFFFFFFFFFFFFFULL;
+
+	crc = crc64_impl(crc, _data, len);
+
 	return crc ^ 0xFFFFFFFFFFFFFFFFULL;
 }
+
+int bkey_to_text(char *buf, size_t size, const struct bkey *k)
+{
+	unsigned i;
+	int n;
+
+	n = snprintf(buf, size, "%llu:%llu len %llu",
+		     (unsigned long long) KEY_INODE(k),
+		     (unsigned long long) KEY_OFFSET(k),
+		     (unsigned long long) KEY_SIZE(k));
+
+	for (i = 0; i < KEY_PTRS(k) && n < size; i++)
+		n += snprintf(buf + n, size - n, "%s%llu:%llu gen %llu",
+			      i ? ", " : " -> ",
+			      (unsigned long long) PTR_DEV(k, i),
+			      (unsigned long long) PTR_OFFSET(k, i),
+			      (unsigned long long) PTR_GEN(k, i));
+
+	if (KEY_DIRTY(k) && n < size)
+		n += snprintf(buf + n, size - n, " dirty");
+
+	return n;
+}
+
+/*
+ * Like the kernel's journal_read_bucket(): entries follow each other
+ * block aligned, until one has the wrong magic or doesn't fit. A bad csum
+ * ends the bucket too, since nothing after it can be trusted.
+ */
+struct jset *jset_next(const struct cache_sb *sb, void *bucket,
+		       size_t *offset, bool *bad_csum)
+{
+	size_t bucket_bytes = sb->bucket_size * 512UL;
+	struct jset *i = bucket + *offset;
+
+	if (*offset + sizeof(*i) > bucket_bytes ||
+	    i->magic != jset_magic(sb) ||
+	    set_bytes(i) > bucket_bytes - *offset)
+		return NULL;
+
+	if (i->csum != csum_set(i)) {
+		*bad_csum = true;
+		return NULL;
+	}
+
+	*offset += set_blocks(i, sb->block_size * 512U) * sb->block_size * 512U;
+	return i;
+}
+
+/* Page aligned, so the readers below work on an O_DIRECT fd as well */
+static void *alloc_buf(size_t len)
+{
+	void *buf;
+
+	return posix_memalign(&buf, 4096, len) ? NULL : buf;
+}
+
+static int pread_all(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, offset);
+		if (ret <= 0)
+			return ret ? -errno : -EIO;
+
+		buf	+= ret;
+		len	-= ret;
+		offset	+= ret;
+	}
+
+	return 0;
+}
+
+int journal_read(int fd, const struct cache_sb *sb,
+		 void (*fn)(struct jset *, void *), void *arg)
+{
+	size_t bucket_bytes = sb->bucket_size * 512UL, offset;
+	struct jset *i;
+	bool bad_csum;
+	unsigned b;
+	void *buf;
+	int ret = 0;
+
+	if (sb->njournal_buckets > SB_JOURNAL_BUCKETS)
+		return -ERANGE;
+
+	buf = alloc_buf(bucket_bytes);
+	if (!buf)
+		return -ENOMEM;
+
+	for (b = 0; b < sb->njournal_buckets && !ret; b++) {
+		ret = pread_all(fd, buf, bucket_bytes,
+				bucket_to_offset(sb, sb->d[b]));
+
+		offset = 0;
+		while (!ret && (i = jset_next(sb, buf, &offset, &bad_csum)))
+			fn(i, arg);
+	}
+
+	free(buf);
+	return ret;
+}
+
+int prio_read(int fd, const struct cache_sb *sb, uint64_t bucket,
+	      uint8_t *gens)
+{
+	size_t bucket_bytes = sb->bucket_size * 512UL;
+	size_t per_bucket = (bucket_bytes - sizeof(struct prio_set)) /
+		sizeof(struct bucket_disk);
+	struct prio_set *p;
+	uint64_t b = 0;
+	unsigned i;
+	int ret = 0;
+
+	p = alloc_buf(bucket_bytes);
+	if (!p)
+		return -ENOMEM;
+
+	while (b < sb->nbuckets) {
+		if (bucket < sb->first_bucket || bucket >= sb->nbuckets) {
+			ret = -ERANGE;
+			break;
+		}
+
+		ret = pread_all(fd, p, bucket_bytes,
+				bucket_to_offset(sb, bucket));
+		if (ret)
+			break;
+
+		if (p->csum != crc64(&p->magic, bucket_bytes - 8) ||
+		    p->magic != pset_magic(sb)) {
+			ret = -EBADMSG;
+			break;
+		}
+
+		for (i = 0; i < per_bucket && b < sb->nbuckets; i++, b++)
+			gens[b] = p->data[i].gen;
+
+		bucket = p->next_bucket;
+	}
+
+	free(p);
+	return ret;
+}
+
+/* Seeded with the node's own pointer, so a misdirected read fails it */
+uint64_t btree_csum_set(const struct bkey *k, const struct bset *i)
+{
+	const void *data = (void *) i + 8, *end = end(i);
+
+	return crc64_update(k->ptr[0], data, end - data) ^
+		0xFFFFFFFFFFFFFFFFULL;
+}
+
+/* As btree_node_read_done(): bsets continue while the seq matches */
+int btree_node_check(const struct cache_sb *sb, const struct bkey *k,
+		     void *data, struct btree_node *b, const char **err)
+{
+	unsigned block_bytes = sb->block_size * 512U;
+	unsigned blocks = btree_bytes(sb) / block_bytes;
+	struct bset *i = data;
+
+	b->nr_bsets = 0;
+	b->written = 0;
+
+	*err = "bad magic";
+	if (i->magic != bset_magic(sb))
+		return -EBADMSG;
+
+	while (b->written < blocks) {
+		i = data + b->written * block_bytes;
+
+		if (b->written &&
+		    (i->seq != b->bsets[0]->seq || i->magic != bset_magic(sb)))
+			break;
+
+		*err = "unsupported bset version";
+		if (i->version > BSET_VERSION)
+			return -EBADMSG;
+
+		*err = "bad btree header";
+		if (b->written + set_blocks(i, block_bytes) > blocks)
+			return -EBADMSG;
+
+		*err = "bad checksum";
+		if (i->csum != (i->version ? btree_csum_set(k, i) : csum_set(i)))
+			return -EBADMSG;
+
+		if (b->nr_bsets == b->size) {
+			struct bset **n;
+
+			b->size = b->size ? b->size * 2 : 8;
+			n = realloc(b->bsets, b->size * sizeof(*n));
+			*err = "out of memory";
+			if (!n)
+				return -ENOMEM;
+			b->bsets = n;
+		}
+
+		b->bsets[b->nr_bsets++] = i;
+		b->written += set_blocks(i, block_bytes);
+	}
+
+	*err = NULL;
+	return 0;
+}
+
+/*
+ * Ranges already covered by newer bsets, in (inode, offset) order. Each
+ * bset is sorted and its keys don't overlap, so a bset is resolved with one
+ * merge against what newer ones cover.
+ */
+struct range {
+	uint64_t	inode;
+	uint64_t	start, end;
+};
+
+struct ranges {
+	struct range	*r;
+	size_t		nr, size;
+};
+
+static int range_cmp(const struct range *l, uint64_t inode, uint64_t offset)
+{
+	if (l->inode != inode)
+		return l->inode < inode ? -1 : 1;
+	return l->end <= offset ? -1 : 0;
+}
+
+static int ranges_push(struct ranges *r, uint64_t inode, uint64_t start,
+		       uint64_t end)
+{
+	struct range *last = r->nr ? &r->r[r->nr - 1] : NULL;
+
+	if (last && last->inode == inode && start <= last->end) {
+		if (end > last->end)
+			last->end = end;
+		return 0;
+	}
+
+	if (r->nr == r->size) {
+		struct range *n;
+
+		r->size = r->size ? r->size * 2 : 64;
+		n = realloc(r->r, r->size * sizeof(*n));
+		if (!n)
+			return -ENOMEM;
+		r->r = n;
+	}
+
+	r->r[r->nr++] = (struct range) { inode, start, end };
+	return 0;
+}
+
+static void key_range(const struct bkey *k, unsigned level,
+		      uint64_t *start, uint64_t *end)
+{
+	/* extents end at their offset; node pointers are just a position */
+	*end	= KEY_OFFSET(k) + (level ? 1 : 0);
+	*start	= level ? KEY_OFFSET(k) : KEY_START(k);
+}
+
+int btree_node_for_each_live(const struct btree_node *b, unsigned level,
+			     live_key_fn fn, void *arg)
+{
+	struct ranges covered = { NULL }, next = { NULL }, tmp;
+	int n, ret = 0;
+
+	for (n = b->nr_bsets - 1; n >= 0 && !ret; n--) {
+		struct bset *i = b->bsets[n];
+		struct bkey *k;
+		size_t c = 0, m = 0;
+
+		next.nr = 0;
+
+		for (k = i->start; k < (struct bkey *) end(i); k = bkey_next(k)) {
+			uint64_t start, end, pos;
+
+			if (KEY_SIZE(k) > KEY_OFFSET(k) ||
+			    bkey_next(k) > (struct bkey *) end(i))
+				break;
+
+			key_range(k, level, &start, &end);
+			pos = start;
+
+			/* the covered ranges before this key can't overlap it */
+			while (c < covered.nr &&
+			       range_cmp(&covered.r[c], KEY_INODE(k), start) < 0)
+				c++;
+
+			for (m = c; pos < end && m < covered.nr &&
+			     covered.r[m].inode == KEY_INODE(k) &&
+			     covered.r[m].start < end; m++) {
+				if (covered.r[m].start > pos && KEY_PTRS(k))
+					fn(k, pos, covered.r[m].start, arg);
+				if (covered.r[m].end > pos)
+					pos = covered.r[m].end;
+			}
+
+			if (pos < end && KEY_PTRS(k))
+				fn(k, pos, end, arg);
+		}
+
+		/* then what's covered so far is the union of the two */
+		c = 0;
+		k = i->start;
+		while (!ret) {
+			struct range kr = { 0 };
+			bool have_key = k < (struct bkey *) end(i) &&
+				KEY_SIZE(k) <= KEY_OFFSET(k) &&
+				bkey_next(k) <= (struct bkey *) end(i);
+
+			if (have_key) {
+				kr.inode = KEY_INODE(k);
+				key_range(k, level, &kr.start, &kr.end);
+			}
+
+			if (c < covered.nr &&
+			    (!have_key ||
+			     covered.r[c].inode < kr.inode ||
+			     (covered.r[c].inode == kr.inode &&
+			      covered.r[c].start < kr.start))) {
+				ret = ranges_push(&next, covered.r[c].inode,
+						  covered.r[c].start,
+						  covered.r[c].end);
+				c++;
+			} else if (have_key) {
+				ret = ranges_push(&next, kr.inode,
+						  kr.start, kr.end);
+				k = bkey_next(k);
+			} else {
+				break;
+			}
+		}
+
+		tmp = covered;
+		covered = next;
+		next = tmp;
+	}
+
+	free(covered.r);
+	free(next.r);
+	return ret;
+}
+
+bool ptr_live(const struct cache_sb *sb, const uint8_t *gens,
+	      const struct bkey *k, unsigned i)
+{
+	uint64_t b = PTR_OFFSET(k, i) / sb->bucket_size;
+
+	return PTR_DEV(k, i) == sb->nr_this_dev &&
+		b >= sb->first_bucket && b < sb->nbuckets &&
+		!gen_after(gens[b], PTR_GEN(k, i));
+}
+
+struct walk {
+	int			fd;
+	const struct cache_sb	*sb;
+	const uint8_t		*gens;
+	live_key_fn		fn;
+	void			*arg;
+	const char		**err;
+};
+
+struct children {
+	struct child {
+		BKEY_PADDED(key);
+	}			*k;
+	size_t			nr, size;
+	const struct walk	*w;
+	int			ret;
+};
+
+static void child_key(const struct bkey *k, uint64_t start, uint64_t end,
+		      void *arg)
+{
+	struct children *c = arg;
+
+	if (c->ret || !ptr_live(c->w->sb, c->w->gens, k, 0))
+		return;
+
+	if (c->nr == c->size) {
+		struct child *n;
+
+		c->size = c->size ? c->size * 2 : 64;
+		n = realloc(c->k, c->size * sizeof(*n));
+		if (!n) {
+			c->ret = -ENOMEM;
+			return;
+		}
+		c->k = n;
+	}
+
+	memcpy(&c->k[c->nr++].key, k, bkey_u64s(k) * sizeof(uint64_t));
+}
+
+static int walk_node(const struct walk *w, const struct bkey *k,
+		     unsigned level)
+{
+	size_t bytes = btree_bytes(w->sb), i;
+	struct children c = { .w = w };
+	struct btree_node b = { 0 };
+	void *buf;
+	int ret;
+
+	buf = alloc_buf(bytes);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = pread_all(w->fd, buf, bytes, PTR_OFFSET(k, 0) << 9);
+	if (ret) {
+		*w->err = "read error";
+		goto out;
+	}
+
+	ret = btree_node_check(w->sb, k, buf, &b, w->err);
+	if (ret)
+		goto out;
+
+	if (!level) {
+		ret = btree_node_for_each_live(&b, 0, w->fn, w->arg);
+		goto out;
+	}
+
+	ret = btree_node_for_each_live(&b, level, child_key, &c) ?: c.ret;
+
+	/* this node's no longer needed, and its children are read next */
+	free(buf);
+	free(b.bsets);
+	buf = NULL;
+	b.bsets = NULL;
+
+	for (i = 0; !ret && i < c.nr; i++)
+		posix_fadvise(w->fd, PTR_OFFSET(&c.k[i].key, 0) << 9, bytes,
+			      POSIX_FADV_WILLNEED);
+
+	for (i = 0; !ret && i < c.nr; i++)
+		ret = walk_node(w, &c.k[i].key, level - 1);
+out:
+	free(c.k);
+	free(b.bsets);
+	free(buf);
+	return ret;
+}
+
+int btree_walk(int fd, const struct cache_sb *sb, const uint8_t *gens,
+	       const struct bkey *root, unsigned level,
+	       live_key_fn fn, void *arg, const char **err)
+{
+	struct walk w = { fd, sb, gens, fn, arg, err };
+
+	*err = "bad btree root";
+	if (!KEY_PTRS(root) || !ptr_live(sb, gens, root, 0))
+		return -EBADMSG;
+
+	*err = NULL;
+	return walk_node(&w, root, level);
+}
+
+static const char * const sb_status_names[] = {
+	[SB_OK]		= "ok",
+	[SB_ERR_OPEN]	= "open-error",
+	[SB_ERR_READ]	= "read-error",
+	[SB_BAD_MAGIC]	= "no-superblock",
+	[SB_BAD_OFFSET]	= "bad-sector",
+	[SB_BAD_CSUM]	= "bad-csum",
+};
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+static const char *name_of(const char * const names[], unsigned nr,
+			   uint64_t v)
+{
+	return v < nr && names[v] ? names[v] : "unknown";
+}
+
+const char *sb_status_str(enum sb_status status)
+{
+	return name_of(sb_status_names, ARRAY_SIZE(sb_status_names), status);
+}
+
+#define SB_IO_SIZE	4096
+
+int sb_read(int fd, uint64_t offset, struct cache_sb *sb)
+{
+	void *buf = alloc_buf(SB_IO_SIZE);
+	ssize_t ret;
+
+	if (!buf)
+		return -ENOMEM;
+
+	/* a device too small for the whole 4k still has a superblock */
+	ret = pread(fd, buf, SB_IO_SIZE, offset ?: SB_START);
+	if (ret >= (ssize_t) sizeof(*sb))
+		memcpy(sb, buf, sizeof(*sb));
+
+	free(buf);
+
+	if (ret < 0)
+		return -errno;
+	return ret < (ssize_t) sizeof(*sb) ? -EIO : 0;
+}
+
+int sb_write(int fd, uint64_t offset, const struct cache_sb *sb)
+{
+	void *buf = alloc_buf(SB_IO_SIZE);
+	ssize_t ret;
+
+	if (!buf)
+		return -ENOMEM;
+
+	memset(buf, 0, SB_IO_SIZE);
+	memcpy(buf, sb, sizeof(*sb));
+
+	ret = pwrite(fd, buf, SB_IO_SIZE, offset ?: SB_START);
+	free(buf);
+
+	if (ret < 0)
+		return -errno;
+	return ret != SB_IO_SIZE ? -EIO : 0;
+}
+
+enum sb_status sb_check(const struct cache_sb *sb)
+{
+	if (memcmp(sb->magic, bcache_magic, 16))
+		return SB_BAD_MAGIC;
+	if (sb->offset != SB_SECTOR)
+		return SB_BAD_OFFSET;
+	/* keys bounds what csum_set() reads */
+	if (sb->keys > SB_JOURNAL_BUCKETS || sb->csum != csum_set(sb))
+		return SB_BAD_CSUM;
+	return SB_OK;
+}
+
+void sb_set_csum(struct cache_sb *sb)
+{
+	sb->csum = csum_set(sb);
+}
+
+uint64_t sb_data_offset(const struct cache_sb *sb)
+{
+	return sb->version == BCACHE_SB_VERSION_BDEV
+		? BDEV_DATA_START_DEFAULT : sb->data_offset;
+}
+
+static const char * const cache_mode_names[] = {
+	[CACHE_MODE_WRITETHROUGH]	= "writethrough",
+	[CACHE_MODE_WRITEBACK]		= "writeback",
+	[CACHE_MODE_WRITEAROUND]	= "writearound",
+	[CACHE_MODE_NONE]		= "none",
+};
+
+static const char * const bdev_state_names[] = {
+	[BDEV_STATE_NONE]		= "detached",
+	[BDEV_STATE_CLEAN]		= "clean",
+	[BDEV_STATE_DIRTY]		= "dirty",
+	[BDEV_STATE_STALE]		= "inconsistent",
+};
+
+static const char * const replacement_names[] = {
+	[CACHE_REPLACEMENT_LRU]		= "lru",
+	[CACHE_REPLACEMENT_FIFO]	= "fifo",
+	[CACHE_REPLACEMENT_RANDOM]	= "random",
+};
+
+const char *bdev_cache_mode_name(uint64_t mode)
+{
+	return name_of(cache_mode_names, ARRAY_SIZE(cache_mode_names), mode);
+}
+
+const char *bdev_state_name(uint64_t state)
+{
+	return name_of(bdev_state_names, ARRAY_SIZE(bdev_state_names), state);
+}
+
+const char *cache_replacement_name(uint64_t policy)
+{
+	return name_of(replacement_names, ARRAY_SIZE(replacement_names),
+		       policy);
+}
+
+/* Regular files on filesystems without O_DIRECT get a buffered read */
+void sb_probe_dev(struct sb_probe *p)
+{
+	int fd, ret;
+
+	p->status = SB_ERR_OPEN;
+
+	fd = open(p->dev, O_RDONLY|O_DIRECT);
+	if (fd < 0 && errno == EINVAL)
+		fd = open(p->dev, O_RDONLY);
+	if (fd < 0) {
+		p->error = errno;
+		return;
+	}
+
+	if ((ret = sb_read(fd, p->offset, &p->sb))) {
+		p->status	= SB_ERR_READ;
+		p->error	= -ret;
+	} else {
+		p->status	= sb_check(&p->sb);
+	}
+
+	close(fd);
+}
+
+struct probe_pool {
+	struct sb_probe	*probes;
+	unsigned	nprobes;
+	unsigned	next;
+};
+
+static void *probe_worker(void *arg)
+{
+	struct probe_pool *pool = arg;
+	unsigned i;
+
+	while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->nprobes)
+		sb_probe_dev(&pool->probes[i]);
+
+	return NULL;
+}
+
+void sb_probe_all(struct sb_probe *probes, unsigned nprobes, unsigned jobs)
+{
+	struct probe_pool pool = { .probes = probes, .nprobes = nprobes };
+	unsigned i, started = 0;
+	pthread_t *threads;
+
+	/* on the heap: library callers may pass any jobs, or nprobes */
+	jobs = jobs < nprobes ? jobs : nprobes;
+	threads = jobs > 1 ? calloc(jobs - 1, sizeof(*threads)) : NULL;
+	if (!threads)
+		jobs = 1;
+
+	for (i = 1; i < jobs; i++) {
+		if (pthread_create(&threads[started], NULL,
+				   probe_worker, &pool))
+			break;
+		started++;
+	}
+
+	probe_worker(&pool);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+}
@@ -7,6 +7,10 @@
 #ifndef _BCACHE_H
 #define _BCACHE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define BITMASK(name, type, field, offset, size)		\
 static inline uint64_t name(const type *k)			\
 { return (k->field >> offset) & ~(((uint64_t) ~0) << size); }	\
@@ -40,6 +44,18 @@ static const char bcache_magic[] = {
 #define BDEV_DATA_START_DEFAULT	16	/* sectors */
 #define SB_START		(SB_SECTOR * 512)
 
+/*
+ * Backup copies of the superblock, byte for byte the primary (offset still
+ * SB_SECTOR): one at SB_BACKUP_SECTOR, which the kernel never touches on a
+ * cache (first_bucket starts at 24 sectors or later) or on a backing device
+ * whose data starts after it, and on caches one more in the last 4k of the
+ * device, past the last bucket.
+ */
+#define SB_BACKUP_SECTOR	16
+#define SB_BACKUP_SIZE		4096
+#define SB_BACKUP_END(bytes)	(((bytes) & ~(uint64_t) (SB_BACKUP_SIZE - 1)) \
+				 - SB_BACKUP_SIZE)
+
 struct cache_sb {
 	uint64_t		csum;
 	uint64_t		offset;	/* sector where this sb was written */
@@ -120,7 +136,309 @@ BITMASK(BDEV_STATE,		struct cache_sb, flags, 61, 2);
 #define BDEV_STATE_DIRTY	2U
 #define BDEV_STATE_STALE	3U
 
+/*
+ * Formatted for a zoned device, of either kind: buckets, or the data of a
+ * backing device, are laid out on zone boundaries.
+ */
+BITMASK(SB_ZONED,		struct cache_sb, flags, 60, 1);
+
+/* Backup copies were written: at SB_BACKUP_SECTOR, and the end of a cache */
+BITMASK(SB_BACKUP,		struct cache_sb, flags, 59, 1);
+
+/* Btree keys - all units are in sectors */
+
+struct bkey {
+	uint64_t	high;
+	uint64_t	low;
+	uint64_t	ptr[];
+};
+
+#define KEY_FIELD(name, field, offset, size)				\
+	BITMASK(name, struct bkey, field, offset, size)
+
+#define PTR_FIELD(name, offset, size)					\
+static inline uint64_t name(const struct bkey *k, unsigned i)		\
+{ return (k->ptr[i] >> offset) & ~(~0ULL << size); }
+
+#define KEY_SIZE_BITS		16
+#define KEY_MAX_U64S		8
+
+KEY_FIELD(KEY_PTRS,	high, 60, 3)
+KEY_FIELD(HEADER_SIZE,	high, 58, 2)
+KEY_FIELD(KEY_CSUM,	high, 56, 2)
+KEY_FIELD(KEY_PINNED,	high, 55, 1)
+KEY_FIELD(KEY_DIRTY,	high, 36, 1)
+
+KEY_FIELD(KEY_SIZE,	high, 20, KEY_SIZE_BITS)
+KEY_FIELD(KEY_INODE,	high, 0,  20)
+
+static inline uint64_t KEY_OFFSET(const struct bkey *k)
+{
+	return k->low;
+}
+
+/* Keys point at their end; this is where the extent starts */
+static inline uint64_t KEY_START(const struct bkey *k)
+{
+	return KEY_OFFSET(k) - KEY_SIZE(k);
+}
+
+#define PTR_DEV_BITS		12
+
+PTR_FIELD(PTR_DEV,	51, PTR_DEV_BITS)
+PTR_FIELD(PTR_OFFSET,	8,  43)
+PTR_FIELD(PTR_GEN,	0,  8)
+
+#define PTR_CHECK_DEV		((1 << PTR_DEV_BITS) - 1)
+
+static inline unsigned bkey_u64s(const struct bkey *k)
+{
+	return 2 + KEY_PTRS(k);
+}
+
+static inline struct bkey *bkey_next(const struct bkey *k)
+{
+	return (struct bkey *) ((uint64_t *) k + bkey_u64s(k));
+}
+
+#define BKEY_PAD		8
+
+#define BKEY_PADDED(key)						\
+	union { struct bkey key; uint64_t key ## _pad[BKEY_PAD]; }
+
+/* Journal */
+
+#define JSET_MAGIC		0x245235c1a3625032ULL
+#define JSET_VERSION		1
+#define MAX_CACHES_PER_SET	8
+
+static inline uint64_t jset_magic(const struct cache_sb *sb)
+{
+	return sb->set_magic ^ JSET_MAGIC;
+}
+
+/*
+ * A journal write: the keys inserted since the previous one, plus the
+ * current btree root and the location of everything else needed to find
+ * the btree again. Entries are block aligned within journal buckets.
+ */
+struct jset {
+	uint64_t		csum;
+	uint64_t		magic;
+	uint64_t		seq;
+	uint32_t		version;
+	uint32_t		keys;	/* u64s */
+
+	uint64_t		last_seq;	/* oldest entry still needed */
+
+	BKEY_PADDED(uuid_bucket);
+	BKEY_PADDED(btree_root);
+	uint16_t		btree_level;
+	uint16_t		pad[3];
+
+	uint64_t		prio_bucket[MAX_CACHES_PER_SET];
+
+	union {
+		struct bkey	start[0];
+		uint64_t	d[0];
+	};
+};
+
+#define set_bytes(i)		(sizeof(*(i)) + (i)->keys * sizeof(uint64_t))
+#define set_blocks(i, block_bytes)					\
+	((set_bytes(i) + (block_bytes) - 1) / (block_bytes))
+
+/* Btree nodes: a sequence of bsets, block aligned and sharing a seq */
+
+#define BSET_MAGIC		0x90135c78b99e07f5ULL
+#define BSET_VERSION		1
+
+static inline uint64_t bset_magic(const struct cache_sb *sb)
+{
+	return sb->set_magic ^ BSET_MAGIC;
+}
+
+struct bset {
+	uint64_t		csum;
+	uint64_t		magic;
+	uint64_t		seq;
+	uint32_t		version;
+	uint32_t		keys;	/* u64s */
+
+	union {
+		struct bkey	start[0];
+		uint64_t	d[0];
+	};
+};
+
+/* A node is a bucket, or a quarter of one once buckets are over 256k */
+static inline size_t btree_bytes(const struct cache_sb *sb)
+{
+	size_t bucket = sb->bucket_size * 512UL, max = 256 << 10;
+
+	return bucket <= max ? bucket : bucket / 4 > max ? bucket / 4 : max;
+}
+
+/* Bucket priorities and generations, a chain of buckets per cache */
+
+#define PSET_MAGIC		0x6750e15f87337f91ULL
+
+static inline uint64_t pset_magic(const struct cache_sb *sb)
+{
+	return sb->set_magic ^ PSET_MAGIC;
+}
+
+struct prio_set {
+	uint64_t		csum;
+	uint64_t		magic;
+	uint64_t		seq;
+	uint32_t		version;
+	uint32_t		pad;
+
+	uint64_t		next_bucket;
+
+	struct bucket_disk {
+		uint16_t	prio;
+		uint8_t		gen;
+	} __attribute((packed)) data[];
+};
+
+/* A pointer is stale once its bucket has been reused */
+static inline uint8_t gen_after(uint8_t a, uint8_t b)
+{
+	uint8_t r = a - b;
+
+	return r > 128U ? 0 : r;
+}
+
+/* The uuid bucket: an entry per backing device or flash volume, by inode */
+
+struct uuid_entry {
+	union {
+		struct {
+			uint8_t		uuid[16];
+			uint8_t		label[32];
+			uint32_t	first_reg;
+			uint32_t	last_reg;
+			uint32_t	invalidated;
+
+			uint32_t	flags;
+			/* Size of flash only volumes */
+			uint64_t	sectors;
+		};
+
+		uint8_t		pad[128];
+	};
+};
+
+BITMASK(UUID_FLASH_ONLY,	struct uuid_entry, flags, 0, 1);
+
 uint64_t crc64(const void *_data, size_t len);
+uint64_t crc64_update(uint64_t crc, const void *_data, size_t len);
+
+/* Prints inode:offset len size followed by the pointers, for debugging */
+int bkey_to_text(char *buf, size_t size, const struct bkey *k);
+
+/*
+ * Offline readers for a cache device's metadata. They follow what the
+ * kernel does at register time, and return -errno or NULL on failure.
+ */
+
+/* Next valid jset in a journal bucket read at *offset, advancing it */
+struct jset *jset_next(const struct cache_sb *sb, void *bucket,
+		       size_t *offset, bool *bad_csum);
+
+/* Calls @fn for every valid jset in the journal, bucket by bucket */
+int journal_read(int fd, const struct cache_sb *sb,
+		 void (*fn)(struct jset *, void *), void *arg);
+
+/* Fills in gens[] for every bucket from the prio_set chain at @bucket */
+int prio_read(int fd, const struct cache_sb *sb, uint64_t bucket,
+	      uint8_t *gens);
+
+uint64_t btree_csum_set(const struct bkey *k, const struct bset *i);
+
+struct btree_node {
+	unsigned		nr_bsets;
+	unsigned		written;	/* blocks */
+	struct bset		**bsets;	/* grown as needed; free() it */
+	unsigned		size;
+};
+
+/* Finds and checks the bsets of a node read into @data, from key @k */
+int btree_node_check(const struct cache_sb *sb, const struct bkey *k,
+		     void *data, struct btree_node *b, const char **err);
+
+/*
+ * Calls @fn for what's left of every key once newer bsets are applied: for
+ * leaf nodes the parts of each extent no newer extent overwrote, for
+ * interior nodes every pointer no newer key at the same position replaced.
+ * Keys with no pointers only cover older keys. Returns 0 or -ENOMEM.
+ */
+typedef void (*live_key_fn)(const struct bkey *k, uint64_t start,
+			    uint64_t end, void *arg);
+
+int btree_node_for_each_live(const struct btree_node *b, unsigned level,
+			     live_key_fn fn, void *arg);
+
+/* Pointer @i of @k is to this cache, and its bucket hasn't been reused */
+bool ptr_live(const struct cache_sb *sb, const uint8_t *gens,
+	      const struct bkey *k, unsigned i);
+
+/*
+ * Walks the btree from @root in key order, calling @fn for the live parts of
+ * every leaf key; subtrees behind stale pointers are skipped. Stops at the
+ * first bad node, with -EBADMSG and @err set.
+ */
+int btree_walk(int fd, const struct cache_sb *sb, const uint8_t *gens,
+	       const struct bkey *root, unsigned level,
+	       live_key_fn fn, void *arg, const char **err);
+
+/*
+ * Superblocks. sb_read() and sb_write() do one page aligned 4k I/O, so they
+ * work on O_DIRECT fds too; @offset is in bytes, 0 meaning the primary at
+ * SB_START. sb_write() writes @sb as is: sb_set_csum() it first.
+ */
+enum sb_status {
+	SB_OK,
+	SB_ERR_OPEN,
+	SB_ERR_READ,
+	SB_BAD_MAGIC,
+	SB_BAD_OFFSET,
+	SB_BAD_CSUM,
+};
+
+const char *sb_status_str(enum sb_status status);
+
+int sb_read(int fd, uint64_t offset, struct cache_sb *sb);
+int sb_write(int fd, uint64_t offset, const struct cache_sb *sb);
+
+/* Magic, then the sector it says it was written at, then the csum */
+enum sb_status sb_check(const struct cache_sb *sb);
+void sb_set_csum(struct cache_sb *sb);
+
+/* Sectors; version 1 backing devices don't record it */
+uint64_t sb_data_offset(const struct cache_sb *sb);
+
+const char *bdev_cache_mode_name(uint64_t mode);
+const char *bdev_state_name(uint64_t state);
+const char *cache_replacement_name(uint64_t policy);
+
+/*
+ * Reads the superblock at @offset of each device, on up to @jobs threads
+ * with O_DIRECT, so checking many devices costs roughly one device latency
+ * per thread and leaves the page cache alone.
+ */
+struct sb_probe {
+	const char	*dev;
+	uint64_t	offset;
+	enum sb_status	status;
+	int		error;		/* errno, if SB_ERR_OPEN or _READ */
+	struct cache_sb	sb;
+};
+
+void sb_probe_dev(struct sb_probe *p);
+void sb_probe_all(struct sb_probe *probes, unsigned nprobes, unsigned jobs);
 
 #define node(i, j)		((void *) ((i)->d + (j)))
 #define end(i)			node(i, (i)->keys)
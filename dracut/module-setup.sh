@@ -29,6 +29,13 @@ installkernel() {
 }
 
 install() {
-    inst_multiple ${udevdir}/probe-bcache ${udevdir}/bcache-register
+    # bcache-udev is probe-bcache and bcache-register linked statically
+    if [[ -x ${udevdir}/bcache-udev ]]; then
+        inst_simple ${udevdir}/bcache-udev
+        ln_r ${udevdir}/bcache-udev ${udevdir}/probe-bcache
+        ln_r ${udevdir}/bcache-udev ${udevdir}/bcache-register
+    else
+        inst_multiple ${udevdir}/probe-bcache ${udevdir}/bcache-register
+    fi
     inst_rules 69-bcache.rules
 }
@@ -7,14 +7,18 @@
 #define _FILE_OFFSET_BITS	64
 #define __USE_FILE_OFFSET64
 #define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 
 #include <blkid.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <linux/blkzoned.h>
 #include <linux/fs.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -23,6 +27,8 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
@@ -156,12 +162,20 @@ void usage()
 	       "	-B, --bdev		Format a backing device\n"
 	       "	-b, --bucket		bucket size\n"
 	       "	-w, --block		block size (hard sector size of SSD, often 2k)\n"
-	       "	-o, --data-offset	data offset in sectors\n"
+	       "	-o, --data-offset	data offset in sectors (default: stripe aligned)\n"
 	       "	    --cset-uuid		UUID for the cache set\n"
 //	       "	-U			UUID\n"
 	       "	    --writeback		enable writeback\n"
 	       "	    --discard		enable discards\n"
 	       "	    --cache_replacement_policy=(lru|fifo)\n"
+	       "	-j, --jobs		format up to this many devices in parallel\n"
+	       "	    --trim-device	discard the whole cache device before formatting\n"
+	       "	    --trim-chunk	bytes to discard per request (default 1G)\n"
+	       "	    --auto-geometry	pick bucket and block size from device I/O limits\n"
+	       "	    --journal-size	journal buckets, or bytes with a unit (default: as the kernel)\n"
+	       "	    --no-backup-sb	don't write backup copies of the superblock\n"
+	       "	    --convert		make a backing device of a filesystem, in place\n"
+	       "	    --fs-size		size of the filesystem to convert, if blkid can't tell\n"
 	       "	-h, --help		display this help and exit\n");
 	exit(EXIT_FAILURE);
 }
@@ -173,31 +187,524 @@ const char * const cache_replacement_policies[] = {
 	NULL
 };
 
-static void write_sb(char *dev, unsigned block_size, unsigned bucket_size,
-		     bool writeback, bool discard, bool wipe_bcache,
-		     unsigned cache_replacement_policy,
-		     uint64_t data_offset,
-		     uuid_t set_uuid, bool bdev)
+/*
+ * Read a numeric attribute from the block device's sysfs directory, e.g.
+ * "queue/discard_granularity" or "md/chunk_size"; partitions don't have
+ * those directories of their own, so fall back to the parent's.
+ */
+static int sysfs_dev_read(int fd, const char *attr, uint64_t *v)
 {
+	struct stat statbuf;
+	char path[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	if (fstat(fd, &statbuf) || !S_ISBLK(statbuf.st_mode))
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s",
+		 major(statbuf.st_rdev), minor(statbuf.st_rdev), attr);
+	if (!(f = fopen(path, "r"))) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../%s",
+			 major(statbuf.st_rdev), minor(statbuf.st_rdev), attr);
+		if (!(f = fopen(path, "r")))
+			return -1;
+	}
+
+	ret = fscanf(f, "%" SCNu64, v) == 1 ? 0 : -1;
+	fclose(f);
+
+	return ret;
+}
+
+struct dev_geometry {
+	unsigned	logical_block_size;
+	unsigned	physical_block_size;
+	unsigned	minimum_io_size;
+	unsigned	optimal_io_size;
+	int		alignment_offset;
+	uint64_t	discard_granularity;
+	uint64_t	chunk_size;		/* bytes; zone size if zoned */
+	uint64_t	md_chunk_size;
+};
+
+static void get_geometry(const char *path, struct dev_geometry *g)
+{
+	struct stat statbuf;
+	uint64_t chunk_sectors = 0;
 	int fd;
-	char uuid_str[40], set_uuid_str[40], zeroes[SB_START] = {0};
-	struct cache_sb sb;
+
+	memset(g, 0, sizeof(*g));
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "open(%s) failed: %m\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fstat(fd, &statbuf)) {
+		fprintf(stderr, "Error statting %s: %s\n",
+			path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (!S_ISBLK(statbuf.st_mode)) {
+		g->logical_block_size	= statbuf.st_blksize;
+		g->physical_block_size	= statbuf.st_blksize;
+		close(fd);
+		return;
+	}
+
+	if (ioctl(fd, BLKSSZGET, &g->logical_block_size) ||
+	    ioctl(fd, BLKPBSZGET, &g->physical_block_size) ||
+	    ioctl(fd, BLKIOMIN, &g->minimum_io_size) ||
+	    ioctl(fd, BLKIOOPT, &g->optimal_io_size) ||
+	    ioctl(fd, BLKALIGNOFF, &g->alignment_offset)) {
+		fprintf(stderr, "Error reading I/O limits of %s: %m\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* not every kernel has these */
+	sysfs_dev_read(fd, "queue/discard_granularity", &g->discard_granularity);
+	sysfs_dev_read(fd, "queue/chunk_sectors", &chunk_sectors);
+	g->chunk_size = chunk_sectors << 9;
+	sysfs_dev_read(fd, "md/chunk_size", &g->md_chunk_size);
+
+	close(fd);
+}
+
+#define ZERO_BUF_SIZE		(4U << 20)
+
+/*
+ * Zero [start, end) of a device: one BLKDISCARD if discards are enabled and
+ * the device says discarded blocks read back as zeroes, else one BLKZEROOUT;
+ * if the device can't do either (or it's a regular file), fall back to large
+ * O_DIRECT writes.
+ */
+static int zero_range(const char *dev, int fd, uint64_t start, uint64_t end,
+		      bool discard)
+{
+	uint64_t range[2] = { start, end - start };
+	struct stat statbuf;
+	void *buf;
+	int wfd;
+
+	if (start >= end)
+		return 0;
+
+	if (fstat(fd, &statbuf))
+		return -1;
+
+	if (S_ISBLK(statbuf.st_mode)) {
+		unsigned int discard_zeroes = 0;
+
+		if (discard &&
+		    !ioctl(fd, BLKDISCARDZEROES, &discard_zeroes) &&
+		    discard_zeroes &&
+		    !ioctl(fd, BLKDISCARD, range))
+			return 0;
+
+		if (!ioctl(fd, BLKZEROOUT, range))
+			return 0;
+	}
+
+	if (posix_memalign(&buf, ZERO_BUF_SIZE, ZERO_BUF_SIZE)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(buf, 0, ZERO_BUF_SIZE);
+
+	/* O_DIRECT needs sector aligned I/O; ranges are bucket aligned */
+	wfd = -1;
+	if (!(start & 4095) && !(end & 4095))
+		wfd = open(dev, O_WRONLY|O_DIRECT);
+
+	while (start < end) {
+		size_t len = min(end - start, (uint64_t) ZERO_BUF_SIZE);
+		ssize_t ret = pwrite(wfd >= 0 ? wfd : fd, buf, len, start);
+
+		if (ret < 0 && wfd >= 0 && errno == EINVAL) {
+			/* filesystem doesn't do O_DIRECT after all */
+			close(wfd);
+			wfd = -1;
+			continue;
+		}
+
+		if (ret <= 0) {
+			if (!ret)
+				errno = EIO;
+			break;
+		}
+
+		start += ret;
+	}
+
+	if (wfd >= 0)
+		close(wfd);
+	free(buf);
+
+	return start < end ? -1 : 0;
+}
+
+struct format_dev {
+	char			*dev;
+	bool			bdev;
+	int			fd;
+	struct cache_sb		sb;
+
+	/* cache devices: members of one set, in the order given */
+	unsigned		nr_in_set;
+	unsigned		nr_this_dev;
+
+	/* zoned devices; zone_sectors is 0 if not */
+	uint64_t		zone_sectors;
+	unsigned		nr_zones;
+	unsigned		conv_zones;
+	bool			host_managed;
+	bool			sb_zone_conventional;
+
+	/*
+	 * --convert: the filesystem stays where it is, and the superblock goes
+	 * in the last data_offset sectors, from convert_base (bytes) on.
+	 */
+	bool			convert;
+	uint64_t		fs_size;
+	char			*fs_type, *fs_uuid;
+	uint64_t		convert_base;
+
+	/* backup superblocks; backup_end is 0 if there's none at the end */
+	bool			backup_sb;
+	uint64_t		backup_end;
+
+	/* --journal-size, in buckets or bytes; neither means the default */
+	unsigned		journal_buckets;
+	uint64_t		journal_bytes;
+
+	/* data_offset wasn't given, align it to the device's stripes */
+	bool			auto_data_offset;
+	uint64_t		data_align;
+	const char		*data_align_reason;
+
+	/* --trim-device */
+	bool			trim;
+	bool			progress;
+	uint64_t		trim_chunk;
+	uint64_t		discard_granularity;
+	uint64_t		discard_max_bytes;
+
+	/* Filled in by write_sb() */
+	const char		*failed_op;
+	int			error;
+	double			elapsed;
+	uint64_t		trimmed;
+};
+
+/*
+ * Zoned devices. Calls @fn for every zone overlapping [start, end), in
+ * sectors, BLKREPORTZONE'ing a batch of them at a time.
+ */
+#define ZONE_BATCH		256
+
+static int for_each_zone(int fd, uint64_t start, uint64_t end,
+			 int (*fn)(int, struct blk_zone *, void *), void *arg)
+{
+	struct blk_zone_report *r;
+	unsigned i;
+	int ret = 0;
+
+	r = malloc(sizeof(*r) + ZONE_BATCH * sizeof(struct blk_zone));
+	if (!r) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	while (start < end && !ret) {
+		memset(r, 0, sizeof(*r));
+		r->sector	= start;
+		r->nr_zones	= ZONE_BATCH;
+
+		if (ioctl(fd, BLKREPORTZONE, r)) {
+			ret = -1;
+			break;
+		}
+
+		if (!r->nr_zones)
+			break;
+
+		for (i = 0; i < r->nr_zones && !ret; i++) {
+			struct blk_zone *z = &r->zones[i];
+
+			if (z->start >= end)
+				break;
+
+			ret = fn(fd, z, arg);
+			start = z->start + z->len;
+		}
+	}
+
+	free(r);
+	return ret;
+}
+
+static int count_zone(int fd, struct blk_zone *z, void *arg)
+{
+	struct format_dev *d = arg;
+
+	if (z->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+		d->conv_zones++;
+		if (!z->start)
+			d->sb_zone_conventional = true;
+	} else if (z->type == BLK_ZONE_TYPE_SEQWRITE_REQ)
+		d->host_managed = true;
+
+	return 0;
+}
+
+static void get_zones(struct format_dev *d, int fd)
+{
+	uint32_t zone_sectors = 0, nr_zones = 0;
+
+	/* not zoned, or a kernel too old to know about zones */
+	if (ioctl(fd, BLKGETZONESZ, &zone_sectors) || !zone_sectors)
+		return;
+
+	if (ioctl(fd, BLKGETNRZONES, &nr_zones) ||
+	    for_each_zone(fd, 0, UINT64_MAX, count_zone, d)) {
+		fprintf(stderr, "Error reporting zones of %s: %m\n", d->dev);
+		exit(EXIT_FAILURE);
+	}
+
+	d->zone_sectors = zone_sectors;
+	d->nr_zones	= nr_zones;
+}
+
+struct zone_reset {
+	const char	*dev;
+	uint64_t	start, end;	/* sectors */
+};
+
+/*
+ * Sequential zones read back as zeroes once reset, and can't be written
+ * anywhere but at the write pointer: reset every one the range touches
+ * whole, the rest of it is free space anyway. Only a zone that also holds
+ * the superblock is zeroed instead, as are conventional zones.
+ */
+static int reset_zone(int fd, struct blk_zone *z, void *arg)
+{
+	struct zone_reset *r = arg;
+	uint64_t start = max(r->start, (uint64_t) z->start);
+	uint64_t end = min(r->end, (uint64_t) (z->start + z->len));
+
+	if (z->type != BLK_ZONE_TYPE_CONVENTIONAL &&
+	    z->start >= SB_SECTOR + SB_START / 512) {
+		struct blk_zone_range range = { z->start, z->len };
+
+		return ioctl(fd, BLKRESETZONE, &range);
+	}
+
+	return zero_range(r->dev, fd, start << 9, end << 9, false);
+}
+
+static int reset_zones(struct format_dev *d, uint64_t start, uint64_t end)
+{
+	struct zone_reset r = { d->dev, start >> 9, end >> 9 };
+
+	return for_each_zone(d->fd, r.start, r.end, reset_zone, &r);
+}
+
+/*
+ * What the kernel gives a new cache set if the superblock doesn't say: a
+ * bucket of journal per 128 buckets of cache.
+ */
+static unsigned default_journal_buckets(uint64_t nbuckets)
+{
+	return max(2U, (unsigned) min(nbuckets >> 7,
+				      (uint64_t) SB_JOURNAL_BUCKETS));
+}
+
+/*
+ * The journal is the buckets following first_bucket, in order; the kernel
+ * refuses anything else. Rounded up to whole buckets, capped at
+ * SB_JOURNAL_BUCKETS, and leaving the cache most of the device.
+ */
+static void set_journal(struct format_dev *d)
+{
+	struct cache_sb *sb = &d->sb;
+	uint64_t bucket_bytes = (uint64_t) sb->bucket_size << 9;
+	uint64_t n = d->journal_buckets;
+	unsigned i;
+
+	if (d->journal_bytes)
+		n = (d->journal_bytes + bucket_bytes - 1) / bucket_bytes;
+	if (!n)
+		n = default_journal_buckets(sb->nbuckets);
+
+	if (n > SB_JOURNAL_BUCKETS) {
+		fprintf(stderr, "%s: journal of %ju buckets capped at %u\n",
+			d->dev, n, SB_JOURNAL_BUCKETS);
+		n = SB_JOURNAL_BUCKETS;
+	}
+
+	n = max(n, (uint64_t) 2);
+
+	if (sb->first_bucket + n > sb->nbuckets / 2) {
+		fprintf(stderr, "Journal of %ju buckets is too big for %s, "
+			"with %ju buckets\n", n, d->dev, sb->nbuckets);
+		exit(EXIT_FAILURE);
+	}
+
+	sb->njournal_buckets = n;
+	for (i = 0; i < n; i++)
+		sb->d[i] = sb->first_bucket + i;
+}
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Pick a data offset for a backing device so that full stripe writes from
+ * the cache land on stripe boundaries: md and dm-stripe both export their
+ * stripe width as optimal_io_size and their chunk as minimum_io_size.
+ */
+static uint64_t aligned_data_offset(struct format_dev *d, unsigned block_size)
+{
+	uint64_t align, offset, start = BDEV_DATA_START_DEFAULT << 9;
+	struct dev_geometry g;
+
+	get_geometry(d->dev, &g);
+
+	if (g.optimal_io_size) {
+		align			= g.optimal_io_size;
+		d->data_align_reason	= "optimal_io_size";
+	} else if (g.md_chunk_size) {
+		align			= g.md_chunk_size;
+		d->data_align_reason	= "md chunk_size";
+	} else if (g.minimum_io_size) {
+		align			= g.minimum_io_size;
+		d->data_align_reason	= "minimum_io_size";
+	} else {
+		return BDEV_DATA_START_DEFAULT;
+	}
+
+	/* BLKALIGNOFF says -1 when the device's start isn't aligned at all */
+	if (g.alignment_offset < 0) {
+		fprintf(stderr, "%s is misaligned with its underlying device, "
+			"not aligning data offset\n", d->dev);
+		d->data_align_reason = NULL;
+		return BDEV_DATA_START_DEFAULT;
+	}
+
+	if ((uint64_t) g.alignment_offset >= start)
+		offset = g.alignment_offset;
+	else
+		offset = g.alignment_offset +
+			(start - g.alignment_offset + align - 1) / align * align;
+
+	if (offset % ((uint64_t) block_size << 9)) {
+		fprintf(stderr, "%s: %s %ju isn't a multiple of the block size, "
+			"not aligning data offset\n",
+			d->dev, d->data_align_reason, align);
+		d->data_align_reason = NULL;
+		return BDEV_DATA_START_DEFAULT;
+	}
+
+	d->data_align = align;
+	return offset >> 9;
+}
+
+/*
+ * Finds the filesystem --convert is to keep, and how big it is: libblkid
+ * knows that for most filesystems if it's recent enough, else --fs-size
+ * has to say.
+ */
+static void probe_convert(struct format_dev *d, int fd)
+{
+	const char *v;
 	blkid_probe pr;
 
+	if (!(pr = blkid_new_probe()))
+		exit(EXIT_FAILURE);
+	if (blkid_probe_set_device(pr, fd, 0, 0))
+		exit(EXIT_FAILURE);
+	if (blkid_probe_enable_partitions(pr, true))
+		exit(EXIT_FAILURE);
+#ifdef BLKID_SUBLKS_FSINFO
+	blkid_probe_set_superblocks_flags(pr, BLKID_SUBLKS_TYPE|
+					  BLKID_SUBLKS_UUID|BLKID_SUBLKS_FSINFO);
+#endif
+
+	if (blkid_do_safeprobe(pr)) {
+		fprintf(stderr, "No filesystem to convert on %s, or more than "
+			"one signature\n", d->dev);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!blkid_probe_lookup_value(pr, "PTTYPE", &v, NULL)) {
+		fprintf(stderr, "%s has a %s partition table; convert a "
+			"partition, not the disk\n", d->dev, v);
+		exit(EXIT_FAILURE);
+	}
+
+	if (blkid_probe_lookup_value(pr, "TYPE", &v, NULL)) {
+		fprintf(stderr, "No filesystem to convert on %s\n", d->dev);
+		exit(EXIT_FAILURE);
+	}
+	d->fs_type = strdup(v);
+
+	if (!blkid_probe_lookup_value(pr, "UUID", &v, NULL))
+		d->fs_uuid = strdup(v);
+
+	if (!blkid_probe_lookup_value(pr, "FSSIZE", &v, NULL))
+		d->fs_size = strtoull(v, NULL, 10);
+
+	blkid_free_probe(pr);
+
+	if (!d->fs_type || !d->fs_size) {
+		fprintf(stderr, "Can't tell how big the %s filesystem on %s "
+			"is, give it with --fs-size\n",
+			d->fs_type ?: "", d->dev);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Everything that can refuse to format a device happens here, for every
+ * device, before anything is written. The device is left open (O_EXCL) for
+ * write_sb().
+ */
+static void prepare_sb(struct format_dev *d, unsigned block_size,
+		       unsigned bucket_size, bool writeback, bool discard,
+		       bool wipe_bcache, unsigned cache_replacement_policy,
+		       uint64_t data_offset, uuid_t set_uuid)
+{
+	char *dev = d->dev;
+	struct cache_sb *sb = &d->sb;
+	blkid_probe pr;
+	int fd;
+
 	if ((fd = open(dev, O_RDWR|O_EXCL)) == -1) {
 		fprintf(stderr, "Can't open dev %s: %s\n", dev, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	if (pread(fd, &sb, sizeof(sb), SB_START) != sizeof(sb))
+	if (sb_read(fd, 0, sb))
 		exit(EXIT_FAILURE);
 
-	if (!memcmp(sb.magic, bcache_magic, 16) && !wipe_bcache) {
+	if (sb_check(sb) != SB_BAD_MAGIC && !wipe_bcache) {
 		fprintf(stderr, "Already a bcache device on %s, "
 			"overwrite with --wipe-bcache\n", dev);
 		exit(EXIT_FAILURE);
 	}
 
+	if (d->convert) {
+		probe_convert(d, fd);
+		goto probed;
+	}
+
 	if (!(pr = blkid_new_probe()))
 		exit(EXIT_FAILURE);
 	if (blkid_probe_set_device(pr, fd, 0, 0))
@@ -211,56 +718,238 @@ static void write_sb(char *dev, unsigned block_size, unsigned bucket_size,
 				"remove it using wipefs and wipefs -a\n", dev);
 		exit(EXIT_FAILURE);
 	}
+	blkid_free_probe(pr);
+probed:
 
-	memset(&sb, 0, sizeof(struct cache_sb));
+	memset(sb, 0, sizeof(struct cache_sb));
 
-	sb.offset	= SB_SECTOR;
-	sb.version	= bdev
-		? BCACHE_SB_VERSION_BDEV
-		: BCACHE_SB_VERSION_CDEV;
+	get_zones(d, fd);
 
-	memcpy(sb.magic, bcache_magic, 16);
-	uuid_generate(sb.uuid);
-	memcpy(sb.set_uuid, set_uuid, sizeof(sb.set_uuid));
+	/* the superblock is rewritten in place, a sequential zone can't be */
+	if (d->host_managed && !d->sb_zone_conventional) {
+		fprintf(stderr, "%s is host managed, and its first zone isn't "
+			"conventional; there's nowhere for the superblock\n", dev);
+		exit(EXIT_FAILURE);
+	}
 
-	sb.bucket_size	= bucket_size;
-	sb.block_size	= block_size;
+	sb->offset	= SB_SECTOR;
+	sb->version	= d->bdev
+		? BCACHE_SB_VERSION_BDEV
+		: BCACHE_SB_VERSION_CDEV_WITH_UUID;
 
-	uuid_unparse(sb.uuid, uuid_str);
-	uuid_unparse(sb.set_uuid, set_uuid_str);
+	memcpy(sb->magic, bcache_magic, 16);
+	uuid_generate(sb->uuid);
+	memcpy(sb->set_uuid, set_uuid, sizeof(sb->set_uuid));
 
-	if (SB_IS_BDEV(&sb)) {
+	sb->bucket_size	= bucket_size;
+	sb->block_size	= block_size;
+
+	if (SB_IS_BDEV(sb)) {
 		SET_BDEV_CACHE_MODE(
-			&sb, writeback ? CACHE_MODE_WRITEBACK : CACHE_MODE_WRITETHROUGH);
+			sb, writeback ? CACHE_MODE_WRITEBACK : CACHE_MODE_WRITETHROUGH);
+
+		if (d->zone_sectors && d->auto_data_offset) {
+			/* the data starts with the zone after the superblock's */
+			data_offset		= d->zone_sectors;
+			d->data_align		= d->zone_sectors << 9;
+			d->data_align_reason	= "zone size";
+		} else if (d->auto_data_offset) {
+			data_offset = aligned_data_offset(d, block_size);
+		}
+
+		if (d->zone_sectors && data_offset % d->zone_sectors) {
+			fprintf(stderr, "%s is zoned, data offset must be a "
+				"multiple of the zone size, %ju sectors\n",
+				dev, d->zone_sectors);
+			exit(EXIT_FAILURE);
+		}
 
 		if (data_offset != BDEV_DATA_START_DEFAULT) {
-			sb.version = BCACHE_SB_VERSION_BDEV_WITH_OFFSET;
-			sb.data_offset = data_offset;
+			sb->version = BCACHE_SB_VERSION_BDEV_WITH_OFFSET;
+			sb->data_offset = data_offset;
+		}
+
+		if (d->convert) {
+			uint64_t sectors = getblocks(fd);
+
+			if (d->zone_sectors) {
+				fprintf(stderr, "Can't convert %s: it's zoned, "
+					"its last zone can't be rewritten\n",
+					dev);
+				exit(EXIT_FAILURE);
+			}
+
+			if (sectors < 2 * data_offset) {
+				fprintf(stderr, "%s is too small to convert\n",
+					dev);
+				exit(EXIT_FAILURE);
+			}
+
+			d->convert_base = (sectors - data_offset) << 9;
+			if (d->fs_size > d->convert_base) {
+				fprintf(stderr, "The %s filesystem on %s is %ju "
+					"bytes, shrink it to %ju or less, to "
+					"make room for the superblock\n",
+					d->fs_type, dev, d->fs_size,
+					d->convert_base);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		/* the rest of the device is data */
+		if (data_offset < SB_BACKUP_SECTOR + SB_BACKUP_SIZE / 512)
+			d->backup_sb = false;
+	} else {
+		sb->nbuckets		= getblocks(fd) / sb->bucket_size;
+
+		/*
+		 * A zone can't be rewritten in place, and the last one of a
+		 * host managed device is sequential.
+		 */
+		if (d->backup_sb && !d->zone_sectors) {
+			d->backup_end = SB_BACKUP_END(getblocks(fd) << 9);
+
+			/* give up the last bucket if it runs into the copy */
+			if (bucket_to_offset(sb, sb->nbuckets) > d->backup_end)
+				sb->nbuckets--;
+		}
+		sb->nr_in_set		= d->nr_in_set;
+		sb->nr_this_dev		= d->nr_this_dev;
+		sb->first_bucket	= (23 / sb->bucket_size) + 1;
+
+		if (sb->nbuckets < 1 << 7) {
+			fprintf(stderr, "Not enough buckets on %s: %ju, need %u\n",
+			       dev, sb->nbuckets, 1 << 7);
+			exit(EXIT_FAILURE);
+		}
+
+		/* a bucket is written sequentially, and reset as a whole */
+		if (d->zone_sectors && d->zone_sectors % sb->bucket_size) {
+			fprintf(stderr, "%s is zoned, bucket size must be the "
+				"zone size, %ju sectors, or divide it\n",
+				dev, d->zone_sectors);
+			exit(EXIT_FAILURE);
+		}
+
+		set_journal(d);
+
+		SET_CACHE_DISCARD(sb, discard);
+		SET_CACHE_REPLACEMENT(sb, cache_replacement_policy);
+
+		/* resetting a zone stands in for discarding it */
+		if (d->trim && !d->zone_sectors) {
+			if (sysfs_dev_read(fd, "queue/discard_granularity",
+					     &d->discard_granularity) ||
+			    sysfs_dev_read(fd, "queue/discard_max_bytes",
+					     &d->discard_max_bytes) ||
+			    !d->discard_max_bytes) {
+				fprintf(stderr, "%s doesn't support discard, "
+					"can't --trim-device\n", dev);
+				exit(EXIT_FAILURE);
+			}
+
+			/* chunks must stay aligned to the discard granularity */
+			if (d->discard_granularity)
+				d->trim_chunk -= d->trim_chunk %
+					d->discard_granularity;
+			if (!d->trim_chunk)
+				d->trim_chunk = max(d->discard_granularity,
+						    (uint64_t) 512);
 		}
+	}
+
+	SET_SB_ZONED(sb, d->zone_sectors != 0);
+	SET_SB_BACKUP(sb, d->backup_sb);
+
+	sb_set_csum(sb);
+	d->fd = fd;
+}
+
+/*
+ * The journal has to hold every btree update between btree node writes; a
+ * busy cache with a small one stalls writes waiting for journal space.
+ */
+static void print_journal_advice(const struct cache_sb *sb)
+{
+	unsigned def = default_journal_buckets(sb->nbuckets);
+	unsigned n = sb->njournal_buckets;
+
+	if (n < def)
+		printf("  journal is smaller than the default of %u buckets "
+		       "for %ju buckets; expect journal stalls under heavy "
+		       "writes\n", def, sb->nbuckets);
+	else if (n > def)
+		printf("  journal is %.1f%% of the cache, against the default "
+		       "of %u buckets; it absorbs more writes between btree "
+		       "flushes\n", n * 100.0 / (sb->nbuckets - sb->first_bucket),
+		       def);
+}
+
+static void print_zones(const struct format_dev *d)
+{
+	if (d->zone_sectors)
+		printf("zoned:			%s, %u zones of %ju MiB, "
+		       "%u conventional\n",
+		       d->host_managed ? "host managed" : "host aware",
+		       d->nr_zones, d->zone_sectors >> 11, d->conv_zones);
+}
 
+static void print_backups(const struct format_dev *d)
+{
+	if (!d->backup_sb)
+		printf("backup_sb:		none\n");
+	else if (d->backup_end)
+		printf("backup_sb:		sector %u, byte %ju\n",
+		       SB_BACKUP_SECTOR, d->backup_end);
+	else
+		printf("backup_sb:		sector %u\n", SB_BACKUP_SECTOR);
+}
+
+/*
+ * The device the kernel is to register: the superblock's sectors first,
+ * then the filesystem, from the start of the device.
+ */
+static void print_convert(const struct format_dev *d)
+{
+	uint64_t offset = sb_data_offset(&d->sb);
+	uint64_t fs_sectors = d->convert_base >> 9;
+
+	printf("converted:		%s filesystem in place, superblock in "
+	       "the last %ju sectors\n"
+	       "dm_table:		0 %ju linear %s %ju\n"
+	       "			%ju %ju linear %s 0\n",
+	       d->fs_type, offset,
+	       offset, d->dev, fs_sectors,
+	       offset, fs_sectors, d->dev);
+}
+
+static void print_sb(const struct format_dev *d)
+{
+	const struct cache_sb *sb = &d->sb;
+	char uuid_str[40], set_uuid_str[40];
+
+	uuid_unparse(sb->uuid, uuid_str);
+	uuid_unparse(sb->set_uuid, set_uuid_str);
+
+	if (SB_IS_BDEV(sb)) {
 		printf("UUID:			%s\n"
 		       "Set UUID:		%s\n"
 		       "version:		%u\n"
 		       "block_size:		%u\n"
 		       "data_offset:		%ju\n",
 		       uuid_str, set_uuid_str,
-		       (unsigned) sb.version,
-		       sb.block_size,
-		       data_offset);
+		       (unsigned) sb->version,
+		       sb->block_size,
+		       sb_data_offset(sb));
+
+		if (d->data_align_reason)
+			printf("data_alignment:		%ju (%s)\n",
+			       d->data_align, d->data_align_reason);
+		print_zones(d);
+		print_backups(d);
+		if (d->convert)
+			print_convert(d);
 	} else {
-		sb.nbuckets		= getblocks(fd) / sb.bucket_size;
-		sb.nr_in_set		= 1;
-		sb.first_bucket		= (23 / sb.bucket_size) + 1;
-
-		if (sb.nbuckets < 1 << 7) {
-			fprintf(stderr, "Not enough buckets: %ju, need %u\n",
-			       sb.nbuckets, 1 << 7);
-			exit(EXIT_FAILURE);
-		}
-
-		SET_CACHE_DISCARD(&sb, discard);
-		SET_CACHE_REPLACEMENT(&sb, cache_replacement_policy);
-
 		printf("UUID:			%s\n"
 		       "Set UUID:		%s\n"
 		       "version:		%u\n"
@@ -269,51 +958,343 @@ static void write_sb(char *dev, unsigned block_size, unsigned bucket_size,
 		       "bucket_size:		%u\n"
 		       "nr_in_set:		%u\n"
 		       "nr_this_dev:		%u\n"
-		       "first_bucket:		%u\n",
+		       "first_bucket:		%u\n"
+		       "journal_buckets:	%u (%ju KiB)\n",
 		       uuid_str, set_uuid_str,
-		       (unsigned) sb.version,
-		       sb.nbuckets,
-		       sb.block_size,
-		       sb.bucket_size,
-		       sb.nr_in_set,
-		       sb.nr_this_dev,
-		       sb.first_bucket);
+		       (unsigned) sb->version,
+		       sb->nbuckets,
+		       sb->block_size,
+		       sb->bucket_size,
+		       sb->nr_in_set,
+		       sb->nr_this_dev,
+		       sb->first_bucket,
+		       sb->njournal_buckets,
+		       (uint64_t) sb->njournal_buckets * sb->bucket_size / 2);
+
+		print_journal_advice(sb);
+		print_zones(d);
+		print_backups(d);
+
+		if (d->trim && !d->zone_sectors)
+			printf("discard_granularity:	%ju\n"
+			       "discard_max_bytes:	%ju\n"
+			       "trimmed:		%ju\n",
+			       d->discard_granularity,
+			       d->discard_max_bytes,
+			       d->trimmed);
 	}
+}
+
+/*
+ * Discard every bucket of a cache device, @chunk bytes per BLKDISCARD so
+ * that we never hand the block layer one enormous request.
+ */
+static int trim_device(struct format_dev *d)
+{
+	struct cache_sb *sb = &d->sb;
+	uint64_t start = bucket_to_offset(sb, sb->first_bucket);
+	uint64_t end = bucket_to_offset(sb, sb->nbuckets);
+	uint64_t total = end - start;
+	unsigned last_pct = ~0U;
 
-	sb.csum = csum_set(&sb);
+	d->trimmed = 0;
 
-	/* Zero start of disk */
-	if (pwrite(fd, zeroes, SB_START, 0) != SB_START) {
-		perror("write error\n");
-		exit(EXIT_FAILURE);
+	while (start < end) {
+		uint64_t range[2] = { start, min(end - start, d->trim_chunk) };
+
+		if (ioctl(d->fd, BLKDISCARD, range))
+			return -1;
+
+		start		+= range[1];
+		d->trimmed	+= range[1];
+
+		if (d->progress) {
+			unsigned pct = d->trimmed * 100 / total;
+
+			if (pct != last_pct)
+				fprintf(stderr, "\rTrimming %s: %3u%%",
+					d->dev, pct);
+			last_pct = pct;
+		}
 	}
+
+	if (d->progress)
+		fputc('\n', stderr);
+
+	return 0;
+}
+
+/*
+ * A conversion only ever wrote past the end of the filesystem: check that
+ * the superblock reads back from the device, not the page cache, and that
+ * the filesystem is still there, as it was.
+ */
+static int verify_convert(struct format_dev *d)
+{
+	struct cache_sb sb;
+	const char *v;
+	blkid_probe pr;
+	bool same;
+
+	posix_fadvise(d->fd, d->convert_base, SB_START * 2, POSIX_FADV_DONTNEED);
+
+	if (sb_read(d->fd, d->convert_base + SB_START, &sb))
+		return -1;
+
+	errno = EIO;
+	if (sb_check(&sb) != SB_OK || memcmp(&sb, &d->sb, sizeof(sb)))
+		return -1;
+
+	if (!(pr = blkid_new_probe()) ||
+	    blkid_probe_set_device(pr, d->fd, 0, 0))
+		return -1;
+
+	same = !blkid_do_safeprobe(pr) &&
+		!blkid_probe_lookup_value(pr, "TYPE", &v, NULL) &&
+		!strcmp(v, d->fs_type) &&
+		(!d->fs_uuid ||
+		 (!blkid_probe_lookup_value(pr, "UUID", &v, NULL) &&
+		  !strcmp(v, d->fs_uuid)));
+
+	blkid_free_probe(pr);
+	errno = EIO;
+	return same ? 0 : -1;
+}
+
+#define write_fail(d, op)						\
+do {									\
+	(d)->failed_op	= (op);						\
+	(d)->error	= errno ?: EIO;					\
+	goto out;							\
+} while (0)
+
+/*
+ * Does the actual writes for a device set up by prepare_sb(); may run on a
+ * worker thread, so failures are recorded in @d rather than exiting.
+ */
+static void write_sb(struct format_dev *d)
+{
+	static const char zeroes[SB_START];
+	struct cache_sb *sb = &d->sb;
+	uint64_t base = d->convert_base;
+	int fd = d->fd;
+	double start = now_seconds();
+
+	errno = 0;
+
+	/* Zero start of disk, or of the space a conversion leaves at its end */
+	if (pwrite(fd, zeroes, SB_START, base) != SB_START)
+		write_fail(d, "zeroing start of device");
 	/* Write superblock */
-	if (pwrite(fd, &sb, sizeof(sb), SB_START) != sizeof(sb)) {
-		perror("write error\n");
-		exit(EXIT_FAILURE);
+	if (pwrite(fd, sb, sizeof(*sb), base + SB_START) != sizeof(*sb))
+		write_fail(d, "writing superblock");
+
+	if (!SB_IS_BDEV(sb)) {
+		/* and whatever the kernel might lay out instead */
+		uint64_t end = sb->first_bucket +
+			max((unsigned) sb->njournal_buckets,
+			    default_journal_buckets(sb->nbuckets));
+
+		if (d->zone_sectors) {
+			/* resetting zones is what trims them, and zeroes them */
+			if (reset_zones(d, bucket_to_offset(sb, sb->d[0]),
+					bucket_to_offset(sb, d->trim
+							 ? sb->nbuckets : end)))
+				write_fail(d, "resetting zones");
+		} else {
+			if (d->trim && trim_device(d))
+				write_fail(d, "trimming device");
+
+			/* Zero cache device journal */
+			if (zero_range(d->dev, fd,
+				       bucket_to_offset(sb, sb->d[0]),
+				       bucket_to_offset(sb, end),
+				       CACHE_DISCARD(sb)))
+				write_fail(d, "zeroing journal");
+		}
 	}
 
-	if (!SB_IS_BDEV(&sb)) {
-		int i, end = min(sb.nbuckets, (uint64_t)sb.first_bucket
-						+ SB_JOURNAL_BUCKETS);
-
-		/* Zero cache device journal */
-		for(i = sb.first_bucket; i < end; i++) {
-			uint64_t offset = bucket_to_offset(&sb, i);
-			uint64_t len, end = bucket_to_offset(&sb, i + 1);
-			while (offset < end) {
-				len = min(end - offset, (uint64_t)SB_START);
-				if (pwrite(fd, zeroes, len, offset) != len) {
-					perror("write error\n");
-					exit(EXIT_FAILURE);
-				}
-				offset += len;
+	/*
+	 * Backups last, so a format that fails halfway doesn't leave a copy
+	 * that looks good. Without backups a stale copy from an earlier format
+	 * is zeroed, where it's reserved space: --recover mustn't find it.
+	 */
+	if (d->backup_sb) {
+		if (pwrite(fd, sb, sizeof(*sb),
+			   base + (SB_BACKUP_SECTOR << 9)) != sizeof(*sb))
+			write_fail(d, "writing backup superblock");
+		if (d->backup_end &&
+		    pwrite(fd, sb, sizeof(*sb), d->backup_end) != sizeof(*sb))
+			write_fail(d, "writing backup superblock at the end");
+	} else if (!SB_IS_BDEV(sb) ||
+		   sb->data_offset >= SB_BACKUP_SECTOR + SB_BACKUP_SIZE / 512) {
+		if (pwrite(fd, zeroes, SB_BACKUP_SIZE,
+			   base + (SB_BACKUP_SECTOR << 9)) != SB_BACKUP_SIZE)
+			write_fail(d, "zeroing backup superblock");
+	}
+
+	if (fsync(fd))
+		write_fail(d, "fsync");
+
+	if (d->convert && verify_convert(d))
+		write_fail(d, "verifying conversion");
+out:
+	close(fd);
+	d->elapsed = now_seconds() - start;
+}
+
+struct format_pool {
+	struct format_dev	*devs;
+	unsigned		ndevs;
+	unsigned		next;
+};
+
+static void *format_worker(void *arg)
+{
+	struct format_pool *pool = arg;
+	unsigned i;
+
+	while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->ndevs)
+		write_sb(&pool->devs[i]);
+
+	return NULL;
+}
+
+/*
+ * Format all devices on up to @jobs threads; with one job this is just the
+ * old serial loop, on the calling thread.
+ */
+static void format_devices(struct format_dev *devs, unsigned ndevs,
+			   unsigned jobs)
+{
+	struct format_pool pool = { .devs = devs, .ndevs = ndevs };
+	pthread_t threads[max(min(jobs, ndevs), 1U)];
+	unsigned i, started = 0;
+
+	for (i = 1; i < min(jobs, ndevs); i++) {
+		if (pthread_create(&threads[started], NULL,
+				   format_worker, &pool))
+			break;
+		started++;
+	}
+
+	format_worker(&pool);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/* Whether @dev is the same device as one of those being formatted */
+static bool formatting(const struct format_dev *devs, unsigned ndevs,
+		       const char *dev)
+{
+	struct stat a, b;
+	unsigned i;
+
+	if (stat(dev, &a))
+		return false;
+
+	for (i = 0; i < ndevs; i++)
+		if (!stat(devs[i].dev, &b) &&
+		    (S_ISBLK(a.st_mode)
+		     ? a.st_rdev == b.st_rdev
+		     : a.st_dev == b.st_dev && a.st_ino == b.st_ino))
+			return true;
+
+	return false;
+}
+
+/*
+ * The caches given are numbered 0 to nr_in_set - 1 between themselves, so
+ * with --cset-uuid naming a set that already has caches elsewhere, the
+ * positions would collide and the kernel couldn't assemble it: the caches
+ * of a set have to be formatted together. Backing devices may name any set.
+ */
+static void check_cache_set(const struct format_dev *devs, unsigned ndevs,
+			    const uuid_t set_uuid)
+{
+	struct sb_probe *probes = NULL;
+	unsigned i, n = 0, size = 0;
+	char line[256], name[128], uuid[40];
+	FILE *f;
+
+	for (i = 0; i < ndevs && devs[i].bdev; i++)
+		;
+	if (i == ndevs || !(f = fopen("/proc/partitions", "r")))
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		unsigned maj, min;
+		unsigned long long blocks;
+		char *dev;
+
+		if (sscanf(line, " %u %u %llu %127s",
+			   &maj, &min, &blocks, name) != 4)
+			continue;
+
+		if (asprintf(&dev, "/dev/%s", name) < 0)
+			break;
+		if (formatting(devs, ndevs, dev)) {
+			free(dev);
+			continue;
+		}
+
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			probes = realloc(probes, size * sizeof(*probes));
+			if (!probes) {
+				fprintf(stderr, "Out of memory\n");
+				exit(EXIT_FAILURE);
 			}
 		}
+		memset(&probes[n], 0, sizeof(probes[n]));
+		probes[n++].dev = dev;
 	}
+	fclose(f);
+
+	sb_probe_all(probes, n, 32);
+
+	for (i = 0; i < n; i++)
+		if (probes[i].status == SB_OK &&
+		    !SB_IS_BDEV(&probes[i].sb) &&
+		    !memcmp(probes[i].sb.set_uuid, set_uuid, 16)) {
+			uuid_unparse(set_uuid, uuid);
+			fprintf(stderr, "%s is already a cache in set %s; the "
+				"caches of a set have to be formatted "
+				"together\n", probes[i].dev, uuid);
+			exit(EXIT_FAILURE);
+		}
 
-	fsync(fd);
-	close(fd);
+	for (i = 0; i < n; i++)
+		free((char *) probes[i].dev);
+	free(probes);
+}
+
+static void print_cache_set(const struct format_dev *devs, unsigned ndevs)
+{
+	const struct cache_sb *sb = NULL;
+	uint64_t nbuckets = 0, sectors = 0;
+	char set_uuid_str[40];
+	unsigned i;
+
+	for (i = 0; i < ndevs; i++)
+		if (!devs[i].bdev) {
+			sb = &devs[i].sb;
+			nbuckets += sb->nbuckets - sb->first_bucket;
+			sectors	 += (uint64_t) sb->bucket_size *
+				(sb->nbuckets - sb->first_bucket);
+		}
+
+	if (!sb)
+		return;
+
+	uuid_unparse(sb->set_uuid, set_uuid_str);
+
+	printf("\nCache set:		%s\n"
+	       "nr_in_set:		%u\n"
+	       "nbuckets:		%ju\n"
+	       "capacity:		%ju MiB\n",
+	       set_uuid_str, sb->nr_in_set, nbuckets, sectors >> 11);
 }
 
 static unsigned get_blocksize(const char *path)
@@ -360,17 +1341,126 @@ static unsigned get_blocksize(const char *path)
 	return statbuf.st_blksize / 512;
 }
 
+/*
+ * Largest power of two bucket that fits in sb.bucket_size; a larger erase
+ * block or zone is still a multiple of this.
+ */
+#define MAX_BUCKET_BYTES	((uint64_t) (USHRT_MAX + 1) / 2 * 512)
+
+static void geometry_consider(const char *path, const char *what,
+			      uint64_t v, uint64_t *bucket_bytes,
+			      const char **reason, const char **reason_dev)
+{
+	if (!v)
+		return;
+
+	if (v & (v - 1)) {
+		printf("  %s %s %ju: not a power of two, ignored\n",
+		       path, what, v);
+		return;
+	}
+
+	v = min(v, MAX_BUCKET_BYTES);
+
+	if (v > *bucket_bytes) {
+		*bucket_bytes	= v;
+		*reason		= what;
+		*reason_dev	= path;
+	}
+}
+
+/*
+ * --auto-geometry: pick the smallest bucket size that is the default or
+ * larger and a multiple of every power of two I/O granularity the cache
+ * devices advertise, so buckets never straddle an erase block or zone.
+ */
+static unsigned auto_bucket_size(char * const *devs, unsigned ndevs,
+				 unsigned bucket_size)
+{
+	uint64_t bucket_bytes = (uint64_t) bucket_size << 9;
+	const char *reason = "default", *reason_dev = NULL;
+	struct dev_geometry g;
+	unsigned i;
+
+	for (i = 0; i < ndevs; i++) {
+		get_geometry(devs[i], &g);
+
+		printf("%s: logical_block_size %u physical_block_size %u "
+		       "minimum_io_size %u optimal_io_size %u "
+		       "alignment_offset %i discard_granularity %ju "
+		       "chunk_size %ju\n",
+		       devs[i], g.logical_block_size, g.physical_block_size,
+		       g.minimum_io_size, g.optimal_io_size,
+		       g.alignment_offset, g.discard_granularity,
+		       g.chunk_size);
+
+		if (g.alignment_offset < 0)
+			printf("  %s is misaligned with its underlying device; "
+			       "consider repartitioning\n", devs[i]);
+		else if (g.alignment_offset)
+			printf("  %s is misaligned by %i bytes; buckets can't "
+			       "compensate, consider repartitioning\n",
+			       devs[i], g.alignment_offset);
+
+		geometry_consider(devs[i], "physical_block_size",
+				  g.physical_block_size,
+				  &bucket_bytes, &reason, &reason_dev);
+		geometry_consider(devs[i], "minimum_io_size",
+				  g.minimum_io_size,
+				  &bucket_bytes, &reason, &reason_dev);
+		geometry_consider(devs[i], "optimal_io_size",
+				  g.optimal_io_size,
+				  &bucket_bytes, &reason, &reason_dev);
+		geometry_consider(devs[i], "discard_granularity",
+				  g.discard_granularity,
+				  &bucket_bytes, &reason, &reason_dev);
+		geometry_consider(devs[i], "chunk_size",
+				  g.chunk_size,
+				  &bucket_bytes, &reason, &reason_dev);
+	}
+
+	if (reason_dev)
+		printf("bucket_size %juk: %s of %s\n",
+		       bucket_bytes >> 10, reason, reason_dev);
+	else
+		printf("bucket_size %juk: default, no larger I/O granularity "
+		       "advertised\n", bucket_bytes >> 10);
+
+	return bucket_bytes >> 9;
+}
+
+/*
+ * --auto-geometry uses the physical block size rather than the logical one,
+ * trading transparency for never doing a read-modify-write on a full block.
+ */
+static unsigned auto_block_size(const char *path)
+{
+	struct dev_geometry g;
+
+	get_geometry(path, &g);
+	return max(g.physical_block_size, g.logical_block_size) / 512;
+}
+
 int main(int argc, char **argv)
 {
 	int c, bdev = -1;
-	unsigned i, ncache_devices = 0, nbacking_devices = 0;
+	unsigned i, ncache_devices = 0, nbacking_devices = 0, jobs = 1;
+	int trim = 0, auto_geometry = 0, no_backup_sb = 0, convert = 0;
+	bool cset_uuid_set = false;
+	uint64_t fs_size = 0;
+	uint64_t trim_chunk = 1ULL << 30;
+	unsigned journal_buckets = 0;
+	uint64_t journal_bytes = 0;
 	char *cache_devices[argc];
 	char *backing_devices[argc];
+	struct format_dev *devs;
+	unsigned ndevs, nfailed = 0;
 
-	unsigned block_size = 0, bucket_size = 1024;
+	unsigned block_size = 0, bucket_size = 0;
 	int writeback = 0, discard = 0, wipe_bcache = 0;
 	unsigned cache_replacement_policy = 0;
 	uint64_t data_offset = BDEV_DATA_START_DEFAULT;
+	bool data_offset_set = false;
 	uuid_t set_uuid;
 
 	uuid_generate(set_uuid);
@@ -388,12 +1478,20 @@ int main(int argc, char **argv)
 		{ "data_offset",	1, NULL,	'o' },
 		{ "data-offset",	1, NULL,	'o' },
 		{ "cset-uuid",		1, NULL,	'u' },
+		{ "jobs",		1, NULL,	'j' },
+		{ "trim-device",	0, &trim,		1 },
+		{ "trim-chunk",		1, NULL,	't' },
+		{ "auto-geometry",	0, &auto_geometry,	1 },
+		{ "journal-size",	1, NULL,	'J' },
+		{ "no-backup-sb",	0, &no_backup_sb,	1 },
+		{ "convert",		0, &convert,	1 },
+		{ "fs-size",		1, NULL,	'F' },
 		{ "help",		0, NULL,	'h' },
 		{ NULL,			0, NULL,	0 },
 	};
 
 	while ((c = getopt_long(argc, argv,
-				"-hCBUo:w:b:",
+				"-hCBUo:w:b:j:",
 				opts, NULL)) != -1)
 		switch (c) {
 		case 'C':
@@ -422,6 +1520,7 @@ int main(int argc, char **argv)
 			break;
 		case 'o':
 			data_offset = atoll(optarg);
+			data_offset_set = true;
 			if (data_offset < BDEV_DATA_START_DEFAULT) {
 				fprintf(stderr, "Bad data offset; minimum %d sectors\n",
 				       BDEV_DATA_START_DEFAULT);
@@ -433,6 +1532,50 @@ int main(int argc, char **argv)
 				fprintf(stderr, "Bad uuid\n");
 				exit(EXIT_FAILURE);
 			}
+			cset_uuid_set = true;
+			break;
+		case 'j': {
+			unsigned long v;
+			char *e;
+
+			errno = 0;
+			v = strtoul(optarg, &e, 10);
+			if (*optarg == '-' || *e || errno || !v || v > UINT_MAX) {
+				fprintf(stderr, "Bad number of jobs\n");
+				exit(EXIT_FAILURE);
+			}
+			jobs = v;
+			break;
+		}
+		case 't':
+			trim_chunk = hatoi(optarg);
+			if (!trim_chunk) {
+				fprintf(stderr, "Bad trim chunk size\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'J': {
+			char *e;
+
+			/* a bare number is buckets, with a unit it's bytes */
+			journal_buckets = strtoul(optarg, &e, 10);
+			if (*e) {
+				journal_buckets = 0;
+				journal_bytes = hatoi(optarg);
+			}
+
+			if (!journal_buckets && !journal_bytes) {
+				fprintf(stderr, "Bad journal size\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case 'F':
+			fs_size = hatoi(optarg);
+			if (!fs_size) {
+				fprintf(stderr, "Bad filesystem size\n");
+				exit(EXIT_FAILURE);
+			}
 			break;
 		case 'h':
 			usage();
@@ -455,32 +1598,121 @@ int main(int argc, char **argv)
 		usage();
 	}
 
-	if (bucket_size < block_size) {
-		fprintf(stderr, "Bucket size cannot be smaller than block size\n");
+	if (ncache_devices > MAX_CACHES_PER_SET) {
+		fprintf(stderr, "A cache set can have at most %u caches\n",
+			MAX_CACHES_PER_SET);
 		exit(EXIT_FAILURE);
 	}
 
 	if (!block_size) {
+		unsigned (*blocksize_fn)(const char *) = auto_geometry
+			? auto_block_size : get_blocksize;
+
 		for (i = 0; i < ncache_devices; i++)
 			block_size = max(block_size,
-					 get_blocksize(cache_devices[i]));
+					 blocksize_fn(cache_devices[i]));
 
 		for (i = 0; i < nbacking_devices; i++)
 			block_size = max(block_size,
-					 get_blocksize(backing_devices[i]));
+					 blocksize_fn(backing_devices[i]));
 	}
 
-	for (i = 0; i < ncache_devices; i++)
-		write_sb(cache_devices[i], block_size, bucket_size,
-			 writeback, discard, wipe_bcache,
-			 cache_replacement_policy,
-			 data_offset, set_uuid, false);
+	if (!bucket_size) {
+		bucket_size = 1024;
 
-	for (i = 0; i < nbacking_devices; i++)
-		write_sb(backing_devices[i], block_size, bucket_size,
-			 writeback, discard, wipe_bcache,
-			 cache_replacement_policy,
-			 data_offset, set_uuid, true);
+		if (auto_geometry && ncache_devices)
+			bucket_size = auto_bucket_size(cache_devices,
+						       ncache_devices,
+						       max(bucket_size,
+							   block_size));
+	}
 
-	return 0;
+	if (bucket_size < block_size) {
+		fprintf(stderr, "Bucket size cannot be smaller than block size\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (convert && (ncache_devices || !nbacking_devices)) {
+		fprintf(stderr, "--convert is for backing devices only\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * The filesystem is still at offset 0 of the raw device, which can be
+	 * mounted past bcache; with dirty data in the cache, that's corruption
+	 */
+	if (convert && writeback) {
+		fprintf(stderr, "--convert can't be used with --writeback: the "
+			"filesystem can still be mounted from the device itself\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ndevs = ncache_devices + nbacking_devices;
+	devs = calloc(ndevs, sizeof(*devs));
+	if (!devs) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < ncache_devices; i++) {
+		devs[i].dev		= cache_devices[i];
+		devs[i].trim		= trim;
+		devs[i].trim_chunk	= trim_chunk;
+		devs[i].progress	= jobs == 1 && isatty(STDERR_FILENO);
+		devs[i].nr_in_set	= ncache_devices;
+		devs[i].nr_this_dev	= i;
+		devs[i].journal_buckets	= journal_buckets;
+		devs[i].journal_bytes	= journal_bytes;
+		devs[i].backup_sb	= !no_backup_sb;
+	}
+
+	for (i = 0; i < nbacking_devices; i++) {
+		devs[ncache_devices + i].dev = backing_devices[i];
+		devs[ncache_devices + i].bdev = true;
+		/* the shim makes the filesystem's alignment the data's */
+		devs[ncache_devices + i].auto_data_offset =
+			!data_offset_set && !convert;
+		devs[ncache_devices + i].backup_sb = !no_backup_sb;
+		devs[ncache_devices + i].convert = convert;
+		devs[ncache_devices + i].fs_size = fs_size;
+	}
+
+	for (i = 0; i < ndevs; i++)
+		prepare_sb(&devs[i], block_size, bucket_size,
+			   writeback, discard, wipe_bcache,
+			   cache_replacement_policy,
+			   data_offset, set_uuid);
+
+	if (cset_uuid_set)
+		check_cache_set(devs, ndevs, set_uuid);
+
+	format_devices(devs, ndevs, jobs);
+
+	for (i = 0; i < ndevs; i++) {
+		if (devs[i].error) {
+			fprintf(stderr, "Error formatting %s: %s: %s\n",
+				devs[i].dev, devs[i].failed_op,
+				strerror(devs[i].error));
+			nfailed++;
+			continue;
+		}
+
+		print_sb(&devs[i]);
+	}
+
+	if (ncache_devices > 1 && !nfailed)
+		print_cache_set(devs, ndevs);
+
+	if (jobs > 1) {
+		printf("\n");
+		for (i = 0; i < ndevs; i++)
+			printf("%-24s %-8s %s %.2fs\n", devs[i].dev,
+			       devs[i].bdev ? "backing" : "cache",
+			       devs[i].error ? "FAILED" : "ok",
+			       devs[i].elapsed);
+	}
+
+	free(devs);
+
+	return nfailed ? EXIT_FAILURE : 0;
 }
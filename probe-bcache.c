@@ -24,14 +24,61 @@
 
 #include "bcache.h"
 
+/*
+ * Is there anything other than bcache on this device? This is the expensive
+ * part, so it's only done once the superblock itself has been found.
+ */
+static bool other_signature(int fd)
+{
+	blkid_probe pr;
+	bool found = true;
+
+	if (!(pr = blkid_new_probe()))
+		return true;
+	/* probe partitions too */
+	if (!blkid_probe_set_device(pr, fd, 0, 0) &&
+	    !blkid_probe_enable_partitions(pr, true))
+		/* bail if anything was found
+		 * probe-bcache isn't needed once blkid recognizes bcache */
+		found = !blkid_do_probe(pr);
+
+	blkid_free_probe(pr);
+	return found;
+}
+
+static void probe_dev(const char *dev, bool udev)
+{
+	struct cache_sb sb;
+	char uuid[40];
+	int fd = open(dev, O_RDONLY);
+
+	if (fd == -1)
+		return;
+
+	/* Fast path: almost nothing we're called on is bcache */
+	if (sb_read(fd, 0, &sb) ||
+	    sb_check(&sb) != SB_OK ||
+	    other_signature(fd))
+		goto out;
+
+	uuid_unparse(sb.uuid, uuid);
+
+	if (udev)
+		printf("ID_FS_UUID=%s\n"
+		       "ID_FS_UUID_ENC=%s\n"
+		       "ID_FS_TYPE=bcache\n",
+		       uuid, uuid);
+	else
+		printf("%s: UUID=\"%s\" TYPE=\"bcache\"\n", dev, uuid);
+out:
+	close(fd);
+}
+
 int main(int argc, char **argv)
 {
 	bool udev = false;
 	int i, o;
 	extern char *optarg;
-	struct cache_sb sb;
-	char uuid[40];
-	blkid_probe pr;
 
 	while ((o = getopt(argc, argv, "o:")) != EOF)
 		switch (o) {
@@ -48,40 +95,8 @@ int main(int argc, char **argv)
 	argv += optind;
 	argc -= optind;
 
-	for (i = 0; i < argc; i++) {
-		int fd = open(argv[i], O_RDONLY);
-		if (fd == -1)
-			continue;
-
-		if (!(pr = blkid_new_probe()))
-			continue;
-		if (blkid_probe_set_device(pr, fd, 0, 0))
-			continue;
-		/* probe partitions too */
-		if (blkid_probe_enable_partitions(pr, true))
-			continue;
-		/* bail if anything was found
-		 * probe-bcache isn't needed once blkid recognizes bcache */
-		if (!blkid_do_probe(pr)) {
-			continue;
-		}
-
-		if (pread(fd, &sb, sizeof(sb), SB_START) != sizeof(sb))
-			continue;
-
-		if (memcmp(sb.magic, bcache_magic, 16))
-			continue;
-
-		uuid_unparse(sb.uuid, uuid);
-
-		if (udev)
-			printf("ID_FS_UUID=%s\n"
-			       "ID_FS_UUID_ENC=%s\n"
-			       "ID_FS_TYPE=bcache\n",
-			       uuid, uuid);
-		else
-			printf("%s: UUID=\"\" TYPE=\"bcache\"\n", uuid);
-	}
+	for (i = 0; i < argc; i++)
+		probe_dev(argv[i], udev);
 
 	return 0;
 }